@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "yoo-ofsm.h"
 #include "poker.h"
@@ -9,21 +11,30 @@
 
 #define MAX_PTR_TO_FREE 20
 
+// Bump it when pack or hash callbacks in poker.c change their results
+#define CACHE_TAG "poker-1"
+
 
 
 int opt_check = 0;
+int opt_checkpoint = 0;
 int opt_verbose = 0;
 int opt_help = 0;
 int opt_opencl = -1;
+int opt_jobs = 1;
+unsigned int opt_memory_mb = 0;
+const char * opt_cache_dir = NULL;
+uint64_t opt_verify_samples = 0;
 
 static void * ptrs_to_free[MAX_PTR_TO_FREE];
 static int qptr_to_free = 0;
+static pthread_mutex_t ptrs_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 
 /* Utils */
 
-static int create_ofsm(const struct poker_ofsm * const poker_ofsm)
+static int create_ofsm(const struct poker_ofsm * const poker_ofsm, const unsigned int qthreads)
 {
     int status;
 
@@ -37,7 +48,34 @@ static int create_ofsm(const struct poker_ofsm * const poker_ofsm)
         ob->logstream = stdout;
     }
 
-    ob->flags |= OBF__AUTO_VERIFY;
+    if (opt_verify_samples > 0) {
+        ob->flags |= OBF__AUTO_VERIFY_SAMPLED;
+        ob->verify_samples = opt_verify_samples;
+    } else {
+        ob->flags |= OBF__AUTO_VERIFY;
+    }
+
+    ob->qthreads = qthreads;
+    ob->cache_dir = opt_cache_dir;
+    ob->cache_tag = CACHE_TAG;
+
+    char checkpoint_path[strlen(poker_ofsm->name) + 6];
+    if (opt_checkpoint) {
+        sprintf(checkpoint_path, "%s.ckpt", poker_ofsm->name);
+        ob->checkpoint_path = checkpoint_path;
+
+        FILE * const f = fopen(checkpoint_path, "rb");
+        if (f != NULL) {
+            status = ofsm_builder_load_checkpoint(ob, f);
+            fclose(f);
+            if (status != 0) {
+                fprintf(stderr, "ofsm_builder_load_checkpoint(ob, f) failed with %d as error code for %s.\n", status, checkpoint_path);
+                free_ofsm_builder(ob);
+                return 1;
+            }
+            printf("Resuming %s after %u operations from %s...\n", poker_ofsm->name, ob->qskip, checkpoint_path);
+        }
+    }
 
     printf("Creating %s...\n", poker_ofsm->name);
     status = poker_ofsm->create(ob);
@@ -47,6 +85,13 @@ static int create_ofsm(const struct poker_ofsm * const poker_ofsm)
         return 1;
     }
 
+    status = ofsm_builder_prune(ob);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_prune(ob) failed with %d as error code for %s.\n", status, poker_ofsm->signature);
+        free_ofsm_builder(ob);
+        return 1;
+    }
+
     struct ofsm_array array;
     status = ofsm_builder_make_array(ob, poker_ofsm->delta, &array);
     if (status != 0) {
@@ -57,6 +102,10 @@ static int create_ofsm(const struct poker_ofsm * const poker_ofsm)
 
     save_binary(poker_ofsm->file_name, poker_ofsm->signature, &array);
 
+    if (opt_checkpoint) {
+        remove(checkpoint_path);
+    }
+
     free(array.array);
     free_ofsm_builder(ob);
     return status;
@@ -92,12 +141,14 @@ void * global_malloc(const size_t sz)
         return NULL;
     }
 
+    pthread_mutex_lock(&ptrs_mutex);
     if (qptr_to_free < MAX_PTR_TO_FREE) {
         ptrs_to_free[qptr_to_free++] = result;
     } else {
         fprintf(stderr, "Warning: ptrs_to_free overflow, please increase MAX_PTR_TO_FREE define.\n");
         fprintf(stderr, "Warning: Current value of MAX_PTR_TO_FREE define is %d.\n", MAX_PTR_TO_FREE);
     }
+    pthread_mutex_unlock(&ptrs_mutex);
 
     return result;
 }
@@ -118,9 +169,14 @@ static void usage(void)
     printf("%s",
         "USAGE: yoo-build-poker-ofsm [OPTION] table1 [table2 ... tableN]\n"
         "  --check, -c       Run poker table verification no generation.\n"
+        "  --checkpoint      Save table.ckpt after each operation and resume from it.\n"
         "  --help, -h        Print usage and terminate.\n"
         "  --enable-opencl   Use OpenCL for verification.\n"
         "  --disable-opencl  Do not use OpenCL for verification.\n"
+        "  --jobs=N, -j N    Build up to N independent tables concurrently, cores are shared.\n"
+        "  --memory=MB       Do not start a table if estimated memory of running ones exceeds MB.\n"
+        "  --cache=DIR       Reuse results of builder operations stored in DIR.\n"
+        "  --verify-samples=N  Verify only N random paths of every flake after each operation.\n"
         "  --verbose, -v     Output an extended logging information to stderr.\n"
     );
 }
@@ -129,16 +185,21 @@ static int parse_command_line(int argc, char * argv[])
 {
     static const struct option long_options[] = {
         { "check", no_argument, &opt_check, 1 },
+        { "checkpoint", no_argument, &opt_checkpoint, 1 },
         { "help",  no_argument, &opt_help, 1},
         { "enable-opencl", no_argument, &opt_opencl, 1},
         { "disable-opencl", no_argument, &opt_opencl, 0},
         { "verbose", no_argument, &opt_verbose, 1 },
+        { "jobs", required_argument, NULL, 'j' },
+        { "memory", required_argument, NULL, 'm' },
+        { "cache", required_argument, NULL, 'C' },
+        { "verify-samples", required_argument, NULL, 'S' },
         { NULL, 0, NULL, 0 }
     };
 
     for (;;) {
         int index = 0;
-        const int c = getopt_long(argc, argv, "hcv", long_options, &index);
+        const int c = getopt_long(argc, argv, "hcvj:", long_options, &index);
         if (c == -1) break;
 
         if (c != 0) {
@@ -152,6 +213,22 @@ static int parse_command_line(int argc, char * argv[])
                 case 'v':
                     opt_verbose = 1;
                     break;
+                case 'j':
+                    opt_jobs = atoi(optarg);
+                    if (opt_jobs <= 0) {
+                        fprintf(stderr, "Invalid jobs count “%s”.\n", optarg);
+                        return -1;
+                    }
+                    break;
+                case 'm':
+                    opt_memory_mb = strtoul(optarg, NULL, 10);
+                    break;
+                case 'C':
+                    opt_cache_dir = optarg;
+                    break;
+                case 'S':
+                    opt_verify_samples = strtoull(optarg, NULL, 10);
+                    break;
                  case '?':
                     fprintf(stderr, "Invalid option.\n");
                     return -1;
@@ -169,23 +246,37 @@ static int parse_command_line(int argc, char * argv[])
 
 /* Poker table to generate/check */
 
-#define POKER_OFSM(arg_name, arg_signature, arg_delta, arg_create, arg_check) { \
+#define POKER_OFSM(arg_name, arg_signature, arg_delta, arg_create, arg_check, arg_depends_on, arg_memory_mb) { \
     .name = arg_name, \
     .file_name = arg_name ".bin", \
     .signature =arg_signature, \
     .delta = arg_delta, \
     .create = arg_create, \
-    .check = arg_check }
+    .check = arg_check, \
+    .depends_on = arg_depends_on, \
+    .memory_mb = arg_memory_mb }
 
+// Memory is a rough estimate of the peak builder usage
 const struct poker_ofsm poker_ofsms[] = {
-    POKER_OFSM("six-plus-5", "OFSM Six Plus 5", 1, create_six_plus_5, check_six_plus_5),
-    POKER_OFSM("six-plus-7", "OFSM Six Plus 7", 0, create_six_plus_7, check_six_plus_7),
-    POKER_OFSM("texas-5", "OFSM Texas 5", 1, create_texas_5, check_texas_5),
-    POKER_OFSM("texas-7", "OFSM Texas 7", 0, create_texas_7, check_texas_7),
-    POKER_OFSM("omaha-7", "OFSM Omaha 7", 0, create_omaha_7, check_omaha_7),
-    { NULL, NULL, NULL, 0, NULL, NULL }
+    POKER_OFSM("six-plus-5", "OFSM Six Plus 5", 1, create_six_plus_5, check_six_plus_5, NULL, 64),
+    POKER_OFSM("six-plus-7", "OFSM Six Plus 7", 0, create_six_plus_7, check_six_plus_7, "six-plus-5", 1024),
+    POKER_OFSM("texas-5", "OFSM Texas 5", 1, create_texas_5, check_texas_5, NULL, 128),
+    POKER_OFSM("texas-7", "OFSM Texas 7", 0, create_texas_7, check_texas_7, "texas-5", 4096),
+    POKER_OFSM("omaha-7", "OFSM Omaha 7", 0, create_omaha_7, check_omaha_7, "texas-5", 8192),
+    { NULL, NULL, NULL, 0, NULL, NULL, NULL, 0 }
 };
 
+static const struct poker_ofsm * find_table(const char * const name)
+{
+    const struct poker_ofsm * entry = poker_ofsms;
+    for (; entry->name != NULL; ++entry) {
+        if (strcmp(name, entry->name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
 static void print_table_names(void)
 {
     const struct poker_ofsm * entry = poker_ofsms;
@@ -234,6 +325,180 @@ static void print_table_names(void)
 
 
 
+/* Build scheduler */
+
+struct build_task
+{
+    const struct poker_ofsm * table;
+    int dependency;
+    int status;
+};
+
+struct build_queue
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct build_task * tasks;
+    int qtasks;
+    unsigned int memory_mb;
+    int qrunning;
+    unsigned int qthreads;
+};
+
+static struct build_task * take_ready_task(struct build_queue * restrict const queue, int * restrict const is_finished)
+{
+    *is_finished = 1;
+
+    for (int i=0; i<queue->qtasks; ++i) {
+        struct build_task * restrict const task = queue->tasks + i;
+        if (task->status == STATUS__EXECUTING) {
+            *is_finished = 0;
+        }
+
+        if (task->status != STATUS__NEW) {
+            continue;
+        }
+
+        const int dependency_status = task->dependency >= 0 ? queue->tasks[task->dependency].status : STATUS__DONE;
+        if (dependency_status == STATUS__FAILED) {
+            fprintf(stderr, "Skip %s because %s failed.\n", task->table->name, queue->tasks[task->dependency].table->name);
+            task->status = STATUS__FAILED;
+            pthread_cond_broadcast(&queue->cond);
+            continue;
+        }
+
+        *is_finished = 0;
+        if (dependency_status != STATUS__DONE) {
+            continue;
+        }
+
+        const int is_fit = opt_memory_mb == 0 || queue->qrunning == 0 || queue->memory_mb + task->table->memory_mb <= opt_memory_mb;
+        if (!is_fit) {
+            continue;
+        }
+
+        task->status = STATUS__EXECUTING;
+        queue->memory_mb += task->table->memory_mb;
+        ++queue->qrunning;
+        return task;
+    }
+
+    return NULL;
+}
+
+static void * build_worker(void * const arg)
+{
+    struct build_queue * restrict const queue = arg;
+
+    pthread_mutex_lock(&queue->mutex);
+    for (;;) {
+        int is_finished;
+        struct build_task * restrict const task = take_ready_task(queue, &is_finished);
+        if (task == NULL) {
+            if (is_finished) {
+                break;
+            }
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&queue->mutex);
+        const int status = create_ofsm(task->table, queue->qthreads);
+        pthread_mutex_lock(&queue->mutex);
+
+        task->status = status == 0 ? STATUS__DONE : STATUS__FAILED;
+        queue->memory_mb -= task->table->memory_mb;
+        --queue->qrunning;
+        pthread_cond_broadcast(&queue->cond);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return NULL;
+}
+
+static int build_tables(const int qcalls, const struct poker_ofsm * const * const call_list)
+{
+    struct build_task tasks[2 * qcalls];
+    int qtasks = 0;
+
+    for (int i=0; i<qcalls; ++i) {
+        int is_duplicate = 0;
+        for (int j=0; j<qtasks; ++j) {
+            is_duplicate |= tasks[j].table == call_list[i];
+        }
+
+        if (!is_duplicate) {
+            tasks[qtasks].table = call_list[i];
+            tasks[qtasks].dependency = -1;
+            tasks[qtasks].status = STATUS__NEW;
+            ++qtasks;
+        }
+    }
+
+    const int qrequested = qtasks;
+
+    // Missing inputs are built first, existing files are just loaded by dependents
+    for (int i=0; i<qrequested; ++i) {
+        const char * const depends_on = tasks[i].table->depends_on;
+        if (depends_on == NULL) {
+            continue;
+        }
+
+        for (int j=0; j<qtasks; ++j) {
+            if (strcmp(tasks[j].table->name, depends_on) == 0) {
+                tasks[i].dependency = j;
+                break;
+            }
+        }
+
+        const struct poker_ofsm * const dependency = find_table(depends_on);
+        if (tasks[i].dependency < 0 && access(dependency->file_name, F_OK) != 0) {
+            tasks[qtasks].table = dependency;
+            tasks[qtasks].dependency = -1;
+            tasks[qtasks].status = STATUS__NEW;
+            tasks[i].dependency = qtasks++;
+        }
+    }
+
+    const long qcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const int qworkers = opt_jobs < qtasks ? opt_jobs : qtasks;
+
+    struct build_queue queue = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .tasks = tasks,
+        .qtasks = qtasks,
+        .memory_mb = 0,
+        .qrunning = 0,
+        .qthreads = qworkers > 1 && qcpus > qworkers ? qcpus / qworkers : qworkers > 1 ? 1 : 0,
+    };
+
+    pthread_t threads[qworkers];
+    int qstarted = 0;
+    for (; qstarted < qworkers - 1; ++qstarted) {
+        if (pthread_create(threads + qstarted, NULL, build_worker, &queue) != 0) {
+            fprintf(stderr, "Warning: pthread_create failed, continue with %d jobs.\n", qstarted + 1);
+            break;
+        }
+    }
+
+    build_worker(&queue);
+
+    for (int i=0; i<qstarted; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i=0; i<qtasks; ++i) {
+        if (tasks[i].status != STATUS__DONE) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
 int main(int argc, char * argv[])
 {
     const int first_arg = parse_command_line(argc, argv);
@@ -264,17 +529,10 @@ int main(int argc, char * argv[])
     const struct poker_ofsm * call_list[qcalls];
     for (int i=0; i<qcalls; ++i) {
         const char * const table_name = argv[first_arg + i];
-        const struct poker_ofsm * entry = poker_ofsms;
-        for (;; ++entry) {
-            if (entry->name == NULL) {
-                ++qerrors;
-                fprintf(stderr, "Table name “%s” is not found.\n", table_name);
-                break;
-            }
-            if (strcmp(table_name, entry->name) == 0) {
-                call_list[i] = entry;
-                break;
-            }
+        call_list[i] = find_table(table_name);
+        if (call_list[i] == NULL) {
+            ++qerrors;
+            fprintf(stderr, "Table name “%s” is not found.\n", table_name);
         }
     }
 
@@ -293,13 +551,7 @@ int main(int argc, char * argv[])
             }
         }
     } else {
-        for (int j=0; j<qcalls; ++j) {
-            const int status = create_ofsm(call_list[j]);
-            if (status != 0) {
-                exit_code = 1;
-                break;
-            }
-        }
+        exit_code = build_tables(qcalls, call_list);
     }
 
     global_free();
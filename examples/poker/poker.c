@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "yoo-combinatoric.h"
@@ -325,39 +326,52 @@ static void * load_fsm(const char * const filename, const char * const signature
     return ptr;
 }
 
+// Tables might be built concurrently, the first user loads the shared one
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static void load_six_plus_fsm5(void)
 {
-    if (six_plus_fsm5 != NULL) return;
-
-    six_plus_fsm5 = load_fsm("six-plus-5.bin", "OFSM Six Plus 5", 36, 5, &six_plus_fsm5_sz);
+    pthread_mutex_lock(&load_mutex);
+    if (six_plus_fsm5 == NULL) {
+        six_plus_fsm5 = load_fsm("six-plus-5.bin", "OFSM Six Plus 5", 36, 5, &six_plus_fsm5_sz);
+    }
+    pthread_mutex_unlock(&load_mutex);
 }
 
 static void load_six_plus_fsm7(void)
 {
-    if (six_plus_fsm7 != NULL) return;
-
-    six_plus_fsm7 = load_fsm("six-plus-7.bin", "OFSM Six Plus 7", 36, 7, &six_plus_fsm7_sz);
+    pthread_mutex_lock(&load_mutex);
+    if (six_plus_fsm7 == NULL) {
+        six_plus_fsm7 = load_fsm("six-plus-7.bin", "OFSM Six Plus 7", 36, 7, &six_plus_fsm7_sz);
+    }
+    pthread_mutex_unlock(&load_mutex);
 }
 
 static void load_texas_fsm5(void)
 {
-    if (texas_fsm5 != NULL) return;
-
-    texas_fsm5 = load_fsm("texas-5.bin", "OFSM Texas 5", 52, 5, &texas_fsm5_sz);
+    pthread_mutex_lock(&load_mutex);
+    if (texas_fsm5 == NULL) {
+        texas_fsm5 = load_fsm("texas-5.bin", "OFSM Texas 5", 52, 5, &texas_fsm5_sz);
+    }
+    pthread_mutex_unlock(&load_mutex);
 }
 
 static void load_texas_fsm7(void)
 {
-    if (texas_fsm7 != NULL) return;
-
-    texas_fsm7 = load_fsm("texas-7.bin", "OFSM Texas 7", 52, 7, &texas_fsm7_sz);
+    pthread_mutex_lock(&load_mutex);
+    if (texas_fsm7 == NULL) {
+        texas_fsm7 = load_fsm("texas-7.bin", "OFSM Texas 7", 52, 7, &texas_fsm7_sz);
+    }
+    pthread_mutex_unlock(&load_mutex);
 }
 
 static void load_omaha_fsm7(void)
 {
-    if (omaha_fsm7 != NULL) return;
-
-    omaha_fsm7 = load_fsm("omaha-7.bin", "OFSM Omaha 7", 52, 7, &omaha_fsm7_sz);
+    pthread_mutex_lock(&load_mutex);
+    if (omaha_fsm7 == NULL) {
+        omaha_fsm7 = load_fsm("omaha-7.bin", "OFSM Omaha 7", 52, 7, &omaha_fsm7_sz);
+    }
+    pthread_mutex_unlock(&load_mutex);
 }
 
 
@@ -553,6 +567,9 @@ static uint32_t eval_via_perm(eval_rank_f eval, const card_t * const cards, cons
 
 /* Creating OFSMs */
 
+// Build cache reuses results of callback operations only for named callbacks
+#define NAME_CALLBACK(ob, f) ofsm_builder_name_callback(ob, (const void *)(f), #f)
+
 pack_value_t calc_six_plus_5(void * const user_data, const unsigned int n, const input_t * const input)
 {
     if (n != 5) {
@@ -569,6 +586,7 @@ int create_six_plus_5(struct ofsm_builder * restrict const ob)
 {
     return 0
         || ofsm_builder_push_comb(ob, 36, 5)
+        || NAME_CALLBACK(ob, calc_six_plus_5)
         || ofsm_builder_pack(ob, calc_six_plus_5, 0)
         || ofsm_builder_optimize(ob, 5, 0, NULL)
     ;
@@ -604,8 +622,11 @@ int create_six_plus_7(struct ofsm_builder * restrict const ob)
 
     return 0
         || ofsm_builder_push_comb(ob, 36, 7)
+        || NAME_CALLBACK(ob, calc_six_plus_7)
         || ofsm_builder_pack(ob, calc_six_plus_7, PACK_FLAG__SKIP_RENUMERING)
+        || NAME_CALLBACK(ob, calc_six_plus_7_flake_7_hash)
         || ofsm_builder_optimize(ob, 7, 1, calc_six_plus_7_flake_7_hash)
+        || NAME_CALLBACK(ob, calc_six_plus_7_flake_6_hash)
         || ofsm_builder_optimize(ob, 6, 1, calc_six_plus_7_flake_6_hash)
         || ofsm_builder_optimize(ob, 7, 0, NULL)
     ;
@@ -634,7 +655,9 @@ int create_texas_5(struct ofsm_builder * restrict const ob)
 {
     return 0
         || ofsm_builder_push_comb(ob, 52, 5)
+        || NAME_CALLBACK(ob, calc_texas_5)
         || ofsm_builder_pack(ob, calc_texas_5, 0)
+        || NAME_CALLBACK(ob, calc_texas_5_flake_5_hash)
         || ofsm_builder_optimize(ob, 5, 1, calc_texas_5_flake_5_hash)
         || ofsm_builder_optimize(ob, 5, 0, NULL)
     ;
@@ -670,7 +693,9 @@ int create_texas_7(struct ofsm_builder * restrict const ob)
 
     return 0
         || ofsm_builder_push_comb(ob, 52, 7)
+        || NAME_CALLBACK(ob, calc_texas_7)
         || ofsm_builder_pack(ob, calc_texas_7, PACK_FLAG__SKIP_RENUMERING)
+        || NAME_CALLBACK(ob, calc_texas_7_flake_7_hash)
         || ofsm_builder_optimize(ob, 7, 1, calc_texas_7_flake_7_hash)
         || ofsm_builder_optimize(ob, 7, 0, NULL)
     ;
@@ -719,13 +744,26 @@ int create_omaha_7(struct ofsm_builder * restrict const ob)
 {
     load_texas_fsm5();
 
-    return 0
+    // Board and hand parts are independent, they are built concurrently before the product
+    ob->flags |= OBF__DEFERRED;
+
+    const int status = 0
         || ofsm_builder_push_comb(ob, 52, 5)
+        || NAME_CALLBACK(ob, calc_omaha_7_flake_5_pack)
         || ofsm_builder_pack(ob, calc_omaha_7_flake_5_pack, 0)
         || ofsm_builder_optimize(ob, 5, 0, NULL)
         || ofsm_builder_push_comb(ob, 52, 2)
         || ofsm_builder_product(ob)
+    ;
+
+    ob->flags &= ~OBF__DEFERRED;
+
+    return 0
+        || status
+        || ofsm_builder_execute(ob)
+        || NAME_CALLBACK(ob, calc_omaha_7)
         || ofsm_builder_pack(ob, calc_omaha_7, PACK_FLAG__SKIP_RENUMERING)
+        || NAME_CALLBACK(ob, calc_omaha_7_flake_7_hash)
         || ofsm_builder_optimize(ob, 7, 1, calc_omaha_7_flake_7_hash)
         || ofsm_builder_optimize(ob, 7, 0, NULL)
     ;
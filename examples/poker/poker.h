@@ -93,6 +93,8 @@ struct poker_ofsm
     int delta;
     create_func create;
     check_func check;
+    const char * depends_on;
+    unsigned int memory_mb;
 };
 
 
@@ -20,11 +20,28 @@
 #define INVALID_HASH (~0ull)
 
 #define OFSM_STACK_SZ   16
+#define OFSM_RECIPE_SZ  32
 
 #define PACK_FLAG__SKIP_RENUMERING     1
 
-#define OBF__OWN_MEMPOOL    1
-#define OBF__AUTO_VERIFY    2
+#define EXPORT_FLAG__COMPRESS_INPUTS    1
+#define EXPORT_FLAG__ORDERED_INPUTS     2
+
+// Set in array_header.qflakes when input class tables follow the array, readers of plain arrays reject such files
+#define ARRAY_HEADER__CLASSES   0x80000000u
+// Set in array_header.qflakes for arrays exported with EXPORT_FLAG__ORDERED_INPUTS, their rows are biased and trimmed
+#define ARRAY_HEADER__ORDERED   0x40000000u
+
+#define OBF__OWN_MEMPOOL            1
+#define OBF__AUTO_VERIFY            2
+#define OBF__DEFERRED               4
+#define OBF__AUTO_VERIFY_SAMPLED    8
+
+#define STATUS__NEW           1
+#define STATUS__EXECUTING     2
+#define STATUS__FAILED        3
+#define STATUS__INTERRUPTED   4
+#define STATUS__DONE          5
 
 
 
@@ -34,6 +51,9 @@ struct ofsm_array
     uint32_t qflakes;
     uint64_t len;
     uint32_t * array;
+    uint32_t classes_width;
+    uint8_t * classes;
+    uint32_t flags;
 };
 
 struct array_header
@@ -47,10 +67,40 @@ struct array_header
 
 
 typedef pack_value_t pack_func(void * user_data, unsigned int n, const input_t * path);
+typedef void pack_multi_func(void * user_data, unsigned int n, const input_t * path, pack_value_t * values);
+typedef state_t jump_func(void * user_data, unsigned int nflake, state_t state, input_t input);
+typedef int pack_key_func(void * user_data, unsigned int n, const input_t * path, void * key);
 typedef uint64_t hash_func(void * user_data, const unsigned int qjumps, const state_t * jumps, const unsigned int path_len, const input_t * path);
+typedef int hash_key_func(void * user_data, const unsigned int qjumps, const state_t * jumps, const unsigned int path_len, const input_t * path, void * key);
 
 
 
+struct ofsm_tune_hash
+{
+    hash_func * f;
+    unsigned int nflake;
+};
+
+struct ofsm_recipe_step
+{
+    unsigned int nflake;
+    unsigned int qflakes;
+    hash_func * f;
+    unsigned int nhash;
+};
+
+struct ofsm_recipe
+{
+    unsigned int qsteps;
+    struct ofsm_recipe_step steps[OFSM_RECIPE_SZ];
+    uint64_t base_len;
+    uint64_t len;
+};
+
+
+
+struct ofsm_async;
+
 struct ofsm_builder
 {
     struct mempool * restrict mempool;
@@ -60,33 +110,86 @@ struct ofsm_builder
     void * stack[OFSM_STACK_SZ];
     unsigned int stack_len;
     void * user_data;
+    unsigned int qthreads;
     struct choose_table choose;
+    const char * checkpoint_path;
+    unsigned int qops;
+    unsigned int qskip;
+    struct ofsm_async * async;
+    void * deferred;
+    const char * cache_dir;
+    const char * cache_tag;
+    uint64_t stack_digest;
+    uint64_t pending_digest;
+    int pending_cache;
+    void * callback_names;
+    const char * shard_dir;
+    unsigned int qshards;
+    uint64_t verify_samples;
+    double verify_seconds;
 };
 
+typedef int builder_task_func(struct ofsm_builder * me, void * args);
+
 
 
 struct ofsm_builder * create_ofsm_builder(struct mempool * restrict const arg_mempool, FILE * const errstream);
 void free_ofsm_builder(struct ofsm_builder * restrict const me);
 int ofsm_builder_make_array(const struct ofsm_builder * const me, const unsigned int delta_last, struct ofsm_array * restrict const out);
+int ofsm_builder_export_array(const struct ofsm_builder * const me, const unsigned int delta_last, const unsigned int flags, struct ofsm_array * restrict const out);
 
 int ofsm_builder_push_pow(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m);
 int ofsm_builder_push_comb(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m);
+int ofsm_builder_push_ordered_comb(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m);
+// States returned by f are renumbered in increasing order without unused ones, f always gets states as it returned them
+int ofsm_builder_push_custom(struct ofsm_builder * restrict const me, const unsigned int m, const input_t * const qinputs, jump_func f);
+int ofsm_builder_push_array(struct ofsm_builder * restrict const me, const struct ofsm_array * const array, const input_t * const qinputs, const unsigned int delta_last);
+int ofsm_builder_dup(struct ofsm_builder * restrict const me);
+int ofsm_builder_drop(struct ofsm_builder * restrict const me);
 int ofsm_builder_product(struct ofsm_builder * restrict const me);
+int ofsm_builder_nary_product(struct ofsm_builder * restrict const me, const unsigned int qitems, pack_func f, const unsigned int flags);
+int ofsm_builder_compose(struct ofsm_builder * restrict const me);
 int ofsm_builder_pack(struct ofsm_builder * restrict const me, pack_func f, const unsigned int flags);
+// Error is the mean squared distance to bucket centers, NAN when the result is restored from a checkpoint or a cache
+int ofsm_builder_pack_buckets(struct ofsm_builder * restrict const me, pack_func f, const unsigned int qbuckets, double * restrict const error);
+int ofsm_builder_pack_multi(struct ofsm_builder * restrict const me, pack_multi_func f, const unsigned int qvalues);
+int ofsm_builder_pack_key(struct ofsm_builder * restrict const me, pack_key_func f, const size_t key_sz);
 int ofsm_builder_optimize(struct ofsm_builder * restrict const me, const unsigned int nflake, unsigned int qflakes, hash_func f);
+int ofsm_builder_optimize_key(struct ofsm_builder * restrict const me, const unsigned int nflake, unsigned int qflakes, hash_key_func f, const size_t key_sz);
+int ofsm_builder_split(struct ofsm_builder * restrict const me, const unsigned int nflake, const input_t qinputs1, const input_t qinputs2, const input_t * const table);
+int ofsm_builder_permute(struct ofsm_builder * restrict const me, const unsigned int * const order);
+int ofsm_builder_fuse(struct ofsm_builder * restrict const me, const unsigned int nflake, const unsigned int qflakes);
+int ofsm_builder_prune(struct ofsm_builder * restrict const me);
+// With OBF__DEFERRED operations only record their arguments: order, table, array, qinputs and error pointers must stay valid until ofsm_builder_execute
+int ofsm_builder_execute(struct ofsm_builder * restrict const me);
 int ofsm_builder_verify(const struct ofsm_builder * const me);
+int ofsm_builder_verify_sampled(const struct ofsm_builder * const me, const uint64_t qsamples, const double seconds, uint64_t * restrict const qchecked);
+int ofsm_builder_start(struct ofsm_builder * restrict const me, builder_task_func f, void * const args);
+// Progress is a fraction of the current step only: a pack, an optimized flake or a verification pass restarts it from zero
+int ofsm_builder_get_status(const struct ofsm_builder * const me, double * restrict const progress);
+void ofsm_builder_cancel(struct ofsm_builder * restrict const me);
+int ofsm_builder_wait(struct ofsm_builder * restrict const me);
+int ofsm_builder_save_checkpoint(const struct ofsm_builder * const me, FILE * const f);
+int ofsm_builder_load_checkpoint(struct ofsm_builder * restrict const me, FILE * const f);
+int ofsm_builder_name_callback(struct ofsm_builder * restrict const me, const void * const f, const char * const name);
+int ofsm_builder_autotune(struct ofsm_builder * restrict const me, const unsigned int qhashes, const struct ofsm_tune_hash * const hashes, const unsigned int export_flags, struct ofsm_recipe * restrict const recipe);
+int ofsm_builder_apply_recipe(struct ofsm_builder * restrict const me, const struct ofsm_recipe * const recipe);
 
 
 
 const void * ofsm_builder_get_ofsm(const struct ofsm_builder * const me);
 const input_t * ofsm_get_path(const void * ofsm, unsigned int nflake, state_t output);
 state_t ofsm_execute(const void * const ofsm, const unsigned int n, const input_t * const inputs);
+const pack_value_t * ofsm_get_records(const void * const ofsm, unsigned int * restrict const qvalues, state_t * restrict const qrecords);
 int ofsm_get_array(const void * const ofsm, const unsigned int delta_last, struct ofsm_array * restrict const out);
+int ofsm_export_array(const void * const ofsm, const unsigned int delta_last, const unsigned int flags, struct ofsm_array * restrict const out);
 
 
 
 int ofsm_array_print(const struct ofsm_array * const array, FILE * const f, const char * const name, const unsigned int arg_qcolumns);
 int ofsm_array_save_binary(const struct ofsm_array * const array, FILE * f, const char * const name);
+// Name buffer, when not NULL, must hold 17 bytes: 16 bytes of the header name and the terminating zero
+int ofsm_array_load_binary(struct ofsm_array * restrict const array, FILE * f, char * const name);
 
 
 
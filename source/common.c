@@ -4,17 +4,20 @@
 #include <yoo-combinatoric.h>
 
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 
 
-#define STATUS__NEW           1
-#define STATUS__EXECUTING     2
-#define STATUS__FAILED        3
-#define STATUS__INTERRUPTED   4
-#define STATUS__DONE          5
+#define FLAKE_FLAG__FUSE_NEXT   1
 
 
 
@@ -25,6 +28,10 @@ struct flake
     state_t qoutputs;
     state_t * jumps[2];
     input_t * paths[2];
+    unsigned int flags;
+    unsigned int * jump_refs;
+    unsigned int * path_refs;
+    int is_verified;
 };
 
 struct ofsm
@@ -32,6 +39,9 @@ struct ofsm
     unsigned int qflakes;
     unsigned int max_flakes;
     struct flake * flakes;
+    unsigned int qvalues;
+    state_t qrecords;
+    pack_value_t * records;
 };
 
 struct ofsm_pack_decode {
@@ -47,9 +57,98 @@ struct state_info
     state_t index;
 };
 
+typedef int chunk_func(void * args, uint64_t start, uint64_t finish);
+
+struct parallel_task
+{
+    chunk_func * f;
+    void * args;
+    uint64_t total;
+    uint64_t chunk_sz;
+    uint64_t next;
+    int status;
+    struct ofsm_async * async;
+};
+
+struct ofsm_async
+{
+    pthread_t thread;
+    int is_joinable;
+    int status;
+    int result;
+    int cancel;
+    uint64_t done;
+    uint64_t total;
+    builder_task_func * f;
+    void * args;
+    struct ofsm_builder * me;
+};
+
+#define OP__PUSH_POW            1
+#define OP__PUSH_COMB           2
+#define OP__PUSH_ORDERED_COMB   3
+#define OP__PUSH_CUSTOM         4
+#define OP__PUSH_ARRAY          5
+#define OP__PRODUCT             6
+#define OP__NARY_PRODUCT        7
+#define OP__COMPOSE             8
+#define OP__PACK                9
+#define OP__PACK_BUCKETS       10
+#define OP__PACK_MULTI         11
+#define OP__PACK_KEY           12
+#define OP__OPTIMIZE           13
+#define OP__OPTIMIZE_KEY       14
+#define OP__SPLIT              15
+#define OP__PERMUTE            16
+#define OP__FUSE               17
+#define OP__PRUNE              18
+#define OP__DUP                19
+#define OP__DROP               20
+
+#define NODE__EXISTING  1
+#define NODE__PUSH      2
+#define NODE__COMBINE   3
+
+struct builder_op
+{
+    int code;
+    input_t qinputs;
+    input_t qinputs2;
+    unsigned int m;
+    unsigned int n;
+    size_t key_sz;
+    const void * ptr;
+    const void * ptr2;
+    double * error;
+    union {
+        jump_func * jump;
+        pack_func * pack;
+        pack_multi_func * pack_multi;
+        pack_key_func * pack_key;
+        hash_func * hash;
+        hash_key_func * hash_key;
+    } f;
+    unsigned int next;
+};
+
+struct deferred_list
+{
+    struct builder_op * ops;
+    unsigned int qops;
+    unsigned int max_ops;
+};
+
+struct callback_names
+{
+    const void ** funcs;
+    char ** names;
+    unsigned int qnames;
+    unsigned int max_names;
+};
 
 
-static const struct flake zero_flake = { 0, 0, 1, { NULL, NULL }, { NULL, NULL } };
+
+static const struct flake zero_flake = { 0, 0, 1, { NULL, NULL }, { NULL, NULL }, 0, NULL, NULL, 0 };
 
 
 
@@ -79,6 +178,50 @@ static int cmp_state_info(const void * const arg_a, const void * const arg_b)
 
 
 
+struct key_sort_args
+{
+    const uint8_t * keys;
+    size_t key_sz;
+};
+
+static int cmp_key_bytes(const void * const arg_a, const void * const arg_b, void * const arg)
+{
+    const struct key_sort_args * const args = arg;
+    const state_t a = *(const state_t *)arg_a;
+    const state_t b = *(const state_t *)arg_b;
+    const int cmp = memcmp(args->keys + a * args->key_sz, args->keys + b * args->key_sz, args->key_sz);
+    if (cmp != 0) return cmp;
+    if (a < b) return -1;
+    if (a > b) return +1;
+    return 0;
+}
+
+static int cmp_key_words(const void * const arg_a, const void * const arg_b, void * const arg)
+{
+    // Keys are compared as big-endian 64-bit words, it gives the same order as memcmp. Only little-endian hosts swap bytes.
+    const struct key_sort_args * const args = arg;
+    const state_t a = *(const state_t *)arg_a;
+    const state_t b = *(const state_t *)arg_b;
+    const uint8_t * const ka = args->keys + a * args->key_sz;
+    const uint8_t * const kb = args->keys + b * args->key_sz;
+    for (size_t i = 0; i < args->key_sz; i += sizeof(uint64_t)) {
+        uint64_t wa, wb;
+        memcpy(&wa, ka + i, sizeof(uint64_t));
+        memcpy(&wb, kb + i, sizeof(uint64_t));
+        if (wa == wb) continue;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        wa = __builtin_bswap64(wa);
+        wb = __builtin_bswap64(wb);
+#endif
+        return wa < wb ? -1 : +1;
+    }
+    if (a < b) return -1;
+    if (a > b) return +1;
+    return 0;
+}
+
+
+
 /* Utils */
 
 static int calc_paths(const struct flake * const flake, const unsigned int nflake)
@@ -118,6 +261,11 @@ static int calc_paths(const struct flake * const flake, const unsigned int nflak
         // Common version
         for (state_t state=0; state<qstates; ++state) {
             const input_t * const base = prev->paths[1] + state * (nflake-1);
+            if (base[0] == INVALID_INPUT) {
+                // Unreachable state, there is no path to continue
+                data_ptr += qinputs;
+                continue;
+            }
             for (input_t input=0; input < qinputs; ++input) {
                 const state_t output = *data_ptr++;
                 if (output == INVALID_STATE) continue;
@@ -132,6 +280,7 @@ static int calc_paths(const struct flake * const flake, const unsigned int nflak
         // Optimized version, only one state, no copying previous paths
         for (input_t input=0; input < qinputs; ++input) {
             const state_t output = *data_ptr++;
+            if (output == INVALID_STATE) continue;
             input_t * restrict const ptr = flake->paths[1] + output;
             *ptr = input;
         }
@@ -142,6 +291,132 @@ static int calc_paths(const struct flake * const flake, const unsigned int nflak
 
 
 
+static uint64_t calc_key_groups(const uint8_t * const keys, const size_t key_sz, state_t * restrict const order, const state_t qorder, uint64_t * restrict const groups)
+{
+    struct key_sort_args args = { keys, key_sz };
+    const int is_words = key_sz % sizeof(uint64_t) == 0;
+    qsort_r(order, qorder, sizeof(state_t), is_words ? cmp_key_words : cmp_key_bytes, &args);
+
+    uint64_t qgroups = 0;
+    const uint8_t * prev = NULL;
+    for (state_t i = 0; i < qorder; ++i) {
+        const uint8_t * const key = keys + order[i] * key_sz;
+        if (prev == NULL || memcmp(prev, key, key_sz) != 0) {
+            ++qgroups;
+            prev = key;
+        }
+        groups[order[i]] = qgroups - 1;
+    }
+
+    return qgroups;
+}
+
+
+
+/* Progress and cancellation */
+
+static void progress_start(const struct ofsm_builder * const me, const uint64_t total)
+{
+    __atomic_store_n(&me->async->done, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&me->async->total, total, __ATOMIC_RELAXED);
+}
+
+static void progress_add(const struct ofsm_builder * const me, const uint64_t done)
+{
+    __atomic_fetch_add(&me->async->done, done, __ATOMIC_RELAXED);
+}
+
+static void progress_finish(const struct ofsm_builder * const me)
+{
+    __atomic_store_n(&me->async->done, __atomic_load_n(&me->async->total, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+static int is_cancelled(const struct ofsm_builder * const me)
+{
+    return __atomic_load_n(&me->async->cancel, __ATOMIC_RELAXED);
+}
+
+
+
+/* Parallel execution */
+
+static void * parallel_worker(void * const arg)
+{
+    struct parallel_task * restrict const task = arg;
+
+    for (;;) {
+        if (__atomic_load_n(&task->status, __ATOMIC_RELAXED) != 0) {
+            break;
+        }
+
+        if (__atomic_load_n(&task->async->cancel, __ATOMIC_RELAXED) != 0) {
+            __atomic_store_n(&task->status, STATUS__INTERRUPTED, __ATOMIC_RELAXED);
+            break;
+        }
+
+        const uint64_t start = __atomic_fetch_add(&task->next, task->chunk_sz, __ATOMIC_RELAXED);
+        if (start >= task->total) {
+            break;
+        }
+
+        const uint64_t finish = task->total - start > task->chunk_sz ? start + task->chunk_sz : task->total;
+        const int status = task->f(task->args, start, finish);
+        if (status != 0) {
+            __atomic_store_n(&task->status, status, __ATOMIC_RELAXED);
+            break;
+        }
+
+        __atomic_fetch_add(&task->async->done, finish - start, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static unsigned int get_qthreads(const struct ofsm_builder * const me)
+{
+    if (me->qthreads != 0) {
+        return me->qthreads;
+    }
+
+    const long qcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return qcpus > 0 ? qcpus : 1;
+}
+
+static int parallel_for(const struct ofsm_builder * const me, const uint64_t total, const uint64_t chunk_sz, chunk_func * f, void * const args)
+{
+    struct parallel_task task = { f, args, total, chunk_sz, 0, 0, me->async };
+    progress_start(me, total);
+
+    const uint64_t qchunks = (total + chunk_sz - 1) / chunk_sz;
+    const unsigned int qthreads = qchunks < get_qthreads(me) ? qchunks : get_qthreads(me);
+
+    if (qthreads <= 1) {
+        parallel_worker(&task);
+        return task.status;
+    }
+
+    pthread_t threads[qthreads - 1];
+    unsigned int qstarted = 0;
+    for (; qstarted < qthreads - 1; ++qstarted) {
+        const int status = pthread_create(threads + qstarted, NULL, parallel_worker, &task);
+        if (status != 0) {
+            // Not fatal, the remaining chunks are processed by the started threads.
+            verbose(me->logstream, "    pthread_create failed with %d as error code, continue with %u threads.", status, qstarted + 1);
+            break;
+        }
+    }
+
+    parallel_worker(&task);
+
+    for (unsigned int i = 0; i < qstarted; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return task.status;
+}
+
+
+
 /* OFSM methods */
 
 static struct ofsm * create_ofsm(struct mempool * restrict const mempool, const unsigned int arg_max_flakes)
@@ -166,46 +441,129 @@ static struct ofsm * create_ofsm(struct mempool * restrict const mempool, const
     ofsm->qflakes = 1;
     ofsm->max_flakes = max_flakes;
     ofsm->flakes = flakes;
+    ofsm->qvalues = 0;
+    ofsm->qrecords = 0;
+    ofsm->records = NULL;
 
     const size_t flake_sz = sizeof(struct flake);
     memcpy(ofsm->flakes, &zero_flake, flake_sz);
     return ofsm;
 }
 
-static void ofsm_truncate(struct ofsm * restrict const me, const unsigned int qflakes)
+/* Jumps and paths might be shared between several OFSMs after ofsm_builder_dup, refs is NULL for exclusive blocks. */
+
+static void release_block(void * const block, unsigned int * const refs)
 {
-    for (unsigned int i=qflakes; i<me->qflakes; ++i) {
+    if (refs != NULL && --*refs > 0) {
+        return;
+    }
 
-        void * const jump_ptr = me->flakes[i].jumps[0];
-        if (jump_ptr != NULL) {
-            free(jump_ptr);
-        }
+    free(refs);
+    free(block);
+}
+
+static void flake_release_jumps(struct flake * restrict const flake)
+{
+    release_block(flake->jumps[0], flake->jump_refs);
+    flake->jump_refs = NULL;
+    flake->is_verified = 0;
+}
+
+static void flake_release_paths(struct flake * restrict const flake)
+{
+    release_block(flake->paths[0], flake->path_refs);
+    flake->path_refs = NULL;
+    flake->is_verified = 0;
+}
+
+static int own_block(void ** const block, unsigned int ** const refs, const size_t sz)
+{
+    if (*refs == NULL) {
+        return 0;
+    }
+
+    if (**refs == 1) {
+        free(*refs);
+        *refs = NULL;
+        return 0;
+    }
+
+    const size_t sizes[2] = { 0, sz };
+    void * ptrs[2];
+    multialloc(2, sizes, ptrs, 32);
+    if (ptrs[0] == NULL) {
+        ERRLOCATION(stderr);
+        msg(stderr, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for copy of shared flake data.", sizes[0], sizes[1]);
+        return 1;
+    }
+
+    memcpy(ptrs[1], block[1], sz);
+    --**refs;
+    *refs = NULL;
+    block[0] = ptrs[0];
+    block[1] = ptrs[1];
+    return 0;
+}
+
+static int flake_own_jumps(struct flake * restrict const flake)
+{
+    flake->is_verified = 0;
+    return own_block((void **)flake->jumps, &flake->jump_refs, (size_t)flake->qstates * flake->qinputs * sizeof(state_t));
+}
+
+static int flake_own_paths(struct flake * restrict const flake, const unsigned int nflake)
+{
+    flake->is_verified = 0;
+    return own_block((void **)flake->paths, &flake->path_refs, (size_t)flake->qoutputs * nflake * sizeof(input_t));
+}
 
-        void * const path_ptr = me->flakes[i].paths[0];
-        if (path_ptr) {
-            free(path_ptr);
+static int share_block(unsigned int ** const refs)
+{
+    if (*refs == NULL) {
+        *refs = malloc(sizeof(unsigned int));
+        if (*refs == NULL) {
+            ERRLOCATION(stderr);
+            msg(stderr, "malloc(%lu) failed with NULL as return value for reference counter.", sizeof(unsigned int));
+            return 1;
         }
+        **refs = 1;
+    }
+
+    ++**refs;
+    return 0;
+}
+
+static void ofsm_truncate(struct ofsm * restrict const me, const unsigned int qflakes)
+{
+    for (unsigned int i=qflakes; i<me->qflakes; ++i) {
+        flake_release_jumps(me->flakes + i);
+        flake_release_paths(me->flakes + i);
     }
 
     me->qflakes = qflakes;
 }
 
+static void ofsm_clear_records(struct ofsm * restrict const me)
+{
+    if (me->records != NULL) {
+        free(me->records);
+    }
+
+    me->qvalues = 0;
+    me->qrecords = 0;
+    me->records = NULL;
+}
+
 static void free_ofsm(struct ofsm * restrict me)
 {
     ofsm_truncate(me, 1);
+    ofsm_clear_records(me);
 }
 
 
 
-static struct flake * ofsm_create_flake(struct ofsm * restrict const ofsm, input_t qinputs, const uint64_t qoutputs, const state_t qstates)
+static int flake_alloc(struct flake * restrict const flake, const unsigned int nflake, input_t qinputs, const uint64_t qoutputs, const state_t qstates)
 {
-    const unsigned int nflake = ofsm->qflakes;
-    if (nflake >= ofsm->max_flakes) {
-        ERRLOCATION(stderr);
-        msg(stderr, "Overflow maximum flake count (%u), qflakes = %u.", ofsm->max_flakes, ofsm->qflakes);
-        return NULL;
-    }
-
     void * jump_ptrs[2];
     void * path_ptrs[2];
     const size_t jump_sizes[2] = { 0, qinputs * qstates * sizeof(state_t) };
@@ -216,7 +574,7 @@ static struct flake * ofsm_create_flake(struct ofsm * restrict const ofsm, input
     if (jump_ptrs[0] == NULL) {
         ERRLOCATION(stderr);
         msg(stderr, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for new flake.", jump_sizes[0], jump_sizes[1]);
-        return NULL;
+        return 1;
     }
 
     multialloc(2, path_sizes, path_ptrs, 32);
@@ -225,11 +583,9 @@ static struct flake * ofsm_create_flake(struct ofsm * restrict const ofsm, input
         ERRLOCATION(stderr);
         msg(stderr, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for new flake.", path_sizes[0], path_sizes[1]);
         free(jump_ptrs[0]);
-        return NULL;
+        return 1;
     }
 
-    struct flake * restrict const flake = ofsm->flakes + nflake;
-
     flake->qinputs = qinputs;
     flake->qoutputs = qoutputs;
     flake->qstates = qstates;
@@ -237,6 +593,26 @@ static struct flake * ofsm_create_flake(struct ofsm * restrict const ofsm, input
     flake->jumps[1] = jump_ptrs[1];
     flake->paths[0] = path_ptrs[0];
     flake->paths[1] = path_ptrs[1];
+    flake->flags = 0;
+    flake->jump_refs = NULL;
+    flake->path_refs = NULL;
+    flake->is_verified = 0;
+    return 0;
+}
+
+static struct flake * ofsm_create_flake(struct ofsm * restrict const ofsm, input_t qinputs, const uint64_t qoutputs, const state_t qstates)
+{
+    const unsigned int nflake = ofsm->qflakes;
+    if (nflake >= ofsm->max_flakes) {
+        ERRLOCATION(stderr);
+        msg(stderr, "Overflow maximum flake count (%u), qflakes = %u.", ofsm->max_flakes, ofsm->qflakes);
+        return NULL;
+    }
+
+    struct flake * restrict const flake = ofsm->flakes + nflake;
+    if (flake_alloc(flake, nflake, qinputs, qoutputs, qstates) != 0) {
+        return NULL;
+    }
 
     ++ofsm->qflakes;
     return flake;
@@ -283,186 +659,327 @@ static state_t do_ofsm_execute(const struct ofsm * const me, const unsigned int
 
 
 
-static int do_ofsm_get_array(const struct ofsm * const ofsm, const unsigned int delta_last, struct ofsm_array * restrict const out)
+static unsigned int calc_input_classes(const struct flake * const flake, uint8_t * restrict const classes, input_t * restrict const reps)
 {
-    memset(out, 0, sizeof(struct ofsm_array));
+    const input_t qinputs = flake->qinputs;
+    const state_t qstates = flake->qstates;
+    const state_t * const jumps = flake->jumps[1];
 
-    if (ofsm->qflakes <= 1) {
-        ERRLOCATION(stderr);
-        msg(stderr, "Invalid argument: try to build and for empty OFSM.");
-        return 1;
+    uint64_t hashes[256];
+    for (input_t input = 0; input < qinputs; ++input) {
+        hashes[input] = 0xCBF29CE484222325ull;
+    }
+
+    const state_t * jump = jumps;
+    for (state_t state = 0; state < qstates; ++state)
+    for (input_t input = 0; input < qinputs; ++input) {
+        hashes[input] ^= *jump++;
+        hashes[input] *= 0x100000001B3ull;
+    }
+
+    unsigned int qclasses = 0;
+    for (input_t input = 0; input < qinputs; ++input) {
+        unsigned int class = qclasses;
+        for (unsigned int i = 0; i < qclasses; ++i) {
+            const input_t rep = reps[i];
+            if (hashes[rep] != hashes[input]) continue;
+
+            state_t state = 0;
+            for (; state < qstates; ++state) {
+                const state_t * const row = jumps + state * qinputs;
+                if (row[rep] != row[input]) break;
+            }
+
+            if (state == qstates) {
+                class = i;
+                break;
+            }
+        }
+
+        if (class == qclasses) {
+            reps[qclasses++] = input;
+        }
+
+        classes[input] = class;
     }
 
-    input_t qinputs_err = 0;
-    for (unsigned int nflake = 0; nflake < ofsm->qflakes; ++nflake) {
+    return qclasses;
+}
+
+static int do_ofsm_get_ordered_array(const struct ofsm * const ofsm, const unsigned int delta_last, struct ofsm_array * restrict const out)
+{
+    // Rows are trimmed to the range of valid inputs, a row pointer is biased by the first one.
+    // Inputs outside of the range land in neighbour rows, so the caller must pass only valid inputs.
+
+    const unsigned int last = ofsm->qflakes - 1;
+    input_t max_width = 0;
+    size_t sizes[ofsm->qflakes + 1];
+    sizes[0] = 0;
+
+    for (unsigned int nflake = 1; nflake <= last; ++nflake) {
         const struct flake * const flake = ofsm->flakes + nflake;
-        if (flake->qinputs > qinputs_err) {
-             qinputs_err = flake->qinputs;
+        if (nflake < last && (flake->flags & FLAKE_FLAG__FUSE_NEXT) != 0) {
+            ERRLOCATION(stderr);
+            msg(stderr, "Ordered export is not supported for fused flake %u.", nflake);
+            return 1;
         }
+
+        if (flake->qinputs > max_width) {
+            max_width = flake->qinputs;
+        }
+
+        sizes[nflake] = (size_t)flake->qstates * sizeof(uint64_t);
     }
 
-    if (qinputs_err == 0) {
+    if (max_width == 0) {
         ERRLOCATION(stderr);
         msg(stderr, "Assertion failed: maximum input count for all flakes is 0.");
         return 1;
     }
 
-    out->qflakes = ofsm->qflakes - 1;
-    out->start_from = qinputs_err;
-    out->len = qinputs_err;
+    void * ptrs[ofsm->qflakes + 1];
+    multialloc(ofsm->qflakes, sizes, ptrs, 32);
+    if (ptrs[0] == NULL) {
+        ERRLOCATION(stderr);
+        msg(stderr, "multialloc(%u, sizes, ptrs, 32) failed for row offsets.", ofsm->qflakes);
+        return 1;
+    }
 
-    for (unsigned int nflake = 1; nflake <  ofsm->qflakes; ++nflake) {
+    uint64_t pos = max_width;
+    for (unsigned int nflake = 1; nflake <= last; ++nflake) {
         const struct flake * const flake = ofsm->flakes + nflake;
-        out->len += flake->qinputs * flake->qstates;
+        uint64_t * restrict const row_offsets = ptrs[nflake];
+        const state_t * row = flake->jumps[1];
+        for (state_t state = 0; state < flake->qstates; ++state, row += flake->qinputs) {
+            int first = 0;
+            while (first < flake->qinputs && row[first] == INVALID_STATE) ++first;
+            int after = flake->qinputs;
+            while (after > first && row[after-1] == INVALID_STATE) --after;
+
+            if (first == after) {
+                // Dead row, point it to the zero row
+                row_offsets[state] = 0;
+            } else {
+                row_offsets[state] = pos - first;
+                pos += after - first;
+            }
+        }
     }
 
+    const uint64_t * const first_offsets = ptrs[1];
+    out->flags = EXPORT_FLAG__ORDERED_INPUTS;
+    out->qflakes = last;
+    out->start_from = first_offsets[0];
+    out->len = pos;
+
     const size_t sz = out->len * sizeof(unsigned int);
     out->array = malloc(sz);
     if (out->array == NULL) {
         ERRLOCATION(stderr);
-        msg(stderr, "malloc(%lu) failed with NULL as return value in “do_ofsm_get_table”.", sz);
+        msg(stderr, "malloc(%lu) failed with NULL as return value in “do_ofsm_get_ordered_array”.", sz);
+        free(ptrs[0]);
         return 1;
     }
 
-
-
     unsigned int * restrict ptr = out->array;
 
-    for (input_t input = 0; input < qinputs_err; ++input) {
+    for (input_t input = 0; input < max_width; ++input) {
         *ptr++ = 0;
     }
 
-    for (unsigned int nflake = 1; nflake < ofsm->qflakes - 1; ++nflake) {
+    for (unsigned int nflake = 1; nflake <= last; ++nflake) {
         const struct flake * const flake = ofsm->flakes + nflake;
-        const uint64_t qjumps = flake->qinputs * flake->qstates;
-        const state_t * jump = flake->jumps[1];
-        const state_t * const end = jump + qjumps;
-        const uint64_t offset = ptr - out->array + qjumps;
-        for (; jump != end; ++jump) {
-            if (*jump == INVALID_STATE) {
-                *ptr++ = 0;
-            } else {
-                *ptr++ = offset + *jump * flake[1].qinputs;
+        const uint64_t * const row_offsets = ptrs[nflake];
+        const uint64_t * const next_offsets = nflake < last ? ptrs[nflake+1] : NULL;
+        const state_t * row = flake->jumps[1];
+        for (state_t state = 0; state < flake->qstates; ++state, row += flake->qinputs) {
+            if (row_offsets[state] == 0) continue;
+
+            const unsigned int first = ptr - out->array - row_offsets[state];
+            int after = flake->qinputs;
+            while (row[after-1] == INVALID_STATE) --after;
+
+            for (unsigned int input = first; input < after; ++input) {
+                const state_t jump = row[input];
+                if (jump == INVALID_STATE) {
+                    *ptr++ = 0;
+                } else {
+                    *ptr++ = next_offsets == NULL ? jump + delta_last : next_offsets[jump];
+                }
             }
         }
     }
 
-    const struct flake * const flake = ofsm->flakes + ofsm->qflakes - 1;
-    const uint64_t qjumps = flake->qinputs * flake->qstates;
-    const state_t * jump = flake->jumps[1];
-    const state_t * const end = jump + qjumps;
-    for (; jump != end; ++jump) {
-        if (*jump == INVALID_STATE) {
-            *ptr++ = 0;
-        } else {
-            *ptr++ = *jump + delta_last;
-        }
-    }
-
+    free(ptrs[0]);
     return 0;
 }
 
-
-
-static const input_t * do_ofsm_get_path(const struct ofsm * const ofsm, const unsigned int nflake, const state_t output)
+static int do_ofsm_get_array(const struct ofsm * const ofsm, const unsigned int delta_last, const unsigned int flags, struct ofsm_array * restrict const out)
 {
-    if (nflake <= 0 || nflake >= ofsm->qflakes) {
+    memset(out, 0, sizeof(struct ofsm_array));
+
+    if (ofsm->qflakes <= 1) {
         ERRLOCATION(stderr);
-        msg(stderr, "Invalid argument “nflake” = %u, should be in range 1 - %u.", nflake, ofsm->qflakes - 1);
-        return NULL;
+        msg(stderr, "Invalid argument: try to build and for empty OFSM.");
+        return 1;
     }
 
-    const struct flake * const flake = ofsm->flakes + nflake;
+    // Fused flakes are exported as one step, the row width is the product of their qinputs.
+    const unsigned int last = ofsm->qflakes - 1;
+    uint64_t widths[ofsm->qflakes];
+    uint64_t row_widths[ofsm->qflakes];
+    unsigned int firsts[ofsm->qflakes];
+    unsigned int qsteps = 0;
+    uint64_t max_width = 0;
+    uint64_t max_row_width = 0;
 
-    if (output >= flake->qoutputs) {
-        ERRLOCATION(stderr);
-        msg(stderr, "Invalid argument “output” = %u for given flake, should be in range 0 - %u.", output, flake->qoutputs - 1);
-        return NULL;
+    const int compress = (flags & EXPORT_FLAG__COMPRESS_INPUTS) != 0;
+
+    if (flags & EXPORT_FLAG__ORDERED_INPUTS) {
+        if (compress) {
+            ERRLOCATION(stderr);
+            msg(stderr, "Ordered inputs can not be combined with input compression.");
+            return 1;
+        }
+        return do_ofsm_get_ordered_array(ofsm, delta_last, out);
     }
+    uint8_t classes[compress ? ofsm->qflakes * 256 : 1];
+    input_t reps[compress ? ofsm->qflakes * 256 : 1];
+
+    for (unsigned int nflake = 1; nflake <= last; ++qsteps) {
+        uint64_t width = 1;
+        firsts[qsteps] = nflake;
+        for (;; ++nflake) {
+            const struct flake * const flake = ofsm->flakes + nflake;
+            width *= flake->qinputs;
+            if (nflake == last || (flake->flags & FLAKE_FLAG__FUSE_NEXT) == 0) {
+                break;
+            }
+        }
 
-    return flake->paths[1] + output * nflake;
-}
+        if (width > UINT32_MAX) {
+            ERRLOCATION(stderr);
+            msg(stderr, "Too wide fused row (%lu) for step %u.", width, qsteps);
+            return 1;
+        }
 
+        if (compress && nflake != firsts[qsteps]) {
+            ERRLOCATION(stderr);
+            msg(stderr, "Input compression is not supported for fused flakes %u - %u.", firsts[qsteps], nflake);
+            return 1;
+        }
 
+        widths[qsteps] = width;
+        row_widths[qsteps] = !compress ? width : calc_input_classes(ofsm->flakes + nflake, classes + qsteps * 256, reps + qsteps * 256);
 
-static int ofsm_verify(const struct ofsm * const me, FILE * const errstream)
-{
-    const size_t flake_sz = sizeof(struct flake);
-    if (memcmp(me->flakes, &zero_flake, flake_sz) != 0) {
-        ERRLOCATION(errstream);
-        msg(errstream, "Verification failed: invalid zero flake.\n");
+        if (width > max_width) {
+            max_width = width;
+        }
+
+        if (row_widths[qsteps] > max_row_width) {
+            max_row_width = row_widths[qsteps];
+        }
+
+        ++nflake;
+    }
+
+    firsts[qsteps] = last + 1;
+
+    if (max_width == 0) {
+        ERRLOCATION(stderr);
+        msg(stderr, "Assertion failed: maximum input count for all flakes is 0.");
         return 1;
     }
 
-    for (unsigned int nflake = 1; nflake < me->qflakes; ++nflake) {
-        const struct flake * const flake = me->flakes + nflake;
-        const struct flake * const prev = flake -1;
-        if (prev->qoutputs != flake->qstates) {
-            ERRLOCATION(errstream);
-            msg(errstream, "Verification failed: Mismatch flake->qstates = %u and prev->qoutputs = %u.\n", flake->qstates, prev->qoutputs);
-            return 1;
-        }
+    out->qflakes = qsteps;
+    out->start_from = max_row_width;
+    out->len = max_row_width;
 
-        const state_t qoutputs = flake->qoutputs;
+    for (unsigned int step = 0; step < qsteps; ++step) {
+        const struct flake * const flake = ofsm->flakes + firsts[step];
+        out->len += row_widths[step] * flake->qstates;
+    }
 
-        const state_t * jump = flake->jumps[1];
-        const state_t * const jump_last = jump + flake->qinputs * flake->qstates;
-        for (; jump != jump_last; ++jump) {
-            const state_t state = *jump;
-            if (state > qoutputs && state != INVALID_STATE) {
-                ERRLOCATION(errstream);
-                msg(errstream, "Verification failed: invalid state %u\n", state);
-                return 1;
-            }
+    const size_t classes_sz = compress ? qsteps * max_width : 0;
+    const size_t sz = out->len * sizeof(unsigned int) + classes_sz;
+    out->array = malloc(sz);
+    if (out->array == NULL) {
+        ERRLOCATION(stderr);
+        msg(stderr, "malloc(%lu) failed with NULL as return value in “do_ofsm_get_table”.", sz);
+        return 1;
+    }
+
+    if (compress) {
+        // Class tables are placed in the same block after the array, so free(out->array) releases both.
+        out->classes_width = max_width;
+        out->classes = (uint8_t *)(out->array + out->len);
+        memset(out->classes, 0, classes_sz);
+        for (unsigned int step = 0; step < qsteps; ++step) {
+            memcpy(out->classes + step * max_width, classes + step * 256, widths[step]);
         }
+    }
 
-        const input_t * input = flake->paths[1];
 
-        for (state_t output=0; output<qoutputs; ++output) {
 
-            int is_invalid = 1;
-            for (unsigned int i=0; i<nflake; ++i) {
-                if (input[i] != INVALID_INPUT) {
-                    is_invalid = 0;
-                    break;
-                }
-            }
+    unsigned int * restrict ptr = out->array;
 
-            if (is_invalid) {
-                continue;
-            }
+    for (uint64_t input = 0; input < max_row_width; ++input) {
+        *ptr++ = 0;
+    }
 
-            for (unsigned int i=1; i<=nflake; ++i) {
-                const struct flake * const current_flake = me->flakes + i;
-                if (input[i-1] >= current_flake->qinputs) {
-                    ERRLOCATION(errstream);
-                    msg(errstream, "Verification failed: in nflake %u invalid state input[%u] = %u, qinputs = %u.", nflake, i-1, input[i-1], current_flake->qinputs);
-                    fprintf(errstream, "Input:");
-                    for (unsigned int j=0; j<nflake; ++j) {
-                        fprintf(errstream, " %u", input[j]);
+    input_t inputs[ofsm->qflakes];
+
+    for (unsigned int step = 0; step < qsteps; ++step) {
+        const unsigned int first = firsts[step];
+        const unsigned int next = firsts[step + 1];
+        const struct flake * const flake = ofsm->flakes + first;
+        const uint64_t width = row_widths[step];
+        const uint64_t offset = ptr - out->array + width * flake->qstates;
+        const int is_last = next > last;
+        const uint64_t next_width = is_last ? 0 : row_widths[step + 1];
+
+        if (next == first + 1) {
+
+            // Fast path: one flake per step
+            const input_t * const step_reps = compress ? reps + step * 256 : NULL;
+            const state_t * row = flake->jumps[1];
+            for (state_t state = 0; state < flake->qstates; ++state) {
+                for (uint64_t index = 0; index < width; ++index) {
+                    const state_t jump = row[compress ? step_reps[index] : index];
+                    if (jump == INVALID_STATE) {
+                        *ptr++ = 0;
+                    } else {
+                        *ptr++ = is_last ? jump + delta_last : offset + jump * next_width;
                     }
-                    fprintf(errstream, "\n");
-                    return 1;
                 }
+                row += flake->qinputs;
             }
 
-            const state_t state = ofsm_execute(me, nflake, input);
-            if (state != output) {
-                ERRLOCATION(errstream);
-                msg(errstream, "Verification failed: execution from path does not lead to output state.");
-                msg(errstream, "Output = %u, state = %u.", output, state);
-                fprintf(errstream, "Input:");
-                for (unsigned int j=0; j<nflake; ++j) {
-                    fprintf(errstream, " %u", input[j]);
-                }
-                fprintf(errstream, "\n");
+            continue;
+        }
 
-                return 1;
+        for (state_t state = 0; state < flake->qstates; ++state)
+        for (uint64_t index = 0; index < width; ++index) {
+
+            uint64_t rest = index;
+            for (unsigned int nflake = next - 1; nflake >= first; --nflake) {
+                const input_t qinputs = ofsm->flakes[nflake].qinputs;
+                inputs[nflake] = rest % qinputs;
+                rest /= qinputs;
             }
 
-            input += nflake;
-        }
+            state_t current = state;
+            for (unsigned int nflake = first; nflake < next && current != INVALID_STATE; ++nflake) {
+                const struct flake * const current_flake = ofsm->flakes + nflake;
+                current = current_flake->jumps[1][current * current_flake->qinputs + inputs[nflake]];
+            }
 
+            if (current == INVALID_STATE) {
+                *ptr++ = 0;
+            } else {
+                *ptr++ = is_last ? current + delta_last : offset + current * next_width;
+            }
+        }
     }
 
     return 0;
@@ -470,861 +987,5627 @@ static int ofsm_verify(const struct ofsm * const me, FILE * const errstream)
 
 
 
-static struct ofsm * do_ofsm_builder_get_ofsm(const struct ofsm_builder * const me)
+static const input_t * do_ofsm_get_path(const struct ofsm * const ofsm, const unsigned int nflake, const state_t output)
 {
-    if (me->stack_len == 0) {
-        ERRLOCATION(me->errstream);
-        msg(me->errstream, "do_ofsm_builder_get_ofsm is called for empty OFSM stack.");
+    if (nflake <= 0 || nflake >= ofsm->qflakes) {
+        ERRLOCATION(stderr);
+        msg(stderr, "Invalid argument “nflake” = %u, should be in range 1 - %u.", nflake, ofsm->qflakes - 1);
         return NULL;
     }
 
-    return me->stack[me->stack_len - 1];
+    const struct flake * const flake = ofsm->flakes + nflake;
+
+    if (output >= flake->qoutputs) {
+        ERRLOCATION(stderr);
+        msg(stderr, "Invalid argument “output” = %u for given flake, should be in range 0 - %u.", output, flake->qoutputs - 1);
+        return NULL;
+    }
+
+    return flake->paths[1] + output * nflake;
 }
 
 
 
-/* OFSM Builder */
+#define VERIFY_JUMP_CHUNK_SZ    (1 << 20)
+#define VERIFY_PATH_CHUNK_SZ    (1 << 14)
 
-static int autoverify(const struct ofsm_builder * const me)
-{
-    return (me->flags & OBF__AUTO_VERIFY) ? ofsm_builder_verify(me) : 0;
-}
+#define PATH__OK                0
+#define PATH__INVALID_INPUT     1
+#define PATH__WRONG_OUTPUT      2
 
+struct verify_args
+{
+    const struct ofsm * ofsm;
+    unsigned int nflake;
+    uint64_t failed;
+};
 
+// Workers stop on the first failure they meet, the smallest failed index is reported
+static void verify_fail(struct verify_args * restrict const args, const uint64_t index)
+{
+    uint64_t failed = __atomic_load_n(&args->failed, __ATOMIC_RELAXED);
+    while (index < failed && !__atomic_compare_exchange_n(&args->failed, &failed, index, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-struct ofsm_builder * create_ofsm_builder(struct mempool * restrict const arg_mempool, FILE * const errstream)
+static int verify_jumps_chunk(void * const arg, const uint64_t start, const uint64_t finish)
 {
-    struct mempool * restrict mempool = arg_mempool != NULL ? arg_mempool : create_mempool(4000);
+    struct verify_args * restrict const args = arg;
+    const struct flake * const flake = args->ofsm->flakes + args->nflake;
+    const state_t qoutputs = flake->qoutputs;
 
-    if (mempool == NULL) {
-        ERRLOCATION(errstream);
-        msg(errstream, "create_mempool(4000) failed with NULL as return value.");
-        return NULL;
+    const state_t * const jumps = flake->jumps[1];
+
+    // Branch free scan is vectorized by compiler, the failed jump is searched only in a bad chunk
+    unsigned int is_bad = 0;
+    for (uint64_t i = start; i < finish; ++i) {
+        const state_t state = jumps[i];
+        is_bad |= (state >= qoutputs) & (state != INVALID_STATE);
     }
 
-    const size_t sz = sizeof(struct ofsm_builder);
-    struct ofsm_builder * restrict const result = mempool_alloc(mempool, sz);
-    if (result == NULL) {
-        ERRLOCATION(errstream);
-        msg(errstream, "mempool_alloc(actual_mempool, %lu) failed with NULL as return value.", sz);
+    if (!is_bad) {
+        return 0;
     }
 
-    result->flags = 0;
-    if (mempool != arg_mempool) {
-        result->flags |= OBF__OWN_MEMPOOL;
+    for (uint64_t i = start; i < finish; ++i) {
+        const state_t state = jumps[i];
+        if (state >= qoutputs && state != INVALID_STATE) {
+            verify_fail(args, i);
+            return 1;
+        }
     }
 
-    result->mempool = mempool;
-    result->logstream = NULL;
-    result->errstream = errstream;
-    result->stack_len = 0;
-    result->user_data = NULL;
-    init_choose_table(&result->choose, 0, 0, errstream);
-    return result;
+    return 0;
 }
 
-
-
-void free_ofsm_builder(struct ofsm_builder * restrict const me)
+static int check_path(const struct ofsm * const me, const unsigned int nflake, const input_t * const input, const state_t output, state_t * restrict const reached)
 {
-    clear_choose_table(&me->choose);
+    int is_invalid = 1;
+    for (unsigned int i=0; i<nflake; ++i) {
+        if (input[i] != INVALID_INPUT) {
+            is_invalid = 0;
+            break;
+        }
+    }
 
-    for (unsigned int i = 0; i < me->stack_len; ++i) {
-        free_ofsm(me->stack[i]);
+    if (is_invalid) {
+        return PATH__OK;
     }
 
-    if (me->flags & OBF__OWN_MEMPOOL) {
-        free_mempool(me->mempool);
+    for (unsigned int i=1; i<=nflake; ++i) {
+        if (input[i-1] >= me->flakes[i].qinputs) {
+            return PATH__INVALID_INPUT;
+        }
     }
-}
 
+    // Jumps of the flake are already checked, so every reached state is in range
+    state_t state = 0;
+    for (unsigned int i=1; i<=nflake && state != INVALID_STATE; ++i) {
+        const struct flake * const flake = me->flakes + i;
+        state = flake->jumps[1][state * flake->qinputs + input[i-1]];
+    }
 
+    *reached = state;
+    return state == output ? PATH__OK : PATH__WRONG_OUTPUT;
+}
 
-int ofsm_builder_make_array(const struct ofsm_builder * const me, const unsigned int delta_last, struct ofsm_array * restrict const out)
+static int verify_paths_chunk(void * const arg, const uint64_t start, const uint64_t finish)
 {
-    const void * const ofsm = do_ofsm_builder_get_ofsm(me);
-    if (ofsm == NULL) {
-        ERRLOCATION(me->errstream);
-        msg(me->errstream, "do_ofsm_builder_get_ofsm_as_void(me) failed with NULL as error value.");
-        return 1;
+    struct verify_args * restrict const args = arg;
+    const unsigned int nflake = args->nflake;
+    const input_t * input = args->ofsm->flakes[nflake].paths[1] + start * nflake;
+
+    for (uint64_t output = start; output < finish; ++output, input += nflake) {
+        state_t reached;
+        if (check_path(args->ofsm, nflake, input, output, &reached) != PATH__OK) {
+            verify_fail(args, output);
+            return 1;
+        }
     }
 
-    return ofsm_get_array(ofsm, delta_last, out);
+    return 0;
+}
+
+static void print_path(FILE * const errstream, const input_t * const input, const unsigned int nflake)
+{
+    fprintf(errstream, "Input:");
+    for (unsigned int j=0; j<nflake; ++j) {
+        fprintf(errstream, " %u", input[j]);
+    }
+    fprintf(errstream, "\n");
 }
 
+static void report_path_failure(const struct ofsm * const me, const unsigned int nflake, const state_t output, FILE * const errstream)
+{
+    const input_t * const input = me->flakes[nflake].paths[1] + (size_t)output * nflake;
+    state_t state = INVALID_STATE;
+    const int status = check_path(me, nflake, input, output, &state);
+
+    if (status == PATH__INVALID_INPUT) {
+        for (unsigned int i=1; i<=nflake; ++i) {
+            const struct flake * const current_flake = me->flakes + i;
+            if (input[i-1] >= current_flake->qinputs) {
+                ERRLOCATION(errstream);
+                msg(errstream, "Verification failed: in nflake %u invalid state input[%u] = %u, qinputs = %u.", nflake, i-1, input[i-1], current_flake->qinputs);
+                break;
+            }
+        }
+    } else {
+        ERRLOCATION(errstream);
+        msg(errstream, "Verification failed: execution from path does not lead to output state.");
+        msg(errstream, "Output = %u, state = %u.", output, state);
+    }
 
+    print_path(errstream, input, nflake);
+}
 
-int ofsm_builder_push_pow(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m)
+/*
+ * Jump bounds first, then replay of every stored path, both split between builder threads.
+ * Path replay relies on checked jumps and does not test state ranges.
+ */
+static int verify_flake_jumps(const struct ofsm_builder * const me, const struct ofsm * const ofsm, const unsigned int nflake)
 {
-    verbose(me->logstream, "START push power OFSM(%u, %u) to stack.", (unsigned int)qinputs, m);
+    const struct flake * const flake = ofsm->flakes + nflake;
+    struct verify_args args = { ofsm, nflake, UINT64_MAX };
 
-    if (me->stack_len == OFSM_STACK_SZ) {
+    const uint64_t qjumps = (uint64_t)flake->qinputs * flake->qstates;
+    const int status = parallel_for(me, qjumps, VERIFY_JUMP_CHUNK_SZ, &verify_jumps_chunk, &args);
+    if (status != 0) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "ofsm_builder_push_pow failed, stack overflow, stack_len = %u, size_sz = %u.", me->stack_len, OFSM_STACK_SZ);
-        verbose(me->logstream, "FAILED push power.");
+        if (args.failed != UINT64_MAX) {
+            msg(me->errstream, "Verification failed: invalid state %u in flake %u, qoutputs = %u.\n", flake->jumps[1][args.failed], nflake, flake->qoutputs);
+        } else {
+            msg(me->errstream, "Verification of flake %u jumps is interrupted with %d as status.", nflake, status);
+        }
         return 1;
     }
 
-    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, 0);
-    if (ofsm == NULL) {
-        ERRLOCATION(me->errstream);
-        msg(me->errstream, "create_ofsm(me->mempool, 0) failed with NULL as result value.");
-        verbose(me->logstream, "FAILED push power.");
+    return 0;
+}
+
+static int verify_flake(const struct ofsm_builder * const me, const struct ofsm * const ofsm, const unsigned int nflake)
+{
+    if (verify_flake_jumps(me, ofsm, nflake) != 0) {
         return 1;
     }
 
-    const struct flake * prev =  ofsm->flakes + ofsm->qflakes - 1;
+    const struct flake * const flake = ofsm->flakes + nflake;
+    struct verify_args args = { ofsm, nflake, UINT64_MAX };
 
-    for (unsigned int i=0; i<m; ++i) {
-        if (prev->qoutputs == INVALID_STATE) {
+    const int path_status = parallel_for(me, flake->qoutputs, VERIFY_PATH_CHUNK_SZ, &verify_paths_chunk, &args);
+    if (path_status != 0) {
+        if (args.failed != UINT64_MAX) {
+            report_path_failure(ofsm, nflake, args.failed, me->errstream);
+        } else {
             ERRLOCATION(me->errstream);
-            msg(me->errstream, "state_t overflow: try to assign %u to qstates.", prev->qoutputs);
-            verbose(me->logstream, "FAILED push power.");
-            free_ofsm(ofsm);
+            msg(me->errstream, "Verification of flake %u paths is interrupted with %d as status.", nflake, path_status);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+static int verify_flake_links(const struct ofsm * const me, FILE * const errstream)
+{
+    const size_t flake_sz = sizeof(struct flake);
+    if (memcmp(me->flakes, &zero_flake, flake_sz) != 0) {
+        ERRLOCATION(errstream);
+        msg(errstream, "Verification failed: invalid zero flake.\n");
+        return 1;
+    }
+
+    for (unsigned int nflake = 1; nflake < me->qflakes; ++nflake) {
+        const struct flake * const flake = me->flakes + nflake;
+        const struct flake * const prev = flake -1;
+        if (prev->qoutputs != flake->qstates) {
+            ERRLOCATION(errstream);
+            msg(errstream, "Verification failed: Mismatch flake->qstates = %u and prev->qoutputs = %u.\n", flake->qstates, prev->qoutputs);
             return 1;
         }
+    }
 
-        const state_t qstates = prev->qoutputs;
-        const uint64_t qoutputs = qstates * qinputs;
+    return 0;
+}
 
-        const unsigned int nflake = ofsm->qflakes;
-        const struct flake * const flake = ofsm_create_flake(ofsm, qinputs, qoutputs, qstates);
+static int ofsm_verify(const struct ofsm_builder * const me, const struct ofsm * const ofsm)
+{
+    if (verify_flake_links(ofsm, me->errstream) != 0) {
+        return 1;
+    }
 
-        if (flake == NULL) {
-            ERRLOCATION(me->errstream);
-            msg(me->errstream, "ofsm_create_flake(me, %u, %lu, %u) faled with NULL as return value.", qinputs, qoutputs, qstates);
-            verbose(me->logstream, "FAILED push power.");
-            free_ofsm(ofsm);
+    for (unsigned int nflake = 1; nflake < ofsm->qflakes; ++nflake) {
+        if (verify_flake(me, ofsm, nflake) != 0) {
             return 1;
         }
+    }
 
-        state_t * restrict jumps = flake->jumps[1];
-        state_t output = 0;
+    return 0;
+}
 
-        for (uint64_t state=0; state<qstates; ++state)
-        for (uint64_t input=0; input<qinputs; ++input) {
-            *jumps++ = output++;
+/*
+ * Incremental variant for auto-verification: only flakes whose jumps or paths were replaced or written since
+ * the last check are verified, untouched flakes cost only the link check.
+ */
+static int ofsm_verify_changed(const struct ofsm_builder * const me, struct ofsm * restrict const ofsm, unsigned int * restrict const qchecked)
+{
+    if (verify_flake_links(ofsm, me->errstream) != 0) {
+        return 1;
+    }
+
+    for (unsigned int nflake = 1; nflake < ofsm->qflakes; ++nflake) {
+        struct flake * restrict const flake = ofsm->flakes + nflake;
+        if (flake->is_verified) {
+            continue;
         }
 
-        const int status = calc_paths(flake, nflake);
-        if (status != 0) {
-            ERRLOCATION(me->errstream);
-            msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, status);
-            verbose(me->logstream, "FAILED push power.");
-            free_ofsm(ofsm);
+        if (verify_flake(me, ofsm, nflake) != 0) {
             return 1;
         }
 
-        prev = flake;
+        flake->is_verified = 1;
+        ++*qchecked;
     }
 
-    me->stack[me->stack_len++] = ofsm;
-    verbose(me->logstream, "DONE push power.");
-    return autoverify(me);
+    return 0;
 }
 
 
 
-static state_t calc_comb_index(const struct choose_table * const ct, const input_t * const inputs, unsigned int qinputs, const unsigned int m)
+/* Sampled verification */
+
+#define SAMPLE_CHUNK_SZ         (1 << 12)
+#define SAMPLE_CLOCK_STEP       256
+
+struct sample_args
 {
+    struct verify_args verify;
+    uint64_t qstrata;
+    uint64_t stride;
+    uint64_t seed;
+    double deadline;
+    uint64_t qchecked;
+};
 
-    if (qinputs > 64) {
-        ERRLOCATION(ct->errstream);
-        msg(ct->errstream, "Sorting of inputs more then 64 is not supported yet.");
-        return INVALID_STATE;
-    }
+static double get_monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-    uint64_t mask = 0;
-    for (unsigned int i=0; i<m; ++i) {
-        const uint64_t new_one = 1ull << inputs[i];
-        if (new_one & mask) return INVALID_STATE; // repetition
-        mask |= new_one;
-    }
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
 
-    input_t sorted[m];
-    for (unsigned int i = 0; i<m; ++i) {
-        sorted[i] = extract_rbit64(&mask);
+static uint64_t calc_gcd(uint64_t a, uint64_t b)
+{
+    while (b != 0) {
+        const uint64_t tmp = a % b;
+        a = b;
+        b = tmp;
     }
+    return a;
+}
+
+/*
+ * Outputs are split into qstrata equal strata and one random output is checked in each of them.
+ * Strata are visited with a stride coprime with qstrata, so every stratum is visited once and
+ * a scan stopped by the time budget has its samples spread over the flake instead of its beginning.
+ * Threads still stop independently, so such partial scan is spread, but not uniform.
+ */
+static int sample_paths_chunk(void * const arg, const uint64_t start, const uint64_t finish)
+{
+    struct sample_args * restrict const args = arg;
+    const unsigned int nflake = args->verify.nflake;
+    const struct flake * const flake = args->verify.ofsm->flakes + nflake;
+    const uint64_t qoutputs = flake->qoutputs;
 
-    state_t result = 0;
-    for (unsigned int k = 0; k < m; ++k) {
-        result += choose(ct, sorted[k], k+1);
+    uint64_t qchecked = 0;
+    int status = 0;
+
+    for (uint64_t i = start; i < finish; ++i) {
+        if (args->deadline > 0 && (i - start) % SAMPLE_CLOCK_STEP == 0 && get_monotonic_time() > args->deadline) {
+            break;
+        }
+
+        const uint64_t stratum = i * args->stride % args->qstrata;
+        const uint64_t first = stratum * qoutputs / args->qstrata;
+        const uint64_t last = (stratum + 1) * qoutputs / args->qstrata;
+        const state_t output = first + mix64(args->seed ^ stratum) % (last - first);
+
+        state_t reached;
+        const input_t * const input = flake->paths[1] + (size_t)output * nflake;
+        if (check_path(args->verify.ofsm, nflake, input, output, &reached) != PATH__OK) {
+            verify_fail(&args->verify, output);
+            status = 1;
+            break;
+        }
+
+        ++qchecked;
     }
 
-    return result;
+    __atomic_fetch_add(&args->qchecked, qchecked, __ATOMIC_RELAXED);
+    return status;
 }
 
-int ofsm_builder_push_comb(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m)
+static int verify_flake_sampled(const struct ofsm_builder * const me, const struct ofsm * const ofsm, const unsigned int nflake, const uint64_t qsamples, const double deadline, uint64_t * restrict const qchecked)
 {
-    verbose(me->logstream, "START push compinatoric OFSM(%u, %u) to stack.", (unsigned int)qinputs, m);
-
-    if (me->stack_len == OFSM_STACK_SZ) {
-        ERRLOCATION(me->errstream);
-        msg(me->errstream, "ofsm_builder_push_comb failed, stack overflow, stack_len = %u, size_sz = %u.", me->stack_len, OFSM_STACK_SZ);
-        verbose(me->logstream, "FAILED push combinatoric.");
+    if (verify_flake_jumps(me, ofsm, nflake) != 0) {
         return 1;
     }
 
-    struct choose_table * restrict const ct = &me->choose;
-    const int status = rebuild_choose_table(ct, qinputs, m);
+    const struct flake * const flake = ofsm->flakes + nflake;
+    const uint64_t qstrata = qsamples == 0 || qsamples > flake->qoutputs ? flake->qoutputs : qsamples;
+    const uint64_t seed = mix64(((uint64_t)me->qops << 32) ^ nflake);
+
+    // Golden ratio stride gives evenly spread prefixes of the permutation
+    uint64_t stride = (uint64_t)(qstrata * 0.6180339887) | 1;
+    while (calc_gcd(stride, qstrata) != 1) {
+        ++stride;
+    }
+
+    struct sample_args args = { { ofsm, nflake, UINT64_MAX }, qstrata, stride, seed, deadline, 0 };
+
+    const int status = parallel_for(me, qstrata, SAMPLE_CHUNK_SZ, &sample_paths_chunk, &args);
+    *qchecked = args.qchecked;
+
     if (status != 0) {
+        if (args.verify.failed != UINT64_MAX) {
+            report_path_failure(ofsm, nflake, args.verify.failed, me->errstream);
+        } else {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Sampled verification of flake %u paths is interrupted with %d as status.", nflake, status);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+
+
+static struct ofsm * do_ofsm_builder_get_ofsm(const struct ofsm_builder * const me)
+{
+    if (me->stack_len == 0) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "rebuild_choose_table(ct, %u, %u, errstream) failed with %d as error code.", (unsigned int)qinputs, m, status);
-        verbose(me->logstream, "FAILED push combinatoric.");
-        return status;
+        msg(me->errstream, "do_ofsm_builder_get_ofsm is called for empty OFSM stack.");
+        return NULL;
     }
 
-    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, 0);
+    return me->stack[me->stack_len - 1];
+}
+
+
+
+/* OFSM Builder */
+
+static int autoverify(struct ofsm_builder * restrict const me)
+{
+    if ((me->flags & OBF__AUTO_VERIFY) == 0) {
+        uint64_t qchecked;
+        return (me->flags & OBF__AUTO_VERIFY_SAMPLED) ? ofsm_builder_verify_sampled(me, me->verify_samples, me->verify_seconds, &qchecked) : 0;
+    }
+
+    verbose(me->logstream, "START verification of changed flakes.");
+
+    unsigned int qchecked = 0;
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        const int status = ofsm_verify_changed(me, me->stack[i], &qchecked);
+        if (status != 0) {
+            verbose(me->logstream, "FAILED verification of changed flakes.");
+            return status;
+        }
+    }
+
+    verbose(me->logstream, "DONE verification of changed flakes, %u flakes are checked.", qchecked);
+    return 0;
+}
+
+
+
+/* Checkpoints */
+
+#define CHECKPOINT_MAGIC    "YOO OFSM CKPT 1"
+
+struct checkpoint_header
+{
+    char magic[16];
+    uint32_t qops;
+    uint32_t stack_len;
+};
+
+struct checkpoint_ofsm
+{
+    uint32_t qflakes;
+    uint32_t max_flakes;
+    uint32_t qvalues;
+    uint32_t qrecords;
+};
+
+struct checkpoint_flake
+{
+    uint32_t qinputs;
+    uint32_t flags;
+    uint32_t qstates;
+    uint32_t qoutputs;
+};
+
+struct checkpoint_stream
+{
+    FILE * f;
+    uint64_t hash;
+};
+
+static void checkpoint_hash(struct checkpoint_stream * restrict const stream, const void * const data, const size_t sz)
+{
+    const uint8_t * ptr = data;
+    const uint8_t * const end = ptr + sz;
+    uint64_t hash = stream->hash;
+    for (; ptr != end; ++ptr) {
+        hash ^= *ptr;
+        hash *= 0x100000001B3ull;
+    }
+    stream->hash = hash;
+}
+
+static int checkpoint_write(struct checkpoint_stream * restrict const stream, const void * const data, const size_t sz)
+{
+    checkpoint_hash(stream, data, sz);
+    return fwrite(data, 1, sz, stream->f) != sz;
+}
+
+static int checkpoint_read(struct checkpoint_stream * restrict const stream, void * const data, const size_t sz)
+{
+    if (fread(data, 1, sz, stream->f) != sz) {
+        return 1;
+    }
+
+    checkpoint_hash(stream, data, sz);
+    return 0;
+}
+
+int ofsm_builder_save_checkpoint(const struct ofsm_builder * const me, FILE * const f)
+{
+    struct checkpoint_stream stream = { f, 0xCBF29CE484222325ull };
+
+    struct checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.qops = me->qops;
+    header.stack_len = me->stack_len;
+
+    int status = checkpoint_write(&stream, &header, sizeof(header));
+
+    for (unsigned int i = 0; status == 0 && i < me->stack_len; ++i) {
+        const struct ofsm * const ofsm = me->stack[i];
+        const struct checkpoint_ofsm item = { ofsm->qflakes, ofsm->max_flakes, ofsm->qvalues, ofsm->qrecords };
+        status = checkpoint_write(&stream, &item, sizeof(item));
+        if (status == 0 && ofsm->qvalues > 0) {
+            status = checkpoint_write(&stream, ofsm->records, (size_t)ofsm->qrecords * ofsm->qvalues * sizeof(pack_value_t));
+        }
+
+        for (unsigned int nflake = 1; status == 0 && nflake < ofsm->qflakes; ++nflake) {
+            const struct flake * const flake = ofsm->flakes + nflake;
+            const struct checkpoint_flake info = { flake->qinputs, flake->flags, flake->qstates, flake->qoutputs };
+            status = 0
+                || checkpoint_write(&stream, &info, sizeof(info))
+                || checkpoint_write(&stream, flake->jumps[1], (size_t)flake->qstates * flake->qinputs * sizeof(state_t))
+                || checkpoint_write(&stream, flake->paths[1], (size_t)flake->qoutputs * nflake * sizeof(input_t))
+            ;
+        }
+    }
+
+    if (status == 0) {
+        const uint64_t checksum = stream.hash;
+        status = fwrite(&checksum, 1, sizeof(checksum), f) != sizeof(checksum);
+    }
+
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Writing checkpoint failed.");
+        return 1;
+    }
+
+    return 0;
+}
+
+static struct ofsm * load_checkpoint_ofsm(const struct ofsm_builder * const me, struct checkpoint_stream * restrict const stream)
+{
+    struct checkpoint_ofsm item;
+    if (checkpoint_read(stream, &item, sizeof(item)) != 0 || item.qflakes == 0 || item.qflakes > item.max_flakes) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Invalid or truncated OFSM header in checkpoint.");
+        return NULL;
+    }
+
+    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, item.max_flakes);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm(me->mempool, %u) failed with NULL as result value.", item.max_flakes);
+        return NULL;
+    }
+
+    if (item.qvalues > 0) {
+        const size_t sz = (size_t)item.qrecords * item.qvalues * sizeof(pack_value_t);
+        ofsm->records = malloc(sz > 0 ? sz : 1);
+        if (ofsm->records == NULL || checkpoint_read(stream, ofsm->records, sz) != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Loading %lu bytes of output records from checkpoint failed.", sz);
+            free_ofsm(ofsm);
+            return NULL;
+        }
+        ofsm->qvalues = item.qvalues;
+        ofsm->qrecords = item.qrecords;
+    }
+
+    for (unsigned int nflake = 1; nflake < item.qflakes; ++nflake) {
+        struct checkpoint_flake info;
+        if (checkpoint_read(stream, &info, sizeof(info)) != 0 || info.qinputs > INVALID_INPUT) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Invalid or truncated header of flake %u in checkpoint.", nflake);
+            free_ofsm(ofsm);
+            return NULL;
+        }
+
+        struct flake * restrict const flake = ofsm_create_flake(ofsm, info.qinputs, info.qoutputs, info.qstates);
+        if (flake == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_create_flake(ofsm, %u, %u, %u) failed with NULL as result.", info.qinputs, info.qoutputs, info.qstates);
+            free_ofsm(ofsm);
+            return NULL;
+        }
+
+        flake->flags = info.flags;
+
+        const int status = 0
+            || checkpoint_read(stream, flake->jumps[1], (size_t)flake->qstates * flake->qinputs * sizeof(state_t))
+            || checkpoint_read(stream, flake->paths[1], (size_t)flake->qoutputs * nflake * sizeof(input_t))
+        ;
+
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Truncated data of flake %u in checkpoint.", nflake);
+            free_ofsm(ofsm);
+            return NULL;
+        }
+    }
+
+    return ofsm;
+}
+
+static int do_load_checkpoint(struct ofsm_builder * restrict const me, FILE * const f, unsigned int * restrict const qops)
+{
+    struct checkpoint_stream stream = { f, 0xCBF29CE484222325ull };
+
+    struct checkpoint_header header;
+    if (checkpoint_read(&stream, &header, sizeof(header)) != 0 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || header.stack_len > OFSM_STACK_SZ) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Invalid checkpoint header.");
+        return 1;
+    }
+
+    struct ofsm * stack[OFSM_STACK_SZ];
+    unsigned int qloaded = 0;
+    for (; qloaded < header.stack_len; ++qloaded) {
+        stack[qloaded] = load_checkpoint_ofsm(me, &stream);
+        if (stack[qloaded] == NULL) {
+            break;
+        }
+    }
+
+    uint64_t checksum = 0;
+    const int is_ok = 1
+        && qloaded == header.stack_len
+        && fread(&checksum, 1, sizeof(checksum), f) == sizeof(checksum)
+        && checksum == stream.hash
+    ;
+
+    if (!is_ok) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Checkpoint is truncated or corrupted, %u of %u items loaded.", qloaded, header.stack_len);
+        for (unsigned int i = 0; i < qloaded; ++i) {
+            free_ofsm(stack[i]);
+        }
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        free_ofsm(me->stack[i]);
+    }
+
+    for (unsigned int i = 0; i < qloaded; ++i) {
+        me->stack[i] = stack[i];
+    }
+
+    me->stack_len = qloaded;
+    me->stack_digest = stream.hash;
+    *qops = header.qops;
+    return 0;
+}
+
+int ofsm_builder_load_checkpoint(struct ofsm_builder * restrict const me, FILE * const f)
+{
+    verbose(me->logstream, "START load checkpoint.");
+
+    unsigned int qops;
+    if (do_load_checkpoint(me, f, &qops) != 0) {
+        verbose(me->logstream, "FAILED load checkpoint.");
+        return 1;
+    }
+
+    // Operations which are already in the checkpoint are skipped when the pipeline is replayed
+    me->qops = 0;
+    me->qskip = qops;
+
+    verbose(me->logstream, "DONE load checkpoint, %u operations to skip.", me->qskip);
+    return 0;
+}
+
+static int write_checkpoint_file(const struct ofsm_builder * const me, const char * const path)
+{
+    char tmp_path[strlen(path) + 32];
+    sprintf(tmp_path, "%s.%d.tmp", path, (int)getpid());
+
+    FILE * const f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "fopen(\"%s\", \"wb\") failed with NULL as return value.", tmp_path);
+        return 1;
+    }
+
+    setvbuf(f, NULL, _IOFBF, 1 << 22);
+
+    const int status = ofsm_builder_save_checkpoint(me, f);
+    const int close_status = fclose(f);
+    if (status != 0 || close_status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Saving checkpoint to \"%s\" failed.", tmp_path);
+        remove(tmp_path);
+        return 1;
+    }
+
+    // Rename keeps the previous checkpoint valid until the new one is complete
+    if (rename(tmp_path, path) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "rename(\"%s\", \"%s\") failed.", tmp_path, path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Build cache */
+
+// Bump it when any operation changes its result, old cache entries become misses
+#define CACHE_VERSION       "yoo-ofsm-cache-2"
+
+#define CACHE__NONE         0
+#define CACHE__STORE        1
+#define CACHE__REKEY        2
+
+static const void * get_op_callback(const struct builder_op * const op)
+{
+    switch (op->code) {
+        case OP__PUSH_CUSTOM: return (const void *)op->f.jump;
+        case OP__NARY_PRODUCT: return (const void *)op->f.pack;
+        case OP__PACK: return (const void *)op->f.pack;
+        case OP__PACK_BUCKETS: return (const void *)op->f.pack;
+        case OP__PACK_MULTI: return (const void *)op->f.pack_multi;
+        case OP__PACK_KEY: return (const void *)op->f.pack_key;
+        case OP__OPTIMIZE: return (const void *)op->f.hash;
+        case OP__OPTIMIZE_KEY: return (const void *)op->f.hash_key;
+    }
+
+    return NULL;
+}
+
+static const char * find_callback_name(const struct ofsm_builder * const me, const void * const f)
+{
+    const struct callback_names * const list = me->callback_names;
+    if (list == NULL) {
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < list->qnames; ++i) {
+        if (list->funcs[i] == f) {
+            return list->names[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void free_callback_names(struct ofsm_builder * restrict const me)
+{
+    struct callback_names * const list = me->callback_names;
+    if (list != NULL) {
+        for (unsigned int i = 0; i < list->qnames; ++i) {
+            free(list->names[i]);
+        }
+        free(list->funcs);
+        free(list->names);
+        free(list);
+        me->callback_names = NULL;
+    }
+}
+
+static uint64_t stack_content_digest(const struct ofsm_builder * const me)
+{
+    struct checkpoint_stream stream = { NULL, 0xCBF29CE484222325ull };
+
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        const struct ofsm * const ofsm = me->stack[i];
+        checkpoint_hash(&stream, &ofsm->qflakes, sizeof(ofsm->qflakes));
+        if (ofsm->qvalues > 0) {
+            checkpoint_hash(&stream, ofsm->records, (size_t)ofsm->qrecords * ofsm->qvalues * sizeof(pack_value_t));
+        }
+
+        for (unsigned int nflake = 1; nflake < ofsm->qflakes; ++nflake) {
+            const struct flake * const flake = ofsm->flakes + nflake;
+            const struct checkpoint_flake info = { flake->qinputs, flake->flags, flake->qstates, flake->qoutputs };
+            checkpoint_hash(&stream, &info, sizeof(info));
+            checkpoint_hash(&stream, flake->jumps[1], (size_t)flake->qstates * flake->qinputs * sizeof(state_t));
+        }
+    }
+
+    return stream.hash;
+}
+
+static uint64_t calc_op_digest(const struct ofsm_builder * const me, const struct builder_op * const op)
+{
+    struct checkpoint_stream stream = { NULL, 0xCBF29CE484222325ull };
+
+    const struct {
+        uint64_t stack_digest;
+        uint32_t stack_len;
+        int32_t code;
+        uint32_t qinputs;
+        uint32_t qinputs2;
+        uint32_t m;
+        uint32_t n;
+        uint64_t key_sz;
+    } params = { me->stack_digest, me->stack_len, op->code, op->qinputs, op->qinputs2, op->m, op->n, op->key_sz };
+
+    checkpoint_hash(&stream, CACHE_VERSION, sizeof(CACHE_VERSION));
+    checkpoint_hash(&stream, &params, sizeof(params));
+
+    // Callbacks are identified by registered names, built-in defaults (NULL) by the empty one
+    const void * const callback = get_op_callback(op);
+    const char * const callback_name = callback != NULL ? find_callback_name(me, callback) : "";
+    if (callback_name != NULL) {
+        checkpoint_hash(&stream, callback_name, strlen(callback_name) + 1);
+    }
+
+    // Tables passed by pointer are part of the key
+    if (op->ptr != NULL) {
+        switch (op->code) {
+            case OP__PUSH_CUSTOM:
+                checkpoint_hash(&stream, op->ptr, op->m * sizeof(input_t));
+                break;
+            case OP__PUSH_ARRAY: {
+                const struct ofsm_array * const array = op->ptr;
+                checkpoint_hash(&stream, array->array, array->len * sizeof(uint32_t));
+                if (array->classes != NULL) {
+                    checkpoint_hash(&stream, array->classes, (size_t)array->qflakes * array->classes_width);
+                }
+                if (op->ptr2 != NULL) {
+                    checkpoint_hash(&stream, op->ptr2, array->qflakes * sizeof(input_t));
+                }
+                break;
+            }
+            case OP__SPLIT:
+                checkpoint_hash(&stream, op->ptr, (size_t)op->qinputs * op->qinputs2 * sizeof(input_t));
+                break;
+            case OP__PERMUTE: {
+                const struct ofsm * const ofsm = do_ofsm_builder_get_ofsm(me);
+                if (ofsm != NULL) {
+                    checkpoint_hash(&stream, op->ptr, (ofsm->qflakes - 1) * sizeof(unsigned int));
+                }
+                break;
+            }
+        }
+    }
+
+    const char * const tag = me->cache_tag != NULL ? me->cache_tag : "";
+    checkpoint_hash(&stream, tag, strlen(tag) + 1);
+    return stream.hash;
+}
+
+static void cache_chain(struct ofsm_builder * restrict const me, const struct builder_op * const op)
+{
+    if (me->cache_dir != NULL) {
+        me->pending_digest = calc_op_digest(me, op);
+        me->pending_cache = CACHE__NONE;
+    }
+}
+
+static int cache_lookup(struct ofsm_builder * restrict const me, const struct builder_op * const op)
+{
+    if (me->cache_dir == NULL) {
+        return 0;
+    }
+
+    // Result of an unnamed callback can not be keyed, the stack is keyed by content after the operation
+    const void * const callback = get_op_callback(op);
+    if (callback != NULL && find_callback_name(me, callback) == NULL) {
+        verbose(me->logstream, "CACHE skip for operation code %d, callback is not named.", op->code);
+        me->pending_cache = CACHE__REKEY;
+        return 0;
+    }
+
+    const uint64_t digest = calc_op_digest(me, op);
+    me->pending_digest = digest;
+    me->pending_cache = CACHE__STORE;
+
+    char path[strlen(me->cache_dir) + 32];
+    sprintf(path, "%s/%016lx.ofsm", me->cache_dir, digest);
+
+    FILE * const f = fopen(path, "rb");
+    if (f == NULL) {
+        verbose(me->logstream, "CACHE miss %016lx for operation code %d.", digest, op->code);
+        return 0;
+    }
+
+    unsigned int qops;
+    const int status = do_load_checkpoint(me, f, &qops);
+    fclose(f);
+
+    if (status != 0) {
+        verbose(me->logstream, "CACHE entry %s is broken, operation code %d is executed.", path, op->code);
+        return 0;
+    }
+
+    verbose(me->logstream, "CACHE hit %016lx for operation code %d.", digest, op->code);
+    me->stack_digest = digest;
+    me->pending_cache = CACHE__NONE;
+    return 1;
+}
+
+static int cache_store(struct ofsm_builder * restrict const me)
+{
+    const int pending_cache = me->pending_cache;
+    me->pending_cache = CACHE__NONE;
+
+    if (pending_cache == CACHE__REKEY) {
+        me->stack_digest = stack_content_digest(me);
+        return 0;
+    }
+
+    me->stack_digest = me->pending_digest;
+    if (pending_cache != CACHE__STORE) {
+        return 0;
+    }
+
+    char path[strlen(me->cache_dir) + 32];
+    sprintf(path, "%s/%016lx.ofsm", me->cache_dir, me->stack_digest);
+    return write_checkpoint_file(me, path);
+}
+
+int ofsm_builder_name_callback(struct ofsm_builder * restrict const me, const void * const f, const char * const name)
+{
+    if (f == NULL || name == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Invalid argument: callback and its name might not be NULL.");
+        return 1;
+    }
+
+    if (me->callback_names == NULL) {
+        me->callback_names = calloc(1, sizeof(struct callback_names));
+        if (me->callback_names == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "calloc(1, %lu) failed with NULL as return value.", sizeof(struct callback_names));
+            return 1;
+        }
+    }
+
+    struct callback_names * restrict const list = me->callback_names;
+
+    char * const copy = strdup(name);
+    if (copy == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "strdup(\"%s\") failed with NULL as return value.", name);
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < list->qnames; ++i) {
+        if (list->funcs[i] == f) {
+            free(list->names[i]);
+            list->names[i] = copy;
+            return 0;
+        }
+    }
+
+    if (list->qnames == list->max_names) {
+        const unsigned int max_names = list->max_names != 0 ? 2 * list->max_names : 16;
+        const void ** const funcs = realloc(list->funcs, max_names * sizeof(const void *));
+        if (funcs != NULL) {
+            list->funcs = funcs;
+        }
+
+        char ** const names = funcs != NULL ? realloc(list->names, max_names * sizeof(char *)) : NULL;
+        if (names == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "realloc failed for %u callback names.", max_names);
+            free(copy);
+            return 1;
+        }
+
+        list->names = names;
+        list->max_names = max_names;
+    }
+
+    list->funcs[list->qnames] = f;
+    list->names[list->qnames] = copy;
+    ++list->qnames;
+    return 0;
+}
+
+
+
+static int skip_operation(struct ofsm_builder * restrict const me)
+{
+    if (me->qskip == 0) {
+        return 0;
+    }
+
+    --me->qskip;
+    ++me->qops;
+    verbose(me->logstream, "SKIP operation %u, it is restored from checkpoint.", me->qops);
+    return 1;
+}
+
+static int complete_operation(struct ofsm_builder * restrict const me)
+{
+    const int status = autoverify(me);
+    if (status != 0) {
+        return status;
+    }
+
+    ++me->qops;
+
+    if (me->cache_dir != NULL && cache_store(me) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Storing cache entry %016lx failed.", me->stack_digest);
+        return 1;
+    }
+
+    if (me->checkpoint_path == NULL) {
+        return 0;
+    }
+
+    verbose(me->logstream, "  --> save checkpoint after operation %u.", me->qops);
+    const int save_status = write_checkpoint_file(me, me->checkpoint_path);
+    verbose(me->logstream, "  <<< save checkpoint after operation %u.", me->qops);
+    return save_status;
+}
+
+
+
+static void free_deferred(struct ofsm_builder * restrict const me)
+{
+    struct deferred_list * const list = me->deferred;
+    if (list != NULL) {
+        free(list->ops);
+        free(list);
+        me->deferred = NULL;
+    }
+}
+
+
+struct ofsm_builder * create_ofsm_builder(struct mempool * restrict const arg_mempool, FILE * const errstream)
+{
+    struct mempool * restrict mempool = arg_mempool != NULL ? arg_mempool : create_mempool(4000);
+
+    if (mempool == NULL) {
+        ERRLOCATION(errstream);
+        msg(errstream, "create_mempool(4000) failed with NULL as return value.");
+        return NULL;
+    }
+
+    const size_t sz = sizeof(struct ofsm_builder);
+    struct ofsm_builder * restrict const result = mempool_alloc(mempool, sz);
+    if (result == NULL) {
+        ERRLOCATION(errstream);
+        msg(errstream, "mempool_alloc(actual_mempool, %lu) failed with NULL as return value.", sz);
+    }
+
+    result->flags = 0;
+    if (mempool != arg_mempool) {
+        result->flags |= OBF__OWN_MEMPOOL;
+    }
+
+    result->mempool = mempool;
+    result->logstream = NULL;
+    result->errstream = errstream;
+    result->stack_len = 0;
+    result->user_data = NULL;
+    result->qthreads = 0;
+    result->checkpoint_path = NULL;
+    result->qops = 0;
+    result->qskip = 0;
+    result->deferred = NULL;
+    result->cache_dir = NULL;
+    result->cache_tag = NULL;
+    result->stack_digest = 0xCBF29CE484222325ull;
+    result->pending_digest = 0xCBF29CE484222325ull;
+    result->pending_cache = CACHE__NONE;
+    result->callback_names = NULL;
+    result->shard_dir = NULL;
+    result->qshards = 0;
+    result->verify_samples = 0;
+    result->verify_seconds = 0;
+
+    result->async = mempool_alloc(mempool, sizeof(struct ofsm_async));
+    if (result->async == NULL) {
+        ERRLOCATION(errstream);
+        msg(errstream, "mempool_alloc(mempool, %lu) failed with NULL as return value.", sizeof(struct ofsm_async));
+        return NULL;
+    }
+
+    memset(result->async, 0, sizeof(struct ofsm_async));
+    result->async->status = STATUS__NEW;
+
+    init_choose_table(&result->choose, 0, 0, errstream);
+    return result;
+}
+
+
+
+void free_ofsm_builder(struct ofsm_builder * restrict const me)
+{
+    if (me->async->is_joinable) {
+        ofsm_builder_cancel(me);
+        ofsm_builder_wait(me);
+    }
+
+    clear_choose_table(&me->choose);
+    free_deferred(me);
+    free_callback_names(me);
+
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        free_ofsm(me->stack[i]);
+    }
+
+    if (me->flags & OBF__OWN_MEMPOOL) {
+        free_mempool(me->mempool);
+    }
+}
+
+
+
+/* Deferred execution */
+
+struct deferred_node
+{
+    int kind;
+    struct ofsm * ofsm;
+    unsigned int first_op;
+    unsigned int last_op;
+    unsigned int qchildren;
+    unsigned int children[OFSM_STACK_SZ];
+    unsigned int qthreads;
+    struct ofsm_builder * sub;
+    struct ofsm_async * own_async;
+    int status;
+};
+
+struct deferred_plan
+{
+    const struct ofsm_builder * me;
+    const struct builder_op * ops;
+    struct deferred_node * nodes;
+};
+
+struct deferred_thread_args
+{
+    struct deferred_plan * plan;
+    unsigned int nnode;
+};
+
+static int defer_operation(struct ofsm_builder * restrict const me, const struct builder_op * const op)
+{
+    struct deferred_list * restrict list = me->deferred;
+
+    if (list == NULL) {
+        list = malloc(sizeof(struct deferred_list));
+        if (list == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "malloc(%lu) failed with NULL as return value.", sizeof(struct deferred_list));
+            return 1;
+        }
+
+        list->ops = NULL;
+        list->qops = 0;
+        list->max_ops = 0;
+        me->deferred = list;
+    }
+
+    if (list->qops == list->max_ops) {
+        const unsigned int max_ops = list->max_ops != 0 ? 2 * list->max_ops : 16;
+        struct builder_op * const ops = realloc(list->ops, max_ops * sizeof(struct builder_op));
+        if (ops == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "realloc(ops, %lu) failed with NULL as return value.", max_ops * sizeof(struct builder_op));
+            return 1;
+        }
+
+        list->ops = ops;
+        list->max_ops = max_ops;
+    }
+
+    list->ops[list->qops++] = *op;
+    verbose(me->logstream, "DEFER operation %u, code %d.", list->qops, op->code);
+    return 0;
+}
+
+static int run_deferred_op(struct ofsm_builder * restrict const me, const struct builder_op * const op)
+{
+    switch (op->code) {
+        case OP__PUSH_POW:
+            return ofsm_builder_push_pow(me, op->qinputs, op->m);
+        case OP__PUSH_COMB:
+            return ofsm_builder_push_comb(me, op->qinputs, op->m);
+        case OP__PUSH_ORDERED_COMB:
+            return ofsm_builder_push_ordered_comb(me, op->qinputs, op->m);
+        case OP__PUSH_CUSTOM:
+            return ofsm_builder_push_custom(me, op->m, op->ptr, op->f.jump);
+        case OP__PUSH_ARRAY:
+            return ofsm_builder_push_array(me, op->ptr, op->ptr2, op->n);
+        case OP__PRODUCT:
+            return ofsm_builder_product(me);
+        case OP__NARY_PRODUCT:
+            return ofsm_builder_nary_product(me, op->m, op->f.pack, op->n);
+        case OP__COMPOSE:
+            return ofsm_builder_compose(me);
+        case OP__PACK:
+            return ofsm_builder_pack(me, op->f.pack, op->n);
+        case OP__PACK_BUCKETS:
+            return ofsm_builder_pack_buckets(me, op->f.pack, op->m, op->error);
+        case OP__PACK_MULTI:
+            return ofsm_builder_pack_multi(me, op->f.pack_multi, op->m);
+        case OP__PACK_KEY:
+            return ofsm_builder_pack_key(me, op->f.pack_key, op->key_sz);
+        case OP__OPTIMIZE:
+            return ofsm_builder_optimize(me, op->m, op->n, op->f.hash);
+        case OP__OPTIMIZE_KEY:
+            return ofsm_builder_optimize_key(me, op->m, op->n, op->f.hash_key, op->key_sz);
+        case OP__SPLIT:
+            return ofsm_builder_split(me, op->m, op->qinputs, op->qinputs2, op->ptr);
+        case OP__PERMUTE:
+            return ofsm_builder_permute(me, op->ptr);
+        case OP__FUSE:
+            return ofsm_builder_fuse(me, op->m, op->n);
+        case OP__PRUNE:
+            return ofsm_builder_prune(me);
+    }
+
+    ERRLOCATION(me->errstream);
+    msg(me->errstream, "Unknown deferred operation code %d.", op->code);
+    return 1;
+}
+
+static int adopt_ofsm(struct ofsm_builder * restrict const me, struct ofsm * restrict const src)
+{
+    if (me->stack_len == OFSM_STACK_SZ) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "OFSM stack overflow, stack_len = %u.", me->stack_len);
+        return 1;
+    }
+
+    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, src->max_flakes);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm(me->mempool, %u) failed with NULL as result value.", src->max_flakes);
+        return 1;
+    }
+
+    // Flake data moves to the new owner, the source becomes empty
+    memcpy(ofsm->flakes, src->flakes, src->qflakes * sizeof(struct flake));
+    ofsm->qflakes = src->qflakes;
+    ofsm->qvalues = src->qvalues;
+    ofsm->qrecords = src->qrecords;
+    ofsm->records = src->records;
+
+    src->qflakes = 1;
+    src->qvalues = 0;
+    src->qrecords = 0;
+    src->records = NULL;
+
+    me->stack[me->stack_len++] = ofsm;
+    return 0;
+}
+
+static void * run_deferred_thread(void * const arg);
+
+// Sub-builder shares the parent async state, so it is freed with own one to not wait for the parent task
+static void free_deferred_sub(struct deferred_node * restrict const node)
+{
+    if (node->sub != NULL) {
+        node->sub->async = node->own_async;
+        free_ofsm_builder(node->sub);
+        node->sub = NULL;
+    }
+}
+
+static int run_deferred_nodes(struct deferred_plan * restrict const plan, const unsigned int qnodes, const unsigned int * const nnodes, const unsigned int qthreads)
+{
+    pthread_t threads[qnodes];
+    struct deferred_thread_args args[qnodes];
+    int is_started[qnodes];
+
+    // Independent branches run in own threads, the last one runs in the current thread, builder threads are shared between them
+    for (unsigned int i = 0; i < qnodes; ++i) {
+        const unsigned int qnode_threads = qthreads / qnodes + (i < qthreads % qnodes);
+        plan->nodes[nnodes[i]].qthreads = qnode_threads > 0 ? qnode_threads : 1;
+        args[i].plan = plan;
+        args[i].nnode = nnodes[i];
+        is_started[i] = i + 1 < qnodes && pthread_create(threads + i, NULL, run_deferred_thread, args + i) == 0;
+        if (!is_started[i]) {
+            run_deferred_thread(args + i);
+        }
+    }
+
+    int status = 0;
+    for (unsigned int i = 0; i < qnodes; ++i) {
+        if (is_started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        status |= plan->nodes[nnodes[i]].status;
+    }
+
+    return status;
+}
+
+static int run_deferred_node(struct deferred_plan * restrict const plan, struct deferred_node * restrict const node)
+{
+    const struct ofsm_builder * const me = plan->me;
+
+    if (node->kind == NODE__COMBINE) {
+        const int status = run_deferred_nodes(plan, node->qchildren, node->children, node->qthreads);
+        if (status != 0) {
+            return 1;
+        }
+    }
+
+    struct ofsm_builder * restrict const sub = create_ofsm_builder(NULL, me->errstream);
+    if (sub == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm_builder(NULL, errstream) failed with NULL as result value.");
+        return 1;
+    }
+
+    node->sub = sub;
+    node->own_async = sub->async;
+    sub->async = me->async;
+    sub->flags |= me->flags & (OBF__AUTO_VERIFY | OBF__AUTO_VERIFY_SAMPLED);
+    sub->verify_samples = me->verify_samples;
+    sub->verify_seconds = me->verify_seconds;
+    sub->logstream = me->logstream;
+    sub->user_data = me->user_data;
+    sub->qthreads = node->qthreads;
+
+    if (node->kind == NODE__EXISTING && adopt_ofsm(sub, node->ofsm) != 0) {
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < node->qchildren; ++i) {
+        struct deferred_node * restrict const child = plan->nodes + node->children[i];
+        const int status = adopt_ofsm(sub, child->sub->stack[child->sub->stack_len - 1]);
+        free_deferred_sub(child);
+        if (status != 0) {
+            return 1;
+        }
+    }
+
+    for (unsigned int nop = node->first_op; nop != UINT_MAX; nop = plan->ops[nop].next) {
+        const int status = run_deferred_op(sub, plan->ops + nop);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Deferred operation %u (code %d) failed with %d as error code.", nop + 1, plan->ops[nop].code, status);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void * run_deferred_thread(void * const arg)
+{
+    const struct deferred_thread_args * const args = arg;
+    struct deferred_node * restrict const node = args->plan->nodes + args->nnode;
+    node->status = run_deferred_node(args->plan, node);
+    return NULL;
+}
+
+int ofsm_builder_execute(struct ofsm_builder * restrict const me)
+{
+    struct deferred_list * const list = me->deferred;
+    if (list == NULL || list->qops == 0) {
+        return 0;
+    }
+
+    verbose(me->logstream, "START execute %u deferred operations.", list->qops);
+
+    const unsigned int max_nodes = list->qops + me->stack_len;
+    struct deferred_node * restrict const nodes = malloc(max_nodes * sizeof(struct deferred_node));
+    if (nodes == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "malloc(%lu) failed with NULL as return value.", max_nodes * sizeof(struct deferred_node));
+        verbose(me->logstream, "FAILED execute.");
+        return 1;
+    }
+
+    unsigned int qnodes = 0;
+    unsigned int stack[OFSM_STACK_SZ];
+    unsigned int stack_len = 0;
+
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        const struct deferred_node node = { NODE__EXISTING, me->stack[i], UINT_MAX, UINT_MAX, 0, { 0 }, 0, NULL, NULL, 0 };
+        nodes[qnodes] = node;
+        stack[stack_len++] = qnodes++;
+    }
+
+    { verbose(me->logstream, "  --> build dependency graph.");
+
+        for (unsigned int nop = 0; nop < list->qops; ++nop) {
+            struct builder_op * const op = list->ops + nop;
+            op->next = UINT_MAX;
+
+            const int code = op->code;
+            const int is_push = code >= OP__PUSH_POW && code <= OP__PUSH_ARRAY;
+            const unsigned int qitems = code == OP__NARY_PRODUCT ? op->m : code == OP__PRODUCT || code == OP__COMPOSE ? 2 : 0;
+
+            if ((is_push && stack_len == OFSM_STACK_SZ) || (!is_push && stack_len == 0) || qitems > stack_len) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "Deferred operation %u (code %d) does not match stack with %u items.", nop + 1, code, stack_len);
+                verbose(me->logstream, "FAILED execute.");
+                free(nodes);
+                return 1;
+            }
+
+            if (is_push || qitems > 0) {
+                struct deferred_node node = { is_push ? NODE__PUSH : NODE__COMBINE, NULL, nop, nop, 0, { 0 }, 0, NULL, NULL, 0 };
+                if (qitems > 0) {
+                    stack_len -= qitems;
+                    node.qchildren = qitems;
+                    memcpy(node.children, stack + stack_len, qitems * sizeof(unsigned int));
+                }
+                nodes[qnodes] = node;
+                stack[stack_len++] = qnodes++;
+                continue;
+            }
+
+            struct deferred_node * restrict const top = nodes + stack[stack_len - 1];
+            if (top->first_op == UINT_MAX) {
+                top->first_op = nop;
+            } else {
+                list->ops[top->last_op].next = nop;
+            }
+            top->last_op = nop;
+        }
+
+    } verbose(me->logstream, "  <<< build dependency graph, %u nodes, %u stack items.", qnodes, stack_len);
+
+    struct deferred_plan plan = { me, list->ops, nodes };
+
+    int status;
+
+    { verbose(me->logstream, "  --> run independent branches.");
+        status = run_deferred_nodes(&plan, stack_len, stack, get_qthreads(me));
+    } verbose(me->logstream, "  <<< run independent branches.");
+
+    // Moved out items are empty here, the stack is rebuilt from the branch results
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        free_ofsm(me->stack[i]);
+    }
+    me->stack_len = 0;
+
+    for (unsigned int i = 0; i < stack_len; ++i) {
+        struct ofsm_builder * restrict const sub = nodes[stack[i]].sub;
+        if (status == 0) {
+            status = adopt_ofsm(me, sub->stack[sub->stack_len - 1]);
+        }
+    }
+
+    for (unsigned int i = 0; i < qnodes; ++i) {
+        free_deferred_sub(nodes + i);
+    }
+
+    const unsigned int qexecuted = list->qops;
+    list->qops = 0;
+    free(nodes);
+
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Deferred execution failed, OFSM stack is cleared.");
+        for (unsigned int i = 0; i < me->stack_len; ++i) {
+            free_ofsm(me->stack[i]);
+        }
+        me->stack_len = 0;
+        verbose(me->logstream, "FAILED execute.");
+        return 1;
+    }
+
+    verbose(me->logstream, "DONE execute %u deferred operations.", qexecuted);
+
+    // Recorded operations are counted here, complete_operation adds the last one
+    me->qops += qexecuted - 1;
+
+    if (me->cache_dir != NULL) {
+        me->pending_digest = stack_content_digest(me);
+        me->pending_cache = CACHE__NONE;
+    }
+
+    return complete_operation(me);
+}
+
+
+
+/* Asynchronous execution */
+
+static void * async_worker(void * const arg)
+{
+    struct ofsm_async * restrict const async = arg;
+
+    const int result = async->f(async->me, async->args);
+    async->result = result;
+
+    int status = STATUS__DONE;
+    if (result != 0) {
+        status = __atomic_load_n(&async->cancel, __ATOMIC_RELAXED) ? STATUS__INTERRUPTED : STATUS__FAILED;
+    }
+
+    __atomic_store_n(&async->status, status, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int ofsm_builder_start(struct ofsm_builder * restrict const me, builder_task_func f, void * const args)
+{
+    struct ofsm_async * restrict const async = me->async;
+
+    if (async->is_joinable) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_start is called before ofsm_builder_wait for the previous task.");
+        return 1;
+    }
+
+    const int saved_status = async->status;
+
+    async->f = f;
+    async->args = args;
+    async->me = me;
+    async->result = 0;
+    async->cancel = 0;
+    async->done = 0;
+    async->total = 0;
+    __atomic_store_n(&async->status, STATUS__EXECUTING, __ATOMIC_RELEASE);
+
+    const int create_status = pthread_create(&async->thread, NULL, async_worker, async);
+    if (create_status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "pthread_create failed with %d as error code.", create_status);
+        async->status = saved_status;
+        return 1;
+    }
+
+    async->is_joinable = 1;
+    return 0;
+}
+
+int ofsm_builder_get_status(const struct ofsm_builder * const me, double * restrict const progress)
+{
+    const struct ofsm_async * const async = me->async;
+
+    if (progress != NULL) {
+        const uint64_t total = __atomic_load_n(&async->total, __ATOMIC_RELAXED);
+        const uint64_t done = __atomic_load_n(&async->done, __ATOMIC_RELAXED);
+        *progress = total > 0 && done < total ? (double)done / total : total > 0 ? 1.0 : 0.0;
+    }
+
+    return __atomic_load_n(&async->status, __ATOMIC_ACQUIRE);
+}
+
+void ofsm_builder_cancel(struct ofsm_builder * restrict const me)
+{
+    __atomic_store_n(&me->async->cancel, 1, __ATOMIC_RELAXED);
+}
+
+int ofsm_builder_wait(struct ofsm_builder * restrict const me)
+{
+    struct ofsm_async * restrict const async = me->async;
+
+    if (!async->is_joinable) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_wait is called without started task.");
+        return 1;
+    }
+
+    const int join_status = pthread_join(async->thread, NULL);
+    if (join_status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "pthread_join failed with %d as error code.", join_status);
+        return 1;
+    }
+
+    async->is_joinable = 0;
+    async->cancel = 0;
+    return async->result;
+}
+
+
+
+int ofsm_builder_make_array(const struct ofsm_builder * const me, const unsigned int delta_last, struct ofsm_array * restrict const out)
+{
+    const void * const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm_as_void(me) failed with NULL as error value.");
+        return 1;
+    }
+
+    return ofsm_get_array(ofsm, delta_last, out);
+}
+
+int ofsm_builder_export_array(const struct ofsm_builder * const me, const unsigned int delta_last, const unsigned int flags, struct ofsm_array * restrict const out)
+{
+    const void * const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm_as_void(me) failed with NULL as error value.");
+        return 1;
+    }
+
+    return ofsm_export_array(ofsm, delta_last, flags, out);
+}
+
+
+
+int ofsm_builder_push_pow(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PUSH_POW, .qinputs = qinputs, .m = m };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START push power OFSM(%u, %u) to stack.", (unsigned int)qinputs, m);
+
+    if (me->stack_len == OFSM_STACK_SZ) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_push_pow failed, stack overflow, stack_len = %u, size_sz = %u.", me->stack_len, OFSM_STACK_SZ);
+        verbose(me->logstream, "FAILED push power.");
+        return 1;
+    }
+
+    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, 0);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm(me->mempool, 0) failed with NULL as result value.");
+        verbose(me->logstream, "FAILED push power.");
+        return 1;
+    }
+
+    const struct flake * prev =  ofsm->flakes + ofsm->qflakes - 1;
+
+    for (unsigned int i=0; i<m; ++i) {
+        if (prev->qoutputs == INVALID_STATE) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "state_t overflow: try to assign %u to qstates.", prev->qoutputs);
+            verbose(me->logstream, "FAILED push power.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        const state_t qstates = prev->qoutputs;
+        const uint64_t qoutputs = qstates * qinputs;
+
+        const unsigned int nflake = ofsm->qflakes;
+        const struct flake * const flake = ofsm_create_flake(ofsm, qinputs, qoutputs, qstates);
+
+        if (flake == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_create_flake(me, %u, %lu, %u) faled with NULL as return value.", qinputs, qoutputs, qstates);
+            verbose(me->logstream, "FAILED push power.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        state_t * restrict jumps = flake->jumps[1];
+        state_t output = 0;
+
+        for (uint64_t state=0; state<qstates; ++state)
+        for (uint64_t input=0; input<qinputs; ++input) {
+            *jumps++ = output++;
+        }
+
+        const int status = calc_paths(flake, nflake);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, status);
+            verbose(me->logstream, "FAILED push power.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        prev = flake;
+    }
+
+    me->stack[me->stack_len++] = ofsm;
+    verbose(me->logstream, "DONE push power.");
+    return complete_operation(me);
+}
+
+
+
+struct push_comb_args
+{
+    const struct choose_table * ct;
+    const struct flake * prev;
+    const struct flake * flake;
+    unsigned int len;
+    input_t limit;
+};
+
+static int push_comb_chunk(void * const arg, const uint64_t start, const uint64_t finish)
+{
+    const struct push_comb_args * const args = arg;
+    const struct choose_table * const ct = args->ct;
+    const unsigned int len = args->len;
+    const input_t qinputs = args->flake->qinputs;
+
+    state_t * restrict jumps = args->flake->jumps[1] + start * qinputs;
+    const input_t * path = args->prev->paths[1] + start * len;
+
+    input_t sorted[len + 1];
+    uint64_t delta[len + 1];
+
+    for (uint64_t state = start; state < finish; ++state) {
+        uint64_t mask = 0;
+        for (unsigned int k = 0; k < len; ++k) {
+            mask |= 1ull << path[k];
+        }
+        path += len;
+
+        uint64_t rank = 0;
+        for (unsigned int k = 0; k < len; ++k) {
+            sorted[k] = extract_rbit64(&mask);
+            rank += choose(ct, sorted[k], k+1);
+        }
+        sorted[len] = qinputs;
+
+        // An input inserted at position p shifts all greater inputs one position up,
+        // delta[p] is the total rank change for such shifted inputs (modulo 2^64).
+        delta[len] = 0;
+        for (unsigned int p = len; p-- > 0;) {
+            delta[p] = delta[p+1] + choose(ct, sorted[p], p+2) - choose(ct, sorted[p], p+1);
+        }
+
+        unsigned int p = 0;
+        for (input_t input = 0; input < qinputs; ++input) {
+            if (input == sorted[p]) {
+                *jumps++ = INVALID_STATE; // repetition
+                ++p;
+            } else {
+                *jumps++ = rank + choose(ct, input, p+1) + delta[p];
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int push_ordered_comb_chunk(void * const arg, const uint64_t start, const uint64_t finish)
+{
+    const struct push_comb_args * const args = arg;
+    const struct choose_table * const ct = args->ct;
+    const unsigned int len = args->len;
+    const input_t qinputs = args->flake->qinputs;
+    const input_t limit = args->limit;
+
+    state_t * restrict jumps = args->flake->jumps[1] + start * qinputs;
+    const input_t * path = args->prev->paths[1] + start * len;
+
+    for (uint64_t state = start; state < finish; ++state, path += len) {
+        if (path[0] == INVALID_INPUT) {
+            // Unreachable state: the last input was too large to complete the combination
+            for (input_t input = 0; input < qinputs; ++input) {
+                *jumps++ = INVALID_STATE;
+            }
+            continue;
+        }
+
+        // Only inputs above the current maximum are accepted, they are appended at the end
+        input_t max = path[0];
+        uint64_t rank = 0;
+        for (unsigned int k = 0; k < len; ++k) {
+            if (path[k] > max) max = path[k];
+            rank += choose(ct, path[k], k+1);
+        }
+
+        for (input_t input = 0; input < qinputs; ++input) {
+            const int is_valid = input > max && input < limit;
+            *jumps++ = is_valid ? rank + choose(ct, input, len+1) : INVALID_STATE;
+        }
+    }
+
+    return 0;
+}
+
+static int push_comb(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m, const int is_ordered)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = is_ordered ? OP__PUSH_ORDERED_COMB : OP__PUSH_COMB, .qinputs = qinputs, .m = m };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START push %scompinatoric OFSM(%u, %u) to stack.", is_ordered ? "ordered " : "", (unsigned int)qinputs, m);
+
+    if (me->stack_len == OFSM_STACK_SZ) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_push_comb failed, stack overflow, stack_len = %u, size_sz = %u.", me->stack_len, OFSM_STACK_SZ);
+        verbose(me->logstream, "FAILED push combinatoric.");
+        return 1;
+    }
+
+    if (qinputs > 64) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_push_comb failed, more than 64 inputs (%u) are not supported yet.", (unsigned int)qinputs);
+        verbose(me->logstream, "FAILED push combinatoric.");
+        return 1;
+    }
+
+    if (is_ordered && m > qinputs) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_push_ordered_comb failed, can not choose %u from %u inputs.", m, (unsigned int)qinputs);
+        verbose(me->logstream, "FAILED push combinatoric.");
+        return 1;
+    }
+
+    struct choose_table * restrict const ct = &me->choose;
+    const int status = rebuild_choose_table(ct, qinputs, m);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "rebuild_choose_table(ct, %u, %u, errstream) failed with %d as error code.", (unsigned int)qinputs, m, status);
+        verbose(me->logstream, "FAILED push combinatoric.");
+        return status;
+    }
+
+    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, 0);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm(me->mempool, 0) failed with NULL as result value.");
+        verbose(me->logstream, "FAILED push combinatoric.");
+        return 1;
+    }
+
+    const struct flake * prev =  ofsm->flakes + ofsm->qflakes - 1;
+
+    uint64_t nn = qinputs;
+    uint64_t dd = 1;
+
+    for (unsigned int i=0; i<m; ++i) {
+        if (prev->qoutputs == INVALID_STATE) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "state_t overflow: try to assign %u to qstates.", prev->qoutputs);
+            verbose(me->logstream, "FAILED push combinatoric.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        const state_t qstates = prev->qoutputs;
+        const uint64_t qoutputs = qstates * nn / dd;
+
+        unsigned int nflake = ofsm->qflakes;
+        const struct flake * flake = ofsm_create_flake(ofsm, qinputs, qoutputs, qstates);
+        if (flake == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_create_flake(me, %u, %lu, %u) faled with NULL as return value.", qinputs, qoutputs, qstates);
+            verbose(me->logstream, "FAILED push combinatoric.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        state_t * restrict jumps = flake->jumps[1];
+
+        if (i > 0) {
+            struct push_comb_args args = { ct, prev, flake, i, qinputs - m + i + 1 };
+            const int status = parallel_for(me, qstates, 1024, is_ordered ? push_ordered_comb_chunk : push_comb_chunk, &args);
+            if (status != 0) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "parallel_for(me, %u, 1024, push_comb_chunk, &args) failed with %d as an error code.", qstates, status);
+                verbose(me->logstream, "FAILED push combinatoric.");
+                free_ofsm(ofsm);
+                return 1;
+            }
+        } else {
+            if (qstates != 1) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "Internal error: zero flake should return one output! But qstates = %u.", qstates);
+                verbose(me->logstream, "FAILED push combinatoric.");
+                free_ofsm(ofsm);
+                return 1;
+            }
+
+            for (input_t input = 0; input < qinputs; ++input) {
+                const int is_valid = !is_ordered || input <= qinputs - m;
+                *jumps++ = is_valid ? input : INVALID_STATE;
+            }
+        }
+
+        const int status = calc_paths(flake, nflake);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, status);
+            verbose(me->logstream, "FAILED push combinatoric.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        prev = flake;
+        --nn;
+        ++dd;
+    }
+
+    me->stack[me->stack_len++] = ofsm;
+    verbose(me->logstream, "DONE push combinatoric.");
+    return complete_operation(me);
+}
+
+int ofsm_builder_push_comb(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m)
+{
+    return push_comb(me, qinputs, m, 0);
+}
+
+int ofsm_builder_push_ordered_comb(struct ofsm_builder * restrict const me, const input_t qinputs, const unsigned int m)
+{
+    return push_comb(me, qinputs, m, 1);
+}
+
+
+
+struct push_custom_args
+{
+    void * user_data;
+    jump_func * f;
+    const struct flake * flake;
+    unsigned int nflake;
+    const state_t * user_states;
+    state_t max_output;
+};
+
+static int push_custom_chunk(void * const arg, const uint64_t start, const uint64_t finish)
+{
+    struct push_custom_args * restrict const args = arg;
+    const input_t qinputs = args->flake->qinputs;
+    state_t * restrict jumps = args->flake->jumps[1] + start * qinputs;
+
+    state_t max_output = 0;
+    for (uint64_t state = start; state < finish; ++state)
+    for (input_t input = 0; input < qinputs; ++input) {
+        const state_t user_state = args->user_states != NULL ? args->user_states[state] : state;
+        const state_t output = args->f(args->user_data, args->nflake, user_state, input);
+        if (output != INVALID_STATE && output + 1 > max_output) {
+            max_output = output + 1;
+        }
+        *jumps++ = output;
+    }
+
+    state_t current = __atomic_load_n(&args->max_output, __ATOMIC_RELAXED);
+    while (max_output > current) {
+        if (__atomic_compare_exchange_n(&args->max_output, &current, max_output, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * States returned by the jump function are renumbered in increasing order and unused ones are dropped,
+ * so every output has a path. User states of the outputs are kept to call the function for the next flake.
+ */
+static state_t renumber_custom_outputs(struct flake * restrict const flake, const state_t max_output, state_t ** restrict const user_states)
+{
+    state_t * restrict const ranks = malloc(max_output * sizeof(state_t));
+    if (ranks == NULL) {
+        ERRLOCATION(stderr);
+        msg(stderr, "malloc(%lu) failed with NULL as return value for custom output numbers.", max_output * sizeof(state_t));
+        return INVALID_STATE;
+    }
+
+    for (state_t output = 0; output < max_output; ++output) {
+        ranks[output] = INVALID_STATE;
+    }
+
+    state_t * restrict const jumps = flake->jumps[1];
+    const size_t qjumps = (size_t)flake->qstates * flake->qinputs;
+    for (size_t i = 0; i < qjumps; ++i) {
+        if (jumps[i] != INVALID_STATE) {
+            ranks[jumps[i]] = 0;
+        }
+    }
+
+    state_t qoutputs = 0;
+    for (state_t output = 0; output < max_output; ++output) {
+        if (ranks[output] == 0) {
+            ranks[output] = qoutputs++;
+        }
+    }
+
+    state_t * restrict const next_user_states = malloc((qoutputs > 0 ? qoutputs : 1) * sizeof(state_t));
+    if (next_user_states == NULL) {
+        ERRLOCATION(stderr);
+        msg(stderr, "malloc(%lu) failed with NULL as return value for custom user states.", qoutputs * sizeof(state_t));
+        free(ranks);
+        return INVALID_STATE;
+    }
+
+    for (state_t output = 0; output < max_output; ++output) {
+        if (ranks[output] != INVALID_STATE) {
+            next_user_states[ranks[output]] = output;
+        }
+    }
+
+    for (size_t i = 0; i < qjumps; ++i) {
+        if (jumps[i] != INVALID_STATE) {
+            jumps[i] = ranks[jumps[i]];
+        }
+    }
+
+    free(ranks);
+    free(*user_states);
+    *user_states = next_user_states;
+    return qoutputs;
+}
+
+int ofsm_builder_push_custom(struct ofsm_builder * restrict const me, const unsigned int m, const input_t * const qinputs, jump_func f)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PUSH_CUSTOM, .m = m, .ptr = qinputs, .f.jump = f };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START push custom OFSM(%u) to stack.", m);
+
+    if (me->stack_len == OFSM_STACK_SZ) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_push_custom failed, stack overflow, stack_len = %u, size_sz = %u.", me->stack_len, OFSM_STACK_SZ);
+        verbose(me->logstream, "FAILED push custom.");
+        return 1;
+    }
+
+    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, 0);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm(me->mempool, 0) failed with NULL as result value.");
+        verbose(me->logstream, "FAILED push custom.");
+        return 1;
+    }
+
+    const struct flake * prev =  ofsm->flakes + ofsm->qflakes - 1;
+    state_t * user_states = NULL;
+
+    for (unsigned int i=0; i<m; ++i) {
+        const state_t qstates = prev->qoutputs;
+        const unsigned int nflake = ofsm->qflakes;
+
+        struct flake * restrict const flake = ofsm_create_flake(ofsm, qinputs[i], 0, qstates);
+        if (flake == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_create_flake(me, %u, 0, %u) faled with NULL as return value.", qinputs[i], qstates);
+            verbose(me->logstream, "FAILED push custom.");
+            free_ofsm(ofsm);
+            free(user_states);
+            return 1;
+        }
+
+        verbose(me->logstream, "  --> calc jumps for flake %u.", nflake);
+
+        struct push_custom_args args = { me->user_data, f, flake, nflake, user_states, 0 };
+        const int status = parallel_for(me, qstates, 1024, push_custom_chunk, &args);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "parallel_for(me, %u, 1024, push_custom_chunk, &args) failed with %d as an error code.", qstates, status);
+            verbose(me->logstream, "FAILED push custom.");
+            free_ofsm(ofsm);
+            free(user_states);
+            return 1;
+        }
+
+        const state_t qoutputs = args.max_output > 0 ? renumber_custom_outputs(flake, args.max_output, &user_states) : 0;
+        verbose(me->logstream, "  <<< calc jumps for flake %u, qoutputs = %u of %u.", nflake, qoutputs, args.max_output);
+
+        if (qoutputs == INVALID_STATE) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "renumber_custom_outputs(flake, %u, &user_states) failed for flake %u.", args.max_output, nflake);
+            verbose(me->logstream, "FAILED push custom.");
+            free_ofsm(ofsm);
+            free(user_states);
+            return 1;
+        }
+
+        if (qoutputs == 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "All jumps in flake %u are invalid.", nflake);
+            verbose(me->logstream, "FAILED push custom.");
+            free_ofsm(ofsm);
+            free(user_states);
+            return 1;
+        }
+
+        const size_t path_sizes[2] = { 0, (size_t)qoutputs * nflake * sizeof(input_t) };
+        void * path_ptrs[2];
+        multialloc(2, path_sizes, path_ptrs, 32);
+
+        if (path_ptrs[0] == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for custom flake paths.", path_sizes[0], path_sizes[1]);
+            verbose(me->logstream, "FAILED push custom.");
+            free_ofsm(ofsm);
+            free(user_states);
+            return 1;
+        }
+
+        free(flake->paths[0]);
+        flake->paths[0] = path_ptrs[0];
+        flake->paths[1] = path_ptrs[1];
+        flake->qoutputs = qoutputs;
+
+        const int path_status = calc_paths(flake, nflake);
+        if (path_status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, path_status);
+            verbose(me->logstream, "FAILED push custom.");
+            free_ofsm(ofsm);
+            free(user_states);
+            return 1;
+        }
+
+        prev = flake;
+    }
+
+    free(user_states);
+    me->stack[me->stack_len++] = ofsm;
+    verbose(me->logstream, "DONE push custom.");
+    return complete_operation(me);
+}
+
+
+
+int ofsm_builder_push_array(struct ofsm_builder * restrict const me, const struct ofsm_array * const array, const input_t * const qinputs, const unsigned int delta_last)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PUSH_ARRAY, .ptr = array, .ptr2 = qinputs, .n = delta_last };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START push array with %u flakes to stack.", array->qflakes);
+
+    if (me->stack_len == OFSM_STACK_SZ) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_push_array failed, stack overflow, stack_len = %u, size_sz = %u.", me->stack_len, OFSM_STACK_SZ);
+        verbose(me->logstream, "FAILED push array.");
+        return 1;
+    }
+
+    if (array->classes != NULL || (array->flags & EXPORT_FLAG__ORDERED_INPUTS) != 0 || array->qflakes == 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Only plain arrays might be pushed, qflakes = %u, classes = %p, flags = %u.", array->qflakes, (const void *)array->classes, array->flags);
+        verbose(me->logstream, "FAILED push array.");
+        return 1;
+    }
+
+    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, 0);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm(me->mempool, 0) failed with NULL as result value.");
+        verbose(me->logstream, "FAILED push array.");
+        return 1;
+    }
+
+    // Rows of a flake are stored one after another, they are followed by the rows of the next flake.
+    // Every nonzero entry points into the next flake, so the lowest one marks where it starts.
+
+    const uint32_t * const data = array->array;
+    uint64_t base = array->start_from;
+    state_t qstates = 1;
+
+    for (unsigned int i = 0; i < array->qflakes; ++i) {
+        const unsigned int nflake = i + 1;
+        const input_t flake_qinputs = qinputs != NULL ? qinputs[i] : array->start_from;
+        const int is_last = nflake == array->qflakes;
+        const uint64_t end = base + (uint64_t)qstates * flake_qinputs;
+
+        if (flake_qinputs == 0 || end > array->len) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Invalid array: rows of flake %u (%u states, %u inputs) are out of array length %lu.", nflake, qstates, flake_qinputs, array->len);
+            verbose(me->logstream, "FAILED push array.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        if (is_last && end != array->len) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Invalid array: last flake ends at %lu, but array length is %lu.", end, array->len);
+            verbose(me->logstream, "FAILED push array.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        const input_t next_qinputs = is_last ? 0 : qinputs != NULL ? qinputs[i+1] : array->start_from;
+
+        uint64_t qoutputs = 0;
+        for (uint64_t pos = base; pos < end; ++pos) {
+            const uint32_t value = data[pos];
+            if (is_last) {
+                if (value >= delta_last && (value != 0 || delta_last == 0) && value - delta_last + 1 > qoutputs) {
+                    qoutputs = value - delta_last + 1;
+                }
+            } else if (value != 0) {
+                const uint64_t next_state = (value - end) / next_qinputs + 1;
+                if (value < end || (value - end) % next_qinputs != 0) {
+                    ERRLOCATION(me->errstream);
+                    msg(me->errstream, "Invalid array: entry %lu = %u does not point to a row of flake %u.", pos, value, nflake + 1);
+                    verbose(me->logstream, "FAILED push array.");
+                    free_ofsm(ofsm);
+                    return 1;
+                }
+                if (next_state > qoutputs) {
+                    qoutputs = next_state;
+                }
+            }
+        }
+
+        if (qoutputs == 0 || qoutputs >= INVALID_STATE) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Invalid array: flake %u has %lu outputs.", nflake, qoutputs);
+            verbose(me->logstream, "FAILED push array.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        struct flake * restrict const flake = ofsm_create_flake(ofsm, flake_qinputs, qoutputs, qstates);
+        if (flake == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_create_flake(me, %u, %lu, %u) faled with NULL as return value.", flake_qinputs, qoutputs, qstates);
+            verbose(me->logstream, "FAILED push array.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        state_t * restrict jump = flake->jumps[1];
+        for (uint64_t pos = base; pos < end; ++pos) {
+            const uint32_t value = data[pos];
+            if (is_last) {
+                const int is_valid = value >= delta_last && (value != 0 || delta_last == 0);
+                *jump++ = is_valid ? value - delta_last : INVALID_STATE;
+            } else {
+                *jump++ = value != 0 ? (value - end) / next_qinputs : INVALID_STATE;
+            }
+        }
+
+        const int status = calc_paths(flake, nflake);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, status);
+            verbose(me->logstream, "FAILED push array.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        base = end;
+        qstates = qoutputs;
+    }
+
+    me->stack[me->stack_len++] = ofsm;
+    verbose(me->logstream, "DONE push array.");
+    return complete_operation(me);
+}
+
+
+
+int ofsm_builder_dup(struct ofsm_builder * restrict const me)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    // Dup and drop share flake data, so the recorded graph is executed before them
+    if ((me->flags & OBF__DEFERRED) && ofsm_builder_execute(me) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_execute(me) failed before dup.");
+        return 1;
+    }
+
+    const struct builder_op op = { .code = OP__DUP };
+    cache_chain(me, &op);
+
+    verbose(me->logstream, "START dup.");
+
+    if (me->stack_len == 0 || me->stack_len == OFSM_STACK_SZ) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_dup failed, stack_len = %u, size_sz = %u.", me->stack_len, OFSM_STACK_SZ);
+        verbose(me->logstream, "FAILED dup.");
+        return 1;
+    }
+
+    struct ofsm * restrict const src = me->stack[me->stack_len - 1];
+    struct ofsm * restrict const ofsm = create_ofsm(me->mempool, src->max_flakes);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "create_ofsm(me->mempool, %u) failed with NULL as result value.", src->max_flakes);
+        verbose(me->logstream, "FAILED dup.");
+        return 1;
+    }
+
+    if (src->records != NULL) {
+        const size_t sz = (size_t)src->qrecords * src->qvalues * sizeof(pack_value_t);
+        ofsm->records = malloc(sz > 0 ? sz : 1);
+        if (ofsm->records == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "malloc(%lu) failed with NULL as return value for output records.", sz);
+            verbose(me->logstream, "FAILED dup.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+        memcpy(ofsm->records, src->records, sz);
+        ofsm->qvalues = src->qvalues;
+        ofsm->qrecords = src->qrecords;
+    }
+
+    for (unsigned int nflake = 1; nflake < src->qflakes; ++nflake) {
+        struct flake * restrict const flake = src->flakes + nflake;
+        const int is_jumps_shared = share_block(&flake->jump_refs) == 0;
+        if (!is_jumps_shared || share_block(&flake->path_refs) != 0) {
+            if (is_jumps_shared) {
+                // Source keeps its reference, the counter can not reach zero here
+                release_block(flake->jumps[0], flake->jump_refs);
+            }
+
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Sharing data of flake %u failed.", nflake);
+            verbose(me->logstream, "FAILED dup.");
+            free_ofsm(ofsm);
+            return 1;
+        }
+
+        ofsm->flakes[nflake] = *flake;
+        ofsm->qflakes = nflake + 1;
+    }
+
+    me->stack[me->stack_len++] = ofsm;
+    verbose(me->logstream, "DONE dup.");
+    return complete_operation(me);
+}
+
+int ofsm_builder_drop(struct ofsm_builder * restrict const me)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    // Dup and drop share flake data, so the recorded graph is executed before them
+    if ((me->flags & OBF__DEFERRED) && ofsm_builder_execute(me) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_execute(me) failed before drop.");
+        return 1;
+    }
+
+    const struct builder_op op = { .code = OP__DROP };
+    cache_chain(me, &op);
+
+    verbose(me->logstream, "START drop.");
+
+    if (me->stack_len == 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_drop(me) is called for empty OFSM stack.");
+        verbose(me->logstream, "FAILED drop.");
+        return 1;
+    }
+
+    free_ofsm(me->stack[--me->stack_len]);
+
+    verbose(me->logstream, "DONE drop.");
+    return complete_operation(me);
+}
+
+
+
+static int append_product_flakes(struct ofsm_builder * restrict const me, struct ofsm * restrict const ofsm1, const struct ofsm * const ofsm2, const unsigned int qflakes2)
+{
+    const unsigned int saved_qflakes1 = ofsm1->qflakes;
+    const struct flake * const last1 = ofsm1->flakes + saved_qflakes1 - 1;
+
+    for (unsigned int nflake2 = 1; nflake2 <= qflakes2; ++nflake2) {
+        const struct flake * const flake2 = ofsm2->flakes + nflake2;
+        struct flake * restrict const flake1 = ofsm_create_flake(ofsm1, flake2->qinputs, flake2->qoutputs * last1->qoutputs, flake2->qstates * last1->qoutputs);
+        if (flake1 == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_create_flake(ofsm1, %u, %u, %u) failed with NULL as result.", flake2->qinputs, flake2->qoutputs * last1->qoutputs, flake2->qstates * last1->qoutputs);
+            return 1;
+        }
+
+        flake1->flags = flake2->flags;
+
+        state_t * jump1 = flake1->jumps[1];
+        for (unsigned int output1 = 0; output1 < last1->qoutputs; ++output1) {
+            const state_t * jump2 = flake2->jumps[1];
+            for (unsigned int state2 = 0; state2 < flake2->qstates; ++state2)
+            for (unsigned int input2 = 0; input2 < flake2->qinputs; ++input2) {
+                if (*jump2 == INVALID_STATE) {
+                    *jump1 = INVALID_STATE;
+                } else {
+                    *jump1 = (*jump2) + output1 * flake2->qoutputs;
+                }
+                ++jump1;
+                ++jump2;
+            }
+        }
+
+        input_t * path1 = flake1->paths[1];
+        const unsigned int head_len = saved_qflakes1 - 1;
+        const unsigned int tail_len = nflake2;
+
+        const input_t * head = last1->paths[1];
+        for (unsigned int output1 = 0; output1 < last1->qoutputs; ++output1) {
+            const input_t * tail = flake2->paths[1];
+            for (unsigned int output2 = 0; output2 < flake2->qoutputs; ++output2) {
+                const int is_invalid = (head_len > 0 && head[0] == INVALID_INPUT) || tail[0] == INVALID_INPUT;
+                if (is_invalid) {
+                    memset(path1, INVALID_INPUT, (head_len + tail_len) * sizeof(input_t));
+                    path1 += head_len + tail_len;
+                    tail += tail_len;
+                    continue;
+                }
+                if (head_len > 0) {
+                    memcpy(path1, head, head_len * sizeof(input_t));
+                    path1 += head_len;
+                }
+                memcpy(path1, tail, tail_len * sizeof(input_t));
+                path1 += tail_len;
+                tail += tail_len;
+            }
+            head += head_len;
+        }
+    }
+
+    return 0;
+}
+
+int ofsm_builder_product(struct ofsm_builder * restrict const me)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PRODUCT };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START product.");
+
+    if (me->stack_len < 2) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_product(me) is called for too small OFSM stack, stack_len = %u.", me->stack_len);
+        verbose(me->logstream, "FAILED product.");
+        return 1;
+    }
+
+    struct ofsm * restrict const ofsm1 = me->stack[me->stack_len - 2];
+    struct ofsm * restrict const ofsm2 = me->stack[me->stack_len - 1];
+
+    const unsigned int saved_qflakes1 = ofsm1->qflakes;
+    const int status = append_product_flakes(me, ofsm1, ofsm2, ofsm2->qflakes - 1);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "append_product_flakes(me, ofsm1, ofsm2, %u) failed with %d as error code.", ofsm2->qflakes - 1, status);
+        verbose(me->logstream, "FAILED product.");
+        ofsm_truncate(ofsm1, saved_qflakes1);
+        return 1;
+    }
+
+    free_ofsm(ofsm2);
+    --me->stack_len;
+    ofsm_clear_records(ofsm1);
+
+    verbose(me->logstream, "DONE product.");
+    return complete_operation(me);
+}
+
+
+
+struct nary_pack_args
+{
+    void * user_data;
+    pack_func * f;
+    const struct flake * base;
+    const struct flake * last;
+    unsigned int base_len;
+    unsigned int last_len;
+    pack_value_t * values;
+};
+
+static int nary_pack_chunk(void * const arg, const uint64_t start, const uint64_t finish)
+{
+    const struct nary_pack_args * const args = arg;
+    const unsigned int base_len = args->base_len;
+    const unsigned int last_len = args->last_len;
+    const state_t qlast = args->last->qoutputs;
+
+    input_t path[base_len + last_len];
+
+    for (uint64_t tuple = start; tuple < finish; ++tuple) {
+        const state_t output1 = tuple / qlast;
+        const state_t output2 = tuple % qlast;
+        const input_t * const head = args->base->paths[1] + (uint64_t)output1 * base_len;
+        const input_t * const tail = args->last->paths[1] + (uint64_t)output2 * last_len;
+
+        if ((base_len > 0 && head[0] == INVALID_INPUT) || tail[0] == INVALID_INPUT) {
+            args->values[tuple] = INVALID_PACK_VALUE;
+            continue;
+        }
+
+        memcpy(path, head, base_len * sizeof(input_t));
+        memcpy(path + base_len, tail, last_len * sizeof(input_t));
+        args->values[tuple] = args->f(args->user_data, base_len + last_len, path);
+    }
+
+    return 0;
+}
+
+static int cmp_pack_value(const void * const arg_a, const void * const arg_b)
+{
+    const pack_value_t a = *(const pack_value_t *)arg_a;
+    const pack_value_t b = *(const pack_value_t *)arg_b;
+    if (a < b) return -1;
+    if (a > b) return +1;
+    return 0;
+}
+
+static int append_packed_product_flake(struct ofsm_builder * restrict const me, struct ofsm * restrict const ofsm1, const unsigned int base_nflake, const struct ofsm * const ofsm2, pack_func f, const unsigned int flags)
+{
+    const struct flake * const base = ofsm1->flakes + base_nflake;
+    const unsigned int last_nflake = ofsm2->qflakes - 1;
+    const struct flake * const last = ofsm2->flakes + last_nflake;
+    const uint64_t qtuples = (uint64_t)base->qoutputs * last->qoutputs;
+    const uint64_t qstates = (uint64_t)base->qoutputs * last->qstates;
+
+    if (qstates >= INVALID_STATE) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "state_t overflow: try to assign %lu to qstates.", qstates);
+        return 1;
+    }
+
+    const size_t sizes[4] = { 0,
+        qtuples * sizeof(pack_value_t),
+        qtuples * sizeof(pack_value_t),
+        qtuples * sizeof(state_t),
+    };
+
+    void * ptrs[4];
+    multialloc(4, sizes, ptrs, 32);
+    void * const ptr = ptrs[0];
+
+    if (ptr == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(4, {%lu, %lu, %lu, %lu}, ptrs, 32) failed for temporary product data.", sizes[0], sizes[1], sizes[2], sizes[3]);
+        return 1;
+    }
+
+    pack_value_t * restrict const values = ptrs[1];
+    pack_value_t * restrict const sorted = ptrs[2];
+    state_t * restrict const translate = ptrs[3];
+
+
+
+    verbose(me->logstream, "  --> calculate pack values for %lu tuples.", qtuples);
+
+    struct nary_pack_args args = { me->user_data, f, base, last, base_nflake, last_nflake, values };
+    const int status = parallel_for(me, qtuples, 4096, nary_pack_chunk, &args);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "parallel_for(me, %lu, 4096, nary_pack_chunk, &args) failed with %d as an error code.", qtuples, status);
+        free(ptr);
+        return 1;
+    }
+
+    verbose(me->logstream, "  <<< calculate pack values for %lu tuples.", qtuples);
+
+
+
+    state_t new_qoutputs = 0;
+
+    { verbose(me->logstream, "  --> calc output_translate table.");
+
+        if (flags & PACK_FLAG__SKIP_RENUMERING) {
+            for (uint64_t tuple = 0; tuple < qtuples; ++tuple) {
+                const pack_value_t value = values[tuple];
+                translate[tuple] = value != INVALID_PACK_VALUE ? value : INVALID_STATE;
+                if (value != INVALID_PACK_VALUE && value >= new_qoutputs) {
+                    new_qoutputs = value + 1;
+                }
+            }
+        } else {
+            memcpy(sorted, values, qtuples * sizeof(pack_value_t));
+            qsort(sorted, qtuples, sizeof(pack_value_t), cmp_pack_value);
+
+            uint64_t qunique = 0;
+            for (uint64_t i = 0; i < qtuples; ++i) {
+                if (sorted[i] == INVALID_PACK_VALUE) break;
+                if (qunique == 0 || sorted[qunique-1] != sorted[i]) {
+                    sorted[qunique++] = sorted[i];
+                }
+            }
+
+            for (uint64_t tuple = 0; tuple < qtuples; ++tuple) {
+                const pack_value_t value = values[tuple];
+                if (value == INVALID_PACK_VALUE) {
+                    translate[tuple] = INVALID_STATE;
+                    continue;
+                }
+                const pack_value_t * const found = bsearch(&value, sorted, qunique, sizeof(pack_value_t), cmp_pack_value);
+                translate[tuple] = found - sorted;
+            }
+
+            new_qoutputs = qunique;
+        }
+
+    } verbose(me->logstream, "  <<< calc output_translate table, new qoutputs = %u.", new_qoutputs);
+
+
+
+    const unsigned int nflake = ofsm1->qflakes;
+    struct flake * restrict const flake = ofsm_create_flake(ofsm1, last->qinputs, new_qoutputs, qstates);
+    if (flake == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_create_flake(ofsm1, %u, %u, %lu) failed with NULL as result.", last->qinputs, new_qoutputs, qstates);
+        free(ptr);
+        return 1;
+    }
+
+    flake->flags = last->flags;
+
+    { verbose(me->logstream, "  --> update data and paths.");
+
+        state_t * restrict jump = flake->jumps[1];
+        for (state_t output1 = 0; output1 < base->qoutputs; ++output1) {
+            const state_t * const tuple_translate = translate + (uint64_t)output1 * last->qoutputs;
+            const state_t * jump2 = last->jumps[1];
+            const state_t * const end = jump2 + last->qstates * last->qinputs;
+            for (; jump2 != end; ++jump2) {
+                *jump++ = *jump2 != INVALID_STATE ? tuple_translate[*jump2] : INVALID_STATE;
+            }
+        }
+
+        input_t * restrict const paths = flake->paths[1];
+        memset(paths, INVALID_INPUT, (size_t)new_qoutputs * nflake * sizeof(input_t));
+
+        for (uint64_t tuple = 0; tuple < qtuples; ++tuple) {
+            const state_t output = translate[tuple];
+            if (output == INVALID_STATE) continue;
+
+            input_t * restrict const path = paths + (uint64_t)output * nflake;
+            if (path[0] != INVALID_INPUT) continue;
+
+            const state_t output1 = tuple / last->qoutputs;
+            const state_t output2 = tuple % last->qoutputs;
+            memcpy(path, base->paths[1] + (uint64_t)output1 * base_nflake, base_nflake * sizeof(input_t));
+            memcpy(path + base_nflake, last->paths[1] + (uint64_t)output2 * last_nflake, last_nflake * sizeof(input_t));
+        }
+
+    } verbose(me->logstream, "  <<< update data and paths.");
+
+    free(ptr);
+    return 0;
+}
+
+int ofsm_builder_nary_product(struct ofsm_builder * restrict const me, const unsigned int qitems, pack_func f, const unsigned int flags)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__NARY_PRODUCT, .m = qitems, .f.pack = f, .n = flags };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START %u-ary product.", qitems);
+
+    if (qitems < 2 || me->stack_len < qitems) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_nary_product(me, %u) is called for too small OFSM stack, stack_len = %u.", qitems, me->stack_len);
+        verbose(me->logstream, "FAILED n-ary product.");
+        return 1;
+    }
+
+    const unsigned int first = me->stack_len - qitems;
+    struct ofsm * restrict const ofsm1 = me->stack[first];
+    const unsigned int saved_qflakes1 = ofsm1->qflakes;
+
+    for (unsigned int i = first + 1; i < me->stack_len; ++i) {
+        const struct ofsm * const ofsm2 = me->stack[i];
+        const int is_packed = f != NULL && i + 1 == me->stack_len;
+        const unsigned int base_nflake = ofsm1->qflakes - 1;
+        const unsigned int qflakes2 = ofsm2->qflakes - 1 - is_packed;
+
+        verbose(me->logstream, "  --> append item %u.", i - first);
+
+        int status = append_product_flakes(me, ofsm1, ofsm2, qflakes2);
+        if (status == 0 && is_packed) {
+            status = append_packed_product_flake(me, ofsm1, base_nflake, ofsm2, f, flags);
+        }
+
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Appending item %u failed with %d as error code.", i - first, status);
+            verbose(me->logstream, "FAILED n-ary product.");
+            ofsm_truncate(ofsm1, saved_qflakes1);
+            return 1;
+        }
+
+        verbose(me->logstream, "  <<< append item %u, qflakes = %u.", i - first, ofsm1->qflakes - 1);
+    }
+
+    for (unsigned int i = first + 1; i < me->stack_len; ++i) {
+        free_ofsm(me->stack[i]);
+    }
+
+    me->stack_len = first + 1;
+    ofsm_clear_records(ofsm1);
+
+    verbose(me->logstream, "DONE %u-ary product.", qitems);
+    return complete_operation(me);
+}
+
+
+
+int ofsm_builder_compose(struct ofsm_builder * restrict const me)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__COMPOSE };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START compose.");
+
+    if (me->stack_len < 2) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_compose(me) is called for too small OFSM stack, stack_len = %u.", me->stack_len);
+        verbose(me->logstream, "FAILED compose.");
+        return 1;
+    }
+
+    struct ofsm * restrict const inner = me->stack[me->stack_len - 1];
+    struct ofsm * restrict const outer = me->stack[me->stack_len - 2];
+
+    if (inner->qflakes <= 1 || outer->qflakes <= 1) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Try to compose empty OFSM, outer qflakes = %u, inner qflakes = %u.", outer->qflakes, inner->qflakes);
+        verbose(me->logstream, "FAILED compose.");
+        return 1;
+    }
+
+    const unsigned int saved_qflakes = inner->qflakes;
+    struct flake * restrict const inner_last = inner->flakes + saved_qflakes - 1;
+    const struct flake * const outer_first = outer->flakes + 1;
+
+    if (outer_first->qinputs < inner_last->qoutputs) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Inner OFSM has %u outputs, but the first flake of outer OFSM accepts only %u inputs.", inner_last->qoutputs, outer_first->qinputs);
+        verbose(me->logstream, "FAILED compose.");
+        return 1;
+    }
+
+    if (inner->qflakes - 1 + outer->qflakes - 2 >= inner->max_flakes) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Overflow maximum flake count (%u) for composition of %u and %u flakes.", inner->max_flakes, inner->qflakes - 1, outer->qflakes - 1);
+        verbose(me->logstream, "FAILED compose.");
+        return 1;
+    }
+
+    if (flake_own_jumps(inner_last) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "flake_own_jumps(inner_last) failed.");
+        verbose(me->logstream, "FAILED compose.");
+        return 1;
+    }
+
+    const size_t path_sizes[2] = { 0, (size_t)outer_first->qoutputs * (saved_qflakes - 1) * sizeof(input_t) };
+    void * path_ptrs[2];
+    multialloc(2, path_sizes, path_ptrs, 32);
+    if (path_ptrs[0] == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for composed flake paths.", path_sizes[0], path_sizes[1]);
+        verbose(me->logstream, "FAILED compose.");
+        return 1;
+    }
+
+    for (unsigned int nflake = 2; nflake < outer->qflakes; ++nflake) {
+        const struct flake * const flake = outer->flakes + nflake;
+        struct flake * restrict const infant = ofsm_create_flake(inner, flake->qinputs, flake->qoutputs, flake->qstates);
+        if (infant == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_create_flake(inner, %u, %u, %u) failed with NULL as result.", flake->qinputs, flake->qoutputs, flake->qstates);
+            verbose(me->logstream, "FAILED compose.");
+            ofsm_truncate(inner, saved_qflakes);
+            free(path_ptrs[0]);
+            return 1;
+        }
+
+        memcpy(infant->jumps[1], flake->jumps[1], (size_t)flake->qstates * flake->qinputs * sizeof(state_t));
+        infant->flags = flake->flags;
+    }
+
+
+
+    { verbose(me->logstream, "  --> feed inner outputs to the outer first flake.");
+
+        // Only state 0 exists in the first flake, its row translates inner outputs
+        state_t * restrict jump = inner_last->jumps[1];
+        const state_t * const end = jump + (size_t)inner_last->qstates * inner_last->qinputs;
+        for (; jump != end; ++jump) {
+            if (*jump != INVALID_STATE) {
+                *jump = outer_first->jumps[1][*jump];
+            }
+        }
+
+        flake_release_paths(inner_last);
+        inner_last->paths[0] = path_ptrs[0];
+        inner_last->paths[1] = path_ptrs[1];
+        inner_last->qoutputs = outer_first->qoutputs;
+        inner_last->flags = outer_first->flags;
+
+    } verbose(me->logstream, "  <<< feed inner outputs to the outer first flake.");
+
+
+
+    { verbose(me->logstream, "  --> calc paths.");
+
+        for (unsigned int nflake = saved_qflakes - 1; nflake < inner->qflakes; ++nflake) {
+            const int status = calc_paths(inner->flakes + nflake, nflake);
+            if (status != 0) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, status);
+                verbose(me->logstream, "FAILED compose.");
+                return 1;
+            }
+        }
+
+    } verbose(me->logstream, "  <<< calc paths.");
+
+
+
+    // Final outputs are the outputs of the outer OFSM, so are the records
+    ofsm_clear_records(inner);
+    inner->qvalues = outer->qvalues;
+    inner->qrecords = outer->qrecords;
+    inner->records = outer->records;
+    outer->records = NULL;
+
+    free_ofsm(outer);
+    me->stack[me->stack_len - 2] = inner;
+    --me->stack_len;
+
+    verbose(me->logstream, "DONE compose.");
+    return complete_operation(me);
+}
+
+
+
+static int ofsm_builder_replace_last_flake(struct ofsm_builder * restrict const me, struct ofsm * restrict const ofsm, const state_t * const translate, const state_t new_qoutputs)
+{
+    const unsigned int nflake = ofsm->qflakes - 1;
+    const struct flake oldman = ofsm->flakes[nflake];
+
+    --ofsm->qflakes;
+    struct flake * restrict const infant = ofsm_create_flake(ofsm, oldman.qinputs, new_qoutputs, oldman.qstates);
+    if (infant == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_create_flake(me, %u, %u, %u) faled with NULL as return value in pack step.", oldman.qinputs, new_qoutputs, oldman.qstates);
+        ++ofsm->qflakes;
+        return 1;
+    }
+
+    infant->flags = oldman.flags;
+    ofsm_clear_records(ofsm);
+
+
+
+    { verbose(me->logstream, "  --> update data.");
+
+        const state_t * old = oldman.jumps[1];
+        const state_t * const end = old + oldman.qstates * oldman.qinputs;
+        state_t * restrict new = infant->jumps[1];
+
+        for (; old != end; ++old) {
+            if (*old != INVALID_STATE) {
+                *new++ = translate[*old];
+            } else {
+                *new++ = INVALID_STATE;
+            }
+        }
+
+    } verbose(me->logstream, "  <<< update data.");
+
+
+
+    { verbose(me->logstream, "  --> update paths.");
+
+        input_t * restrict const new_paths = infant->paths[1];
+        const size_t new_path_len = (size_t)new_qoutputs * nflake;
+        for (size_t i = 0; i < new_path_len; ++i) {
+            new_paths[i] = INVALID_INPUT;
+        }
+
+        const input_t * old_path = oldman.paths[1];
+        const size_t sz = sizeof(input_t) * nflake;
+        for (state_t old_output = 0; old_output < oldman.qoutputs; ++old_output, old_path += nflake) {
+            const state_t new_output = translate[old_output];
+            if (new_output == INVALID_STATE) continue;
+            input_t * restrict const new_path = new_paths + new_output * nflake;
+            if (new_path[0] == INVALID_INPUT) {
+                memcpy(new_path, old_path, sz);
+            }
+        }
+
+    } verbose(me->logstream, "  <<< update paths.");
+
+    release_block(oldman.jumps[0], oldman.jump_refs);
+    release_block(oldman.paths[0], oldman.path_refs);
+    return 0;
+}
+
+/* Sharded packing */
+
+#define SHARD_ATTEMPTS      3
+#define SHARD_BATCH_SZ      4096
+
+struct shard
+{
+    uint64_t start;
+    uint64_t finish;
+    pid_t pid;
+    unsigned int attempts;
+    int is_done;
+};
+
+struct shard_run
+{
+    FILE * f;
+    uint64_t start;
+    uint64_t finish;
+    uint64_t left;
+    pack_value_t value;
+    state_t output;
+};
+
+static unsigned int shard_seq = 0;
+
+static int save_shard_flake(const struct ofsm_builder * const me, const char * const path, const struct flake * const flake, const unsigned int nflake)
+{
+    FILE * const f = fopen(path, "wb");
+    if (f == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "fopen(\"%s\", \"wb\") failed with NULL as return value.", path);
+        return 1;
+    }
+
+    setvbuf(f, NULL, _IOFBF, 1 << 22);
+
+    const uint64_t qoutputs = flake->qoutputs;
+    const size_t sz = (size_t)flake->qoutputs * nflake;
+    int is_ok = 1
+        && fwrite(&nflake, sizeof(nflake), 1, f) == 1
+        && fwrite(&qoutputs, sizeof(qoutputs), 1, f) == 1
+        && fwrite(flake->paths[1], sizeof(input_t), sz, f) == sz
+    ;
+
+    if (fclose(f) != 0) {
+        is_ok = 0;
+    }
+
+    if (!is_ok) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Writing flake paths to \"%s\" failed.", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int write_shard_run(const struct ofsm_builder * const me, const char * const path, const uint64_t start, const uint64_t finish, const struct ofsm_pack_decode * const items)
+{
+    char tmp_path[strlen(path) + 8];
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE * const f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "fopen(\"%s\", \"wb\") failed with NULL as return value.", tmp_path);
+        return 1;
+    }
+
+    setvbuf(f, NULL, _IOFBF, 1 << 22);
+
+    int is_ok = 1
+        && fwrite(&start, sizeof(start), 1, f) == 1
+        && fwrite(&finish, sizeof(finish), 1, f) == 1
+    ;
+
+    for (uint64_t i = 0; is_ok && i < finish - start; ++i) {
+        is_ok = 1
+            && fwrite(&items[i].value, sizeof(pack_value_t), 1, f) == 1
+            && fwrite(&items[i].output, sizeof(state_t), 1, f) == 1
+        ;
+    }
+
+    if (fclose(f) != 0) {
+        is_ok = 0;
+    }
+
+    // Merge step never sees a half written run, only a missing one
+    if (!is_ok || rename(tmp_path, path) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Writing shard run to \"%s\" failed.", path);
+        remove(tmp_path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Shard worker: pack values for outputs [start, finish) are calculated from the on-disk flake,
+ * sorted and written as a run. It does not touch builder memory, so it might run on any host sharing shard_dir.
+ */
+static int run_pack_shard(const struct ofsm_builder * const me, const char * const prefix, const unsigned int nshard, const uint64_t start, const uint64_t finish, pack_func f)
+{
+    char path[strlen(prefix) + 32];
+    sprintf(path, "%s.flake", prefix);
+
+    FILE * const flake_file = fopen(path, "rb");
+    if (flake_file == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "fopen(\"%s\", \"rb\") failed with NULL as return value.", path);
+        return 1;
+    }
+
+    unsigned int nflake;
+    uint64_t qoutputs;
+    const int is_header_ok = 1
+        && fread(&nflake, sizeof(nflake), 1, flake_file) == 1
+        && fread(&qoutputs, sizeof(qoutputs), 1, flake_file) == 1
+        && finish <= qoutputs
+        && fseeko(flake_file, (off_t)start * nflake, SEEK_CUR) == 0
+    ;
+
+    if (!is_header_ok) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Flake file \"%s\" is broken or does not contain outputs [%lu, %lu).", path, start, finish);
+        fclose(flake_file);
+        return 1;
+    }
+
+    const uint64_t qitems = finish - start;
+    struct ofsm_pack_decode * restrict const items = malloc(qitems * sizeof(struct ofsm_pack_decode) + SHARD_BATCH_SZ * nflake);
+    if (items == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "malloc(%lu) failed with NULL as return value.", qitems * sizeof(struct ofsm_pack_decode) + SHARD_BATCH_SZ * nflake);
+        fclose(flake_file);
+        return 1;
+    }
+
+    input_t * restrict const paths = (input_t *)(items + qitems);
+
+    for (uint64_t i = 0; i < qitems; i += SHARD_BATCH_SZ) {
+        const uint64_t qbatch = qitems - i < SHARD_BATCH_SZ ? qitems - i : SHARD_BATCH_SZ;
+        if (fread(paths, nflake, qbatch, flake_file) != qbatch) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Unexpected end of flake file \"%s\" at output %lu.", path, start + i);
+            fclose(flake_file);
+            free(items);
+            return 1;
+        }
+
+        const input_t * path_ptr = paths;
+        for (uint64_t j = 0; j < qbatch; ++j, path_ptr += nflake) {
+            items[i + j].output = start + i + j;
+            items[i + j].value = f(me->user_data, nflake, path_ptr);
+        }
+    }
+
+    fclose(flake_file);
+
+    qsort(items, qitems, sizeof(struct ofsm_pack_decode), &cmp_ofsm_pack_decode);
+
+    sprintf(path, "%s.%u.run", prefix, nshard);
+    const int status = write_shard_run(me, path, start, finish, items);
+    free(items);
+    return status;
+}
+
+static int start_pack_shard(const struct ofsm_builder * const me, const char * const prefix, const unsigned int nshard, struct shard * restrict const shard, pack_func f)
+{
+    if (me->logstream != NULL) fflush(me->logstream);
+    if (me->errstream != NULL) fflush(me->errstream);
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "fork() failed for shard %u.", nshard);
+        return 1;
+    }
+
+    if (pid == 0) {
+        const int status = run_pack_shard(me, prefix, nshard, shard->start, shard->finish, f);
+        if (me->errstream != NULL) fflush(me->errstream);
+        _exit(status == 0 ? 0 : 1);
+    }
+
+    shard->pid = pid;
+    ++shard->attempts;
+    return 0;
+}
+
+static void kill_pack_shards(struct shard * restrict const shards, const unsigned int qshards)
+{
+    for (unsigned int i = 0; i < qshards; ++i) {
+        if (shards[i].pid > 0) {
+            kill(shards[i].pid, SIGKILL);
+            waitpid(shards[i].pid, NULL, 0);
+            shards[i].pid = 0;
+        }
+    }
+}
+
+static int wait_pack_shards(const struct ofsm_builder * const me, const char * const prefix, struct shard * restrict const shards, const unsigned int qshards, pack_func f)
+{
+    const struct timespec pause = { 0, 10 * 1000 * 1000 };
+    unsigned int qdone = 0;
+
+    while (qdone < qshards) {
+
+        if (is_cancelled(me)) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Sharded packing is interrupted with %u of %u shards done.", qdone, qshards);
+            kill_pack_shards(shards, qshards);
+            return 1;
+        }
+
+        int is_changed = 0;
+        for (unsigned int i = 0; i < qshards; ++i) {
+            struct shard * restrict const shard = shards + i;
+            if (shard->is_done) continue;
+
+            int wstatus;
+            const pid_t pid = waitpid(shard->pid, &wstatus, WNOHANG);
+            if (pid == 0) continue;
+
+            is_changed = 1;
+            shard->pid = 0;
+
+            if (pid > 0 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) {
+                shard->is_done = 1;
+                ++qdone;
+                progress_add(me, 1);
+                continue;
+            }
+
+            verbose(me->logstream, "      shard %u failed on attempt %u of %u.", i, shard->attempts, SHARD_ATTEMPTS);
+
+            if (shard->attempts >= SHARD_ATTEMPTS) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "Shard %u for outputs [%lu, %lu) failed %u times.", i, shard->start, shard->finish, shard->attempts);
+                kill_pack_shards(shards, qshards);
+                return 1;
+            }
+
+            if (start_pack_shard(me, prefix, i, shard, f) != 0) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "start_pack_shard(me, \"%s\", %u, shard, f) failed on retry.", prefix, i);
+                kill_pack_shards(shards, qshards);
+                return 1;
+            }
+        }
+
+        if (!is_changed) {
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    return 0;
+}
+
+static int read_run_item(struct shard_run * restrict const run)
+{
+    if (run->left == 0) {
+        return 0;
+    }
+
+    --run->left;
+    const int is_ok = 1
+        && fread(&run->value, sizeof(pack_value_t), 1, run->f) == 1
+        && fread(&run->output, sizeof(state_t), 1, run->f) == 1
+        && run->output >= run->start && run->output < run->finish
+    ;
+
+    return is_ok ? 1 : -1;
+}
+
+static inline int is_run_less(const struct shard_run * const a, const struct shard_run * const b)
+{
+    if (a->value != b->value) return a->value < b->value;
+    return a->output < b->output;
+}
+
+static void sift_run_heap(struct shard_run * * restrict const heap, const unsigned int qheap, unsigned int i)
+{
+    for (;;) {
+        unsigned int least = i;
+        const unsigned int left = 2 * i + 1;
+        const unsigned int right = left + 1;
+        if (left < qheap && is_run_less(heap[left], heap[least])) least = left;
+        if (right < qheap && is_run_less(heap[right], heap[least])) least = right;
+        if (least == i) return;
+
+        struct shard_run * const tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+/*
+ * K-way merge of sorted runs gives the same order as a sort of the whole decode table,
+ * so translate is equal to the one calculated in memory.
+ */
+static int merge_pack_shards(const struct ofsm_builder * const me, const char * const prefix, const struct shard * const shards, const unsigned int qshards, const int skip_renumering, state_t * restrict const translate, state_t * restrict const new_qoutputs)
+{
+    struct shard_run * restrict const runs = calloc(qshards, sizeof(struct shard_run) + sizeof(struct shard_run *));
+    if (runs == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "calloc(%u, %lu) failed with NULL as return value.", qshards, sizeof(struct shard_run) + sizeof(struct shard_run *));
+        return 1;
+    }
+
+    struct shard_run * * restrict const heap = (struct shard_run * *)(runs + qshards);
+    unsigned int qheap = 0;
+    int status = 0;
+
+    for (unsigned int i = 0; status == 0 && i < qshards; ++i) {
+        char path[strlen(prefix) + 32];
+        sprintf(path, "%s.%u.run", prefix, i);
+
+        struct shard_run * restrict const run = runs + i;
+        run->f = fopen(path, "rb");
+        if (run->f == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "fopen(\"%s\", \"rb\") failed with NULL as return value.", path);
+            status = 1;
+            break;
+        }
+
+        const int is_header_ok = 1
+            && fread(&run->start, sizeof(run->start), 1, run->f) == 1
+            && fread(&run->finish, sizeof(run->finish), 1, run->f) == 1
+            && run->start == shards[i].start
+            && run->finish == shards[i].finish
+        ;
+
+        if (!is_header_ok) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Shard run \"%s\" has invalid header.", path);
+            status = 1;
+            break;
+        }
+
+        run->left = run->finish - run->start;
+        const int read_status = read_run_item(run);
+        if (read_status < 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Shard run \"%s\" is broken.", path);
+            status = 1;
+            break;
+        }
+
+        if (read_status > 0) {
+            heap[qheap++] = run;
+        }
+    }
+
+    for (unsigned int i = qheap / 2; i-- > 0; ) {
+        sift_run_heap(heap, qheap, i);
+    }
+
+    pack_value_t max_value = 0;
+    pack_value_t prev_value = 0;
+    state_t new_output = INVALID_STATE;
+    state_t qnew = 0;
+    int is_first = 1;
+
+    while (status == 0 && qheap > 0) {
+        struct shard_run * restrict const run = heap[0];
+
+        if (is_first || run->value != prev_value) {
+            is_first = 0;
+            prev_value = run->value;
+            if (run->value > max_value) max_value = run->value;
+
+            if (run->value == INVALID_PACK_VALUE) {
+                new_output = INVALID_STATE;
+            } else if (skip_renumering) {
+                new_output = run->value;
+            } else {
+                new_output = qnew++;
+            }
+        }
+
+        translate[run->output] = new_output;
+
+        const int read_status = read_run_item(run);
+        if (read_status < 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Shard run for outputs [%lu, %lu) is broken.", run->start, run->finish);
+            status = 1;
+            break;
+        }
+
+        if (read_status == 0) {
+            heap[0] = heap[--qheap];
+        }
+
+        sift_run_heap(heap, qheap, 0);
+    }
+
+    for (unsigned int i = 0; i < qshards; ++i) {
+        if (runs[i].f != NULL) {
+            fclose(runs[i].f);
+        }
+    }
+
+    free(runs);
+    *new_qoutputs = skip_renumering ? max_value + 1 : qnew;
+    return status;
+}
+
+static void remove_shard_files(const char * const prefix, const unsigned int qshards)
+{
+    char path[strlen(prefix) + 32];
+    sprintf(path, "%s.flake", prefix);
+    remove(path);
+
+    for (unsigned int i = 0; i < qshards; ++i) {
+        sprintf(path, "%s.%u.run", prefix, i);
+        remove(path);
+        sprintf(path, "%s.%u.run.tmp", prefix, i);
+        remove(path);
+    }
+}
+
+static int ofsm_builder_pack_in_shards(struct ofsm_builder * restrict const me, struct ofsm * restrict const ofsm, pack_func f, const int skip_renumering)
+{
+    const unsigned int nflake = ofsm->qflakes - 1;
+    const struct flake * const oldman = ofsm->flakes + nflake;
+    const uint64_t old_qoutputs = oldman->qoutputs;
+    const unsigned int qshards = old_qoutputs < me->qshards ? (old_qoutputs > 0 ? old_qoutputs : 1) : me->qshards;
+
+    const size_t sizes[3] = { 0,
+        qshards * sizeof(struct shard),
+        old_qoutputs * sizeof(state_t),
+    };
+
+    void * ptrs[3];
+    multialloc(3, sizes, ptrs, 32);
+    void * const ptr = ptrs[0];
+
+    if (ptr == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "  multialloc(3, {%lu, %lu, %lu}, ptrs, 32) failed for temporary packing data.", sizes[0], sizes[1], sizes[2]);
+        verbose(me->logstream, "FAILED packing.");
+        return 1;
+    }
+
+    struct shard * restrict const shards = ptrs[1];
+    state_t * restrict const translate = ptrs[2];
+
+    char prefix[strlen(me->shard_dir) + 64];
+    sprintf(prefix, "%s/pack.%d.%u", me->shard_dir, (int)getpid(), __atomic_fetch_add(&shard_seq, 1, __ATOMIC_RELAXED));
+
+    const uint64_t shard_sz = (old_qoutputs + qshards - 1) / qshards;
+    for (unsigned int i = 0; i < qshards; ++i) {
+        const uint64_t start = i * shard_sz;
+        shards[i].start = start < old_qoutputs ? start : old_qoutputs;
+        shards[i].finish = start + shard_sz < old_qoutputs ? start + shard_sz : old_qoutputs;
+        shards[i].pid = 0;
+        shards[i].attempts = 0;
+        shards[i].is_done = 0;
+    }
+
+    int status = 0;
+
+    { verbose(me->logstream, "  --> calculate pack values in %u shards of %lu outputs.", qshards, shard_sz);
+
+        char flake_path[sizeof(prefix) + 8];
+        sprintf(flake_path, "%s.flake", prefix);
+
+        status = save_shard_flake(me, flake_path, oldman, nflake);
+        if (status == 0) {
+            progress_start(me, qshards);
+            for (unsigned int i = 0; status == 0 && i < qshards; ++i) {
+                status = start_pack_shard(me, prefix, i, shards + i, f);
+            }
+
+            if (status == 0) {
+                status = wait_pack_shards(me, prefix, shards, qshards, f);
+            } else {
+                kill_pack_shards(shards, qshards);
+            }
+
+            progress_finish(me);
+        }
+
+    } verbose(me->logstream, "  <<< calculate pack values in %u shards.", qshards);
+
+
+
+    state_t new_qoutputs = 0;
+
+    if (status == 0) {
+        verbose(me->logstream, "  --> merge shard runs.");
+        status = merge_pack_shards(me, prefix, shards, qshards, skip_renumering, translate, &new_qoutputs);
+        verbose(me->logstream, "  <<< merge shard runs.");
+    }
+
+    remove_shard_files(prefix, qshards);
+
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Sharded calculation of pack values in \"%s\" failed.", me->shard_dir);
+        verbose(me->logstream, "FAILED packing.");
+        free(ptr);
+        return 1;
+    }
+
+
+
+    status = ofsm_builder_replace_last_flake(me, ofsm, translate, new_qoutputs);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_replace_last_flake(me, ofsm, translate, %u) failed with %d as error code.", new_qoutputs, status);
+        verbose(me->logstream, "FAILED packing.");
+        free(ptr);
+        return 1;
+    }
+
+
+
+    free(ptr);
+    verbose(me->logstream, "DONE pack step in %u shards, new qoutputs = %u.", qshards, new_qoutputs);
+
+    return complete_operation(me);
+}
+
+
+
+int ofsm_builder_pack(struct ofsm_builder * restrict const me, pack_func f, const unsigned int flags)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PACK, .f.pack = f, .n = flags };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START packing.");
+
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
+        verbose(me->logstream, "FAILED packing.");
+        return 1;
+    }
+
+    if (ofsm->qflakes <= 1) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Try to pack empty OFSM.");
+        verbose(me->logstream, "FAILED packing.");
+        return 1;
+    }
+
+    const int skip_renumering = (flags & PACK_FLAG__SKIP_RENUMERING) != 0;
+    const unsigned int nflake = ofsm->qflakes - 1;
+    const struct flake oldman = ofsm->flakes[nflake];
+    const uint64_t old_qoutputs = oldman.qoutputs;
+
+    if (me->shard_dir != NULL && me->qshards > 1) {
+        return ofsm_builder_pack_in_shards(me, ofsm, f, skip_renumering);
+    }
+
+    const size_t sizes[3] = { 0,
+        (1 + old_qoutputs) * sizeof(struct ofsm_pack_decode),
+        old_qoutputs * sizeof(state_t),
+    };
+
+    void * ptrs[3];
+    multialloc(3, sizes, ptrs, 32);
+    void * const ptr = ptrs[0];
+
+    if (ptr == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "  multialloc(4, {%lu, %lu, %lu}, ptrs, 32) failed for temporary packing data.", sizes[0], sizes[1], sizes[2]);
+        verbose(me->logstream, "FAILED packing.");
+        return 1;
+    }
+
+    struct ofsm_pack_decode * const decode_table = ptrs[1];
+    state_t * restrict const translate = ptrs[2];
+
+
+
+    pack_value_t max_value = 0;
+
+    { verbose(me->logstream, "  --> calculate pack values.");
+
+        progress_start(me, old_qoutputs);
+
+        struct ofsm_pack_decode * restrict curr = decode_table;
+        const input_t * path = oldman.paths[1];
+        for (size_t output = 0; output < old_qoutputs; ++output) {
+            if ((output & 0xFFFF) == 0 && output > 0) {
+                progress_add(me, 0x10000);
+                if (is_cancelled(me)) {
+                    ERRLOCATION(me->errstream);
+                    msg(me->errstream, "Packing is interrupted after %lu outputs.", output);
+                    verbose(me->logstream, "FAILED packing.");
+                    free(ptr);
+                    return 1;
+                }
+            }
+
+            curr->output = output;
+            curr->value = f(me->user_data, nflake, path);
+            if (curr->value > max_value) max_value = curr->value;
+            path += nflake;
+            ++curr;
+        }
+
+        curr->output = INVALID_STATE;
+        curr->value = INVALID_PACK_VALUE;
+        progress_finish(me);
+
+    } verbose(me->logstream, "  <<< calculate pack values, max value is %lu (0x%lx).", max_value, max_value);
+
+
+
+    { verbose(me->logstream, "  --> sort new states.");
+        qsort(decode_table, old_qoutputs, sizeof(struct ofsm_pack_decode), &cmp_ofsm_pack_decode);
+    } verbose(me->logstream, "  <<< sort new states.");
+
+
+
+    state_t new_qoutputs = 0;
+
+    if (skip_renumering) {
+
+        verbose(me->logstream, "  --> calc output_translate table without renumering.");
+
+        new_qoutputs = max_value + 1;
+
+        const struct ofsm_pack_decode * left = decode_table;
+        const struct ofsm_pack_decode * const end = decode_table + old_qoutputs;
+
+        while (left != end) {
+
+            const struct ofsm_pack_decode * right = left + 1;
+            while (right != end && right->value == left->value) {
+                ++right;
+            }
+
+            const state_t new_output = left->value != INVALID_PACK_VALUE ? left->value : INVALID_STATE;
+            for (; left != right; ++left) {
+                translate[left->output] = new_output;
+            }
+        }
+
+        verbose(me->logstream, "  <<< calc output_translate table without renumering.");
+
+    } else {
+
+        verbose(me->logstream, "  --> calc output_translate table with renumering.");
+
+        const struct ofsm_pack_decode * left = decode_table;
+        const struct ofsm_pack_decode * const end = decode_table + old_qoutputs;
+
+        while (left != end) {
+
+            const struct ofsm_pack_decode * right = left + 1;
+            while (right != end && right->value == left->value) {
+                ++right;
+            }
+
+            state_t new_output;
+            if (left->value != INVALID_PACK_VALUE) {
+                new_output = new_qoutputs++;
+            } else {
+                new_output = INVALID_STATE;
+            }
+
+            for (; left != right; ++left) {
+                translate[left->output] = new_output;
+            }
+        }
+
+        verbose(me->logstream, "  <<< calc output_translate table with renumering.");
+    }
+
+
+
+    const int status = ofsm_builder_replace_last_flake(me, ofsm, translate, new_qoutputs);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_replace_last_flake(me, ofsm, translate, %u) failed with %d as error code.", new_qoutputs, status);
+        verbose(me->logstream, "FAILED packing.");
+        free(ptr);
+        return 1;
+    }
+
+
+
+    free(ptr);
+    verbose(me->logstream, "DONE pack step, new qoutputs = %u.", new_qoutputs);
+
+    return complete_operation(me);
+}
+
+
+
+struct bucket_values_args
+{
+    void * user_data;
+    pack_func * f;
+    const input_t * paths;
+    unsigned int nflake;
+    pack_value_t * values;
+};
+
+static int bucket_values_chunk(void * const arg, const uint64_t start, const uint64_t finish)
+{
+    const struct bucket_values_args * const args = arg;
+    const input_t * path = args->paths + start * args->nflake;
+    for (uint64_t output = start; output < finish; ++output, path += args->nflake) {
+        args->values[output] = args->f(args->user_data, args->nflake, path);
+    }
+    return 0;
+}
+
+struct bucket_dp_args
+{
+    const double * w;
+    const double * wx;
+    const double * wxx;
+    const double * prev;
+    double * curr;
+    uint32_t * opt;
+};
+
+static inline double bucket_cost(const struct bucket_dp_args * const args, const uint32_t j, const uint32_t i)
+{
+    const double w = args->w[i] - args->w[j];
+    if (w <= 0) return 0;
+    const double wx = args->wx[i] - args->wx[j];
+    const double cost = args->wxx[i] - args->wxx[j] - wx * wx / w;
+    return cost > 0 ? cost : 0;
+}
+
+/*
+ * Divide and conquer step of 1-D k-means: best split for i in [lo, hi) lies in [opt_lo, opt_hi].
+ * Empty buckets are allowed (j == i), so every layer is defined for every i.
+ */
+static void bucket_dp_solve(const struct bucket_dp_args * const args, const uint32_t lo, const uint32_t hi, const uint32_t opt_lo, const uint32_t opt_hi)
+{
+    if (lo >= hi) return;
+
+    const uint32_t mid = lo + (hi - lo) / 2;
+    const uint32_t last = opt_hi < mid ? opt_hi : mid;
+
+    uint32_t best_j = opt_lo;
+    double best = args->prev[opt_lo] + bucket_cost(args, opt_lo, mid);
+    for (uint32_t j = opt_lo + 1; j <= last; ++j) {
+        const double value = args->prev[j] + bucket_cost(args, j, mid);
+        if (value < best) {
+            best = value;
+            best_j = j;
+        }
+    }
+
+    args->curr[mid] = best;
+    args->opt[mid] = best_j;
+
+    bucket_dp_solve(args, lo, mid, opt_lo, best_j);
+    bucket_dp_solve(args, mid + 1, hi, best_j, opt_hi);
+}
+
+static int bucket_dp_chunk(void * const arg, const uint64_t start, const uint64_t finish)
+{
+    bucket_dp_solve(arg, start, finish, 0, finish - 1);
+    return 0;
+}
+
+int ofsm_builder_pack_buckets(struct ofsm_builder * restrict const me, pack_func f, const unsigned int qbuckets, double * restrict const error)
+{
+    if (skip_operation(me)) {
+        if (error != NULL) {
+            *error = NAN;
+        }
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PACK_BUCKETS, .f.pack = f, .m = qbuckets, .error = error };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        if (error != NULL) {
+            *error = NAN;
+        }
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START bucket packing, %u buckets.", qbuckets);
+
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
+        verbose(me->logstream, "FAILED bucket packing.");
+        return 1;
+    }
+
+    if (ofsm->qflakes <= 1 || qbuckets == 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Try to pack empty OFSM or into zero buckets, qflakes = %u, qbuckets = %u.", ofsm->qflakes, qbuckets);
+        verbose(me->logstream, "FAILED bucket packing.");
+        return 1;
+    }
+
+    const unsigned int nflake = ofsm->qflakes - 1;
+    const struct flake * const flake = ofsm->flakes + nflake;
+    const state_t old_qoutputs = flake->qoutputs;
+
+    const size_t sizes[5] = { 0,
+        (size_t)old_qoutputs * sizeof(pack_value_t),
+        (size_t)old_qoutputs * sizeof(pack_value_t),
+        (size_t)old_qoutputs * sizeof(state_t),
+        (size_t)old_qoutputs * sizeof(uint32_t),
+    };
+
+    void * ptrs[5];
+    multialloc(5, sizes, ptrs, 32);
+    void * const ptr = ptrs[0];
+
+    if (ptr == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(5, {%lu, %lu, %lu, %lu, %lu}, ptrs, 32) failed for temporary packing data.", sizes[0], sizes[1], sizes[2], sizes[3], sizes[4]);
+        verbose(me->logstream, "FAILED bucket packing.");
+        return 1;
+    }
+
+    pack_value_t * restrict const values = ptrs[1];
+    pack_value_t * restrict const sorted = ptrs[2];
+    state_t * restrict const translate = ptrs[3];
+    uint32_t * restrict const counts = ptrs[4];
+
+
+
+    { verbose(me->logstream, "  --> calculate pack values.");
+
+        struct bucket_values_args args = { me->user_data, f, flake->paths[1], nflake, values };
+        const int status = parallel_for(me, old_qoutputs, 4096, bucket_values_chunk, &args);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "parallel_for(me, %u, 4096, bucket_values_chunk, &args) failed with %d as an error code.", old_qoutputs, status);
+            verbose(me->logstream, "FAILED bucket packing.");
+            free(ptr);
+            return 1;
+        }
+
+    } verbose(me->logstream, "  <<< calculate pack values.");
+
+
+
+    uint32_t qdistinct = 0;
+
+    { verbose(me->logstream, "  --> collect distinct values.");
+
+        uint32_t qvalid = 0;
+        for (state_t output = 0; output < old_qoutputs; ++output) {
+            if (values[output] != INVALID_PACK_VALUE) {
+                sorted[qvalid++] = values[output];
+            }
+        }
+
+        qsort(sorted, qvalid, sizeof(pack_value_t), cmp_pack_value);
+
+        for (uint32_t i = 0; i < qvalid; ++i) {
+            if (qdistinct == 0 || sorted[qdistinct - 1] != sorted[i]) {
+                sorted[qdistinct] = sorted[i];
+                counts[qdistinct] = 0;
+                ++qdistinct;
+            }
+            ++counts[qdistinct - 1];
+        }
+
+    } verbose(me->logstream, "  <<< collect distinct values, %u found.", qdistinct);
+
+
+
+    const uint32_t qsegments = qbuckets < qdistinct ? qbuckets : qdistinct;
+    const uint32_t n = qdistinct;
+
+    const size_t dp_sizes[7] = { 0,
+        (size_t)(n + 1) * sizeof(double),
+        (size_t)(n + 1) * sizeof(double),
+        (size_t)(n + 1) * sizeof(double),
+        (size_t)(n + 1) * sizeof(double),
+        (size_t)(n + 1) * sizeof(double),
+        (size_t)(qsegments + 1) * (n + 1) * sizeof(uint32_t),
+    };
+
+    void * dp_ptrs[7];
+    multialloc(7, dp_sizes, dp_ptrs, 32);
+
+    if (dp_ptrs[0] == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(7, {%lu, ..., %lu}, ptrs, 32) failed for k-means tables.", dp_sizes[0], dp_sizes[6]);
+        verbose(me->logstream, "FAILED bucket packing.");
+        free(ptr);
+        return 1;
+    }
+
+    double * restrict const w = dp_ptrs[1];
+    double * restrict const wx = dp_ptrs[2];
+    double * restrict const wxx = dp_ptrs[3];
+    double * restrict prev = dp_ptrs[4];
+    double * restrict curr = dp_ptrs[5];
+    uint32_t * restrict const opts = dp_ptrs[6];
+
+    double total_error = 0;
+    double mean_error = 0;
+
+    { verbose(me->logstream, "  --> calc optimal 1-D k-means for %u values into %u buckets.", n, qsegments);
+
+        // Values are shifted to the smallest one to keep prefix sums of squares precise
+        w[0] = wx[0] = wxx[0] = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            const double x = (double)(sorted[i] - sorted[0]);
+            w[i + 1] = w[i] + counts[i];
+            wx[i + 1] = wx[i] + counts[i] * x;
+            wxx[i + 1] = wxx[i] + counts[i] * x * x;
+        }
+
+        struct bucket_dp_args args = { w, wx, wxx, prev, curr, NULL };
+        for (uint32_t i = 0; i <= n; ++i) {
+            prev[i] = bucket_cost(&args, 0, i);
+            opts[(size_t)1 * (n + 1) + i] = 0;
+        }
+
+        const unsigned int qthreads = get_qthreads(me);
+        const uint64_t chunk_sz = (n + 1) / (qthreads > 0 ? qthreads : 1) + 1024;
+
+        for (uint32_t k = 2; k <= qsegments; ++k) {
+            args.prev = prev;
+            args.curr = curr;
+            args.opt = opts + (size_t)k * (n + 1);
+
+            const int status = parallel_for(me, n + 1, chunk_sz, bucket_dp_chunk, &args);
+            if (status != 0) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "parallel_for(me, %u, %lu, bucket_dp_chunk, &args) failed with %d as an error code.", n + 1, chunk_sz, status);
+                verbose(me->logstream, "FAILED bucket packing.");
+                free(dp_ptrs[0]);
+                free(ptr);
+                return 1;
+            }
+
+            double * const tmp = prev;
+            prev = curr;
+            curr = tmp;
+        }
+
+        total_error = n > 0 ? prev[n] : 0;
+        mean_error = n > 0 ? total_error / w[n] : 0;
+
+    } verbose(me->logstream, "  <<< calc optimal 1-D k-means, squared error is %g, mean is %g.", total_error, mean_error);
+
+
+
+    state_t new_qoutputs = 0;
+
+    { verbose(me->logstream, "  --> calc output_translate table.");
+
+        uint32_t * restrict const bucket_of = counts;
+
+        uint32_t i = n;
+        for (uint32_t k = qsegments; k >= 1; --k) {
+            const uint32_t j = opts[(size_t)k * (n + 1) + i];
+            for (uint32_t t = j; t < i; ++t) {
+                bucket_of[t] = k;
+            }
+            i = j;
+        }
+
+        // Renumber buckets in value order skipping empty ones
+        uint32_t last_bucket = 0;
+        for (uint32_t t = 0; t < n; ++t) {
+            if (bucket_of[t] != last_bucket) {
+                last_bucket = bucket_of[t];
+                ++new_qoutputs;
+            }
+            bucket_of[t] = new_qoutputs - 1;
+        }
+
+        for (state_t output = 0; output < old_qoutputs; ++output) {
+            if (values[output] == INVALID_PACK_VALUE) {
+                translate[output] = INVALID_STATE;
+                continue;
+            }
+
+            const pack_value_t * const found = bsearch(values + output, sorted, n, sizeof(pack_value_t), cmp_pack_value);
+            translate[output] = bucket_of[found - sorted];
+        }
+
+    } verbose(me->logstream, "  <<< calc output_translate table.");
+
+    free(dp_ptrs[0]);
+
+
+
+    const int status = ofsm_builder_replace_last_flake(me, ofsm, translate, new_qoutputs);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_replace_last_flake(me, ofsm, translate, %u) failed with %d as error code.", new_qoutputs, status);
+        verbose(me->logstream, "FAILED bucket packing.");
+        free(ptr);
+        return 1;
+    }
+
+    if (error != NULL) {
+        *error = mean_error;
+    }
+
+    free(ptr);
+    verbose(me->logstream, "DONE bucket packing, new qoutputs = %u.", new_qoutputs);
+
+    return complete_operation(me);
+}
+
+
+
+struct pack_multi_sort_args
+{
+    const pack_value_t * values;
+    unsigned int qvalues;
+};
+
+static int cmp_pack_multi(const void * const arg_a, const void * const arg_b, void * const arg)
+{
+    const struct pack_multi_sort_args * const args = arg;
+    const state_t a = *(const state_t *)arg_a;
+    const state_t b = *(const state_t *)arg_b;
+    const pack_value_t * const va = args->values + (size_t)a * args->qvalues;
+    const pack_value_t * const vb = args->values + (size_t)b * args->qvalues;
+    for (unsigned int i = 0; i < args->qvalues; ++i) {
+        if (va[i] < vb[i]) return -1;
+        if (va[i] > vb[i]) return +1;
+    }
+    if (a < b) return -1;
+    if (a > b) return +1;
+    return 0;
+}
+
+int ofsm_builder_pack_multi(struct ofsm_builder * restrict const me, pack_multi_func f, const unsigned int qvalues)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PACK_MULTI, .f.pack_multi = f, .m = qvalues };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START multi packing, %u values.", qvalues);
+
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
+        verbose(me->logstream, "FAILED multi packing.");
+        return 1;
+    }
+
+    if (ofsm->qflakes <= 1 || qvalues == 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Try to pack empty OFSM or empty tuple, qflakes = %u, qvalues = %u.", ofsm->qflakes, qvalues);
+        verbose(me->logstream, "FAILED multi packing.");
+        return 1;
+    }
+
+    const unsigned int nflake = ofsm->qflakes - 1;
+    const struct flake * const flake = ofsm->flakes + nflake;
+    const state_t old_qoutputs = flake->qoutputs;
+
+    const size_t sizes[4] = { 0,
+        (size_t)old_qoutputs * qvalues * sizeof(pack_value_t),
+        (size_t)old_qoutputs * sizeof(state_t),
+        (size_t)old_qoutputs * sizeof(state_t),
+    };
+
+    void * ptrs[4];
+    multialloc(4, sizes, ptrs, 32);
+    void * const ptr = ptrs[0];
+
+    if (ptr == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(4, {%lu, %lu, %lu, %lu}, ptrs, 32) failed for temporary packing data.", sizes[0], sizes[1], sizes[2], sizes[3]);
+        verbose(me->logstream, "FAILED multi packing.");
+        return 1;
+    }
+
+    pack_value_t * restrict const values = ptrs[1];
+    state_t * restrict const order = ptrs[2];
+    state_t * restrict const translate = ptrs[3];
+
+
+
+    { verbose(me->logstream, "  --> calculate pack tuples.");
+
+        const input_t * path = flake->paths[1];
+        pack_value_t * restrict tuple = values;
+        for (state_t output = 0; output < old_qoutputs; ++output) {
+            f(me->user_data, nflake, path, tuple);
+            order[output] = output;
+            path += nflake;
+            tuple += qvalues;
+        }
+
+    } verbose(me->logstream, "  <<< calculate pack tuples.");
+
+
+
+    { verbose(me->logstream, "  --> sort tuples.");
+        struct pack_multi_sort_args args = { values, qvalues };
+        qsort_r(order, old_qoutputs, sizeof(state_t), cmp_pack_multi, &args);
+    } verbose(me->logstream, "  <<< sort tuples.");
+
+
+
+    state_t new_qoutputs = 0;
+    const size_t tuple_sz = qvalues * sizeof(pack_value_t);
+
+    { verbose(me->logstream, "  --> calc output_translate table.");
+
+        const pack_value_t * prev = NULL;
+        for (state_t i = 0; i < old_qoutputs; ++i) {
+            const state_t output = order[i];
+            const pack_value_t * const tuple = values + (size_t)output * qvalues;
+            if (tuple[0] == INVALID_PACK_VALUE) {
+                translate[output] = INVALID_STATE;
+                continue;
+            }
+
+            if (prev == NULL || memcmp(prev, tuple, tuple_sz) != 0) {
+                ++new_qoutputs;
+                prev = tuple;
+            }
+
+            translate[output] = new_qoutputs - 1;
+        }
+
+    } verbose(me->logstream, "  <<< calc output_translate table, %u records.", new_qoutputs);
+
+    const size_t records_sz = (size_t)new_qoutputs * tuple_sz;
+    pack_value_t * restrict const records = malloc(records_sz > 0 ? records_sz : 1);
+    if (records == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "malloc(%lu) failed with NULL as return value for output records.", records_sz);
+        verbose(me->logstream, "FAILED multi packing.");
+        free(ptr);
+        return 1;
+    }
+
+    for (state_t output = 0; output < old_qoutputs; ++output) {
+        const state_t record = translate[output];
+        if (record != INVALID_STATE) {
+            memcpy(records + (size_t)record * qvalues, values + (size_t)output * qvalues, tuple_sz);
+        }
+    }
+
+    const int status = ofsm_builder_replace_last_flake(me, ofsm, translate, new_qoutputs);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_replace_last_flake(me, ofsm, translate, %u) failed with %d as error code.", new_qoutputs, status);
+        verbose(me->logstream, "FAILED multi packing.");
+        free(records);
+        free(ptr);
+        return 1;
+    }
+
+    ofsm->qvalues = qvalues;
+    ofsm->qrecords = new_qoutputs;
+    ofsm->records = records;
+
+    free(ptr);
+    verbose(me->logstream, "DONE multi pack step, new qoutputs = %u.", new_qoutputs);
+
+    return complete_operation(me);
+}
+
+
+
+int ofsm_builder_pack_key(struct ofsm_builder * restrict const me, pack_key_func f, const size_t key_sz)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__PACK_KEY, .f.pack_key = f, .key_sz = key_sz };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START key packing, key size is %lu bytes.", key_sz);
+
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
+        verbose(me->logstream, "FAILED key packing.");
+        return 1;
+    }
+
+    if (ofsm->qflakes <= 1 || key_sz == 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Try to pack empty OFSM or empty key, qflakes = %u, key_sz = %lu.", ofsm->qflakes, key_sz);
+        verbose(me->logstream, "FAILED key packing.");
+        return 1;
+    }
+
+    const unsigned int nflake = ofsm->qflakes - 1;
+    const struct flake * const flake = ofsm->flakes + nflake;
+    const state_t old_qoutputs = flake->qoutputs;
+
+    const size_t sizes[5] = { 0,
+        (size_t)old_qoutputs * key_sz,
+        (size_t)old_qoutputs * sizeof(state_t),
+        (size_t)old_qoutputs * sizeof(uint64_t),
+        (size_t)old_qoutputs * sizeof(state_t),
+    };
+
+    void * ptrs[5];
+    multialloc(5, sizes, ptrs, 32);
+    void * const ptr = ptrs[0];
+
+    if (ptr == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(5, {%lu, %lu, %lu, %lu, %lu}, ptrs, 32) failed for temporary packing data.", sizes[0], sizes[1], sizes[2], sizes[3], sizes[4]);
+        verbose(me->logstream, "FAILED key packing.");
+        return 1;
+    }
+
+    uint8_t * restrict const keys = ptrs[1];
+    state_t * restrict const order = ptrs[2];
+    uint64_t * restrict const groups = ptrs[3];
+    state_t * restrict const translate = ptrs[4];
+
+
+
+    state_t qorder = 0;
+
+    { verbose(me->logstream, "  --> calculate pack keys.");
+
+        const input_t * path = flake->paths[1];
+        for (state_t output = 0; output < old_qoutputs; ++output) {
+            const int is_invalid = f(me->user_data, nflake, path, keys + output * key_sz) != 0;
+            if (is_invalid) {
+                groups[output] = INVALID_HASH;
+            } else {
+                order[qorder++] = output;
+            }
+            path += nflake;
+        }
+
+    } verbose(me->logstream, "  <<< calculate pack keys, %u valid outputs.", qorder);
+
+
+
+    state_t new_qoutputs = 0;
+
+    { verbose(me->logstream, "  --> sort and group keys.");
+
+        new_qoutputs = calc_key_groups(keys, key_sz, order, qorder, groups);
+        for (state_t output = 0; output < old_qoutputs; ++output) {
+            translate[output] = groups[output] != INVALID_HASH ? groups[output] : INVALID_STATE;
+        }
+
+    } verbose(me->logstream, "  <<< sort and group keys.");
+
+
+
+    const int status = ofsm_builder_replace_last_flake(me, ofsm, translate, new_qoutputs);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_replace_last_flake(me, ofsm, translate, %u) failed with %d as error code.", new_qoutputs, status);
+        verbose(me->logstream, "FAILED key packing.");
+        free(ptr);
+        return 1;
+    }
+
+    free(ptr);
+    verbose(me->logstream, "DONE key pack step, new qoutputs = %u.", new_qoutputs);
+
+    return complete_operation(me);
+}
+
+
+
+static uint64_t get_first_jump(void * const user_data, const unsigned int qjumps, const state_t * jumps, const unsigned int path_len, const input_t * const path)
+{
+    return *jumps != INVALID_STATE ? *jumps : INVALID_HASH;
+}
+
+static int merge(const unsigned int qinputs, state_t * const restrict a, state_t * restrict const b)
+{
+    for (unsigned int i = 0; i < qinputs; ++i) {
+        if (a[i] == INVALID_STATE) continue;
+        if (b[i] == INVALID_STATE) continue;
+        if (a[i] != b[i]) return 0;
+    }
+
+    for (unsigned int i = 0; i < qinputs; ++i) {
+        if (a[i] == INVALID_STATE) {
+            a[i] = b[i];
+        }
+    }
+
+    return 1;
+}
+
+static int ofsm_builder_optimize_flake(struct ofsm_builder * restrict const me, const unsigned int nflake, struct flake * restrict const flake, hash_func * f, const uint64_t * const hashes)
+{
+    hash_func * const hash = f != NULL ? f : get_first_jump;
+    const state_t old_qstates = flake->qstates;
+    const input_t qinputs = flake->qinputs;
+
+
+    const size_t sizes[2] = { 0, old_qstates * sizeof(struct state_info) };
+
+    void * ptrs[2];
+    multialloc(2, sizes, ptrs, 32);
+    void * const ptr = ptrs[0];
+
+    if (ptr == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for temporary optimizing data.", sizes[0], sizes[1]);
+        return 1;
+    }
+
+    struct state_info * const state_infos = ptrs[1];
+
+    // Merge and decode steps below change jumps in place
+    if (flake_own_jumps(flake) != 0 || flake_own_jumps(flake - 1) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Can not get exclusive copy of jumps for flake %u.", nflake);
+        free(ptr);
+        return 1;
+    }
+
+
+
+    // Both hashing and merging walk all states, an interrupted merge leaves valid jumps: rows only gain jumps for invalid inputs
+    progress_start(me, 2 * (uint64_t)old_qstates);
+
+    { verbose(me->logstream, "  --> calc state hashes and sort.");
+
+        uint64_t counter = 0;
+        double start = get_app_age();
+
+        const struct flake * const prev_flake = flake - 1;
+        if (prev_flake->qoutputs != old_qstates) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Previous flack outputs %u is not match to current flake states %u.", prev_flake->qoutputs, old_qstates);
+            return 1;
+        }
+
+        const state_t * jumps = flake->jumps[1];
+        struct state_info * restrict ptr = state_infos;
+        const struct state_info * const end = state_infos + old_qstates;
+        const input_t * path = prev_flake->paths[1];
+        const unsigned int path_len = nflake - 1;
+        state_t state = 0;
+        for (; ptr != end; ++ptr) {
+            ptr->hash = hashes != NULL ? hashes[state] : hash(me->user_data, qinputs, jumps, path_len, path);
+            ptr->old = state++;
+            jumps += qinputs;
+            path += path_len;
+
+            if ((++counter & 0xFF) == 0) {
+                progress_add(me, 0x100);
+                if (is_cancelled(me)) {
+                    ERRLOCATION(me->errstream);
+                    msg(me->errstream, "Optimization of flake %u is interrupted after %lu state hashes.", nflake, counter);
+                    free(ptr);
+                    return 1;
+                }
+
+                const double now = get_app_age();
+                if (now - start > 10.0) {
+                    const uint64_t processed = ptr - state_infos;
+                    verbose(me->logstream, "    processed %5.2f%% (%lu of %u).", 100.0 * processed / old_qstates, processed, old_qstates);
+                    start = now;
+                }
+            }
+        }
+
+        verbose(me->logstream, "    sorting...");
+
+        qsort(state_infos, old_qstates, sizeof(struct state_info), cmp_state_info);
+
+    } verbose(me->logstream, "  <<< calc state hashes and sort.");
+
+
+
+    state_t new_qstates = 0;
+
+    { verbose(me->logstream, "  --> merge states.");
+
+        double start = get_app_age();
+        uint64_t counter = 0;
+        uint64_t merged = 0;
+
+        const struct state_info * const end = state_infos + old_qstates;
+        struct state_info * left = state_infos;
+
+        while (left != end) {
+            struct state_info * right = left + 1;
+            while (right != end && right->hash == left->hash) {
+                ++right;
+            }
+
+            struct state_info * base;
+            if (left->hash != INVALID_HASH || left == state_infos) {
+                base = left;
+                ++new_qstates;
+                left->new = left->old;
+                ++left;
+            } else {
+                base = state_infos;
+            }
+
+            while (left != right) {
+
+                // Current state is unmerged by default
+                left->new = left->old;
+
+                // Try to merge
+                for (const struct state_info * ptr = base; ptr != left; ++ptr) {
+
+                    if (ptr->new != ptr->old) {
+                        // This state was merged with another one, no sence to merge.
+                        continue;
+                    }
+
+                    // Try to merge
+                    state_t * const a = flake->jumps[1] + ptr->old * qinputs;
+                    state_t * const b = flake->jumps[1] + left->old * qinputs;
+                    const int was_merged = merge(qinputs, a, b) != 0;
+
+                    if (was_merged) {
+                        left->new = ptr->new;
+                        ++merged;
+                        break;
+                    }
+                }
+
+                if ((++counter & 0xFFF) == 0) {
+                    progress_add(me, 0x1000);
+                    if (is_cancelled(me)) {
+                        ERRLOCATION(me->errstream);
+                        msg(me->errstream, "Optimization of flake %u is interrupted after %lu merge attempts.", nflake, counter);
+                        free(ptr);
+                        return 1;
+                    }
+
+                    const double now = get_app_age();
+                    if (now - start > 60.0) {
+                        const uint64_t processed = left - state_infos;
+                        const uint64_t total = old_qstates;
+                        const double persent = 100.0 * processed / total;
+
+                        const uint64_t chunk_processed = left - base;
+                        const uint64_t chunk_total = right - base;
+                        const double chunk_persent = 100.0 * chunk_processed / chunk_total;
+
+                        verbose(me->logstream, "    processed total %5.2f%%, this chunk %5.2f%%: total %lu/%lu, chunk %lu/%lu, merged = %lu.",
+                            persent, chunk_persent, processed, total, chunk_processed, chunk_total, merged);
+
+                        start = now;
+                    }
+                }
+
+                new_qstates += left->new == left->old;
+                ++left;
+            }
+        }
+    } verbose(me->logstream, "  <<< merge states.");
+
+
+
+    { verbose(me->logstream, "  --> replace old jumps with a new one.");
+
+        state_t new_qstate = 0;
+
+        size_t sizes[2] = { 0, new_qstates * qinputs * sizeof(state_t) };
+        void * ptrs[2];
+        multialloc(2, sizes, ptrs, 32);
+        if (ptrs[0] == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "multialloc(2, { %lu, %lu }, ptrs, 32) failed with NULL value during reallocating new jump table.", sizes[0], sizes[1]);
+            free(ptr);
+            return 1;
+        }
+
+        state_t * new_jumps = ptrs[1];
+        const state_t * old_jumps = flake->jumps[1];
+        struct state_info * restrict ptr = state_infos;
+        const struct state_info * end = state_infos + old_qstates;
+        for (; ptr != end; ++ptr) {
+            if (ptr->new != ptr->old) {
+                state_infos[ptr->old].index = state_infos[ptr->new].index;
+                continue;
+            }
+
+            state_infos[ptr->old].index = new_qstate++;
+            memcpy(new_jumps, old_jumps + ptr->old * qinputs, qinputs * sizeof(state_t));
+            new_jumps += qinputs;
+        }
+
+        flake_release_jumps(flake);
+        flake->jumps[0] = ptrs[0];
+        flake->jumps[1] = ptrs[1];
+        flake->qstates = new_qstates;
+
+    } verbose(me->logstream, "  <<< replace old jumps with a new one.");
+
+
+
+    { verbose(me->logstream, "  --> decode output states in the previous flake.");
+
+        const struct flake * prev = flake - 1;
+        state_t * restrict jump = prev->jumps[1];
+        const state_t * end = jump + prev->qinputs * prev->qstates;
+        for (; jump != end; ++jump) {
+            if (*jump != INVALID_STATE) {
+                *jump = state_infos[*jump].index;
+            }
+        }
+
+        flake[-1].qoutputs = flake->qstates;
+
+    } verbose(me->logstream, "  <<< decode output states in the previous flake.");
+
+    if (nflake > 1) {
+
+        verbose(me->logstream, "  --> update path from previous flake.");
+
+        const struct flake * const prev = flake - 1;
+        const size_t path_len = nflake - 1;
+        const size_t new_path_len = prev->qoutputs * path_len;
+        const size_t new_path_sizes[2] = { 0, new_path_len * sizeof(input_t) };
+        void * new_path_ptrs[2];
+        multialloc(2, new_path_sizes, new_path_ptrs, 32);
+
+        if (new_path_ptrs[0] == NULL) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "multialloc(2, { %lu, %lu }, ptrs, 32) failed with NULL value during reallocating new jump table.", new_path_sizes[0], new_path_sizes[1]);
+            free(ptr);
+            return 1;
+        }
+
+        input_t * restrict new_path = new_path_ptrs[1];
+        for (size_t i=0; i<new_path_len; ++i) {
+            new_path[i] = INVALID_INPUT;
+        }
+
+        const size_t path_sz = path_len * sizeof(input_t);
+        for (size_t old_state = 0; old_state < old_qstates; ++old_state) {
+            const state_t index = state_infos[old_state].index;
+            const size_t new_path_index = index * path_len;
+            const size_t old_path_index = old_state * path_len;
+            if (new_path[new_path_index] == INVALID_INPUT) {
+                void * new_input = new_path + new_path_index;
+                const void * old_input = prev->paths[1] + old_path_index;
+                memcpy(new_input, old_input, path_sz);
+            }
+        }
+
+        flake_release_paths(flake - 1);
+        flake[-1].paths[0] = new_path_ptrs[0];
+        flake[-1].paths[1] = new_path_ptrs[1];
+
+        verbose(me->logstream, "  <<< update path from previous flake.");
+    }
+
+    free(ptr);
+    progress_finish(me);
+    return 0;
+}
+
+int ofsm_builder_optimize(struct ofsm_builder * restrict const me, const unsigned int nflake, unsigned int qflakes, hash_func f)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__OPTIMIZE, .m = nflake, .n = qflakes, .f.hash = f };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
     if (ofsm == NULL) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "create_ofsm(me->mempool, 0) failed with NULL as result value.");
-        verbose(me->logstream, "FAILED push combinatoric.");
+        msg(me->errstream, "ofsm_builder_optimize(me) failed with NULL as error value.");
         return 1;
     }
 
-    const struct flake * prev =  ofsm->flakes + ofsm->qflakes - 1;
+    if (nflake <= 0 || nflake >= ofsm->qflakes) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Invalid flake number (%u), expected value might be in range 1 - %u.", nflake, ofsm->qflakes - 1);
+        return 1;
+    }
 
-    uint64_t nn = qinputs;
-    uint64_t dd = 1;
+    if (qflakes == 0) --qflakes;
 
-    for (unsigned int i=0; i<m; ++i) {
-        if (prev->qoutputs == INVALID_STATE) {
-            ERRLOCATION(me->errstream);
-            msg(me->errstream, "state_t overflow: try to assign %u to qstates.", prev->qoutputs);
-            verbose(me->logstream, "FAILED push combinatoric.");
-            free_ofsm(ofsm);
-            return 1;
+    for (unsigned int i = 0; i < qflakes; ++i) {
+        const unsigned int current_nflake = nflake - i;
+        if (current_nflake <= 0) {
+            break;
         }
 
-        const state_t qstates = prev->qoutputs;
-        const uint64_t qoutputs = qstates * nn / dd;
-
-        unsigned int nflake = ofsm->qflakes;
-        const struct flake * flake = ofsm_create_flake(ofsm, qinputs, qoutputs, qstates);
-        if (flake == NULL) {
+        if (is_cancelled(me)) {
             ERRLOCATION(me->errstream);
-            msg(me->errstream, "ofsm_create_flake(me, %u, %lu, %u) faled with NULL as return value.", qinputs, qoutputs, qstates);
-            verbose(me->logstream, "FAILED push combinatoric.");
-            free_ofsm(ofsm);
+            msg(me->errstream, "Optimization is interrupted before flake %u.", current_nflake);
             return 1;
         }
 
-        state_t * restrict jumps = flake->jumps[1];
-
-        if (i > 0) {
-            for (state_t state = 0; state < qstates; ++state) {
-                input_t c[i+1];
-                const input_t * const ptr = prev->paths[1] + (nflake-1) * (state+1) - i;
-                memcpy(c, ptr, i * sizeof(input_t));
+        struct flake * restrict const flake = ofsm->flakes + current_nflake;
+        verbose(me->logstream, "START optimize flake %u.", current_nflake);
 
-                for (input_t input = 0; input < qinputs; ++input) {
-                    c[i] = input;
-                    *jumps++ = calc_comb_index(ct, c, qinputs, i+1);
-                }
-            }
+        const int status = ofsm_builder_optimize_flake(me, current_nflake, flake, f, NULL);
+        if (status == 0) {
+            verbose(me->logstream, "DONE optimize flake %u.", current_nflake);
         } else {
-            if (qstates != 1) {
-                ERRLOCATION(me->errstream);
-                msg(me->errstream, "Internal error: zero flake should return one output! But qstates = %u.", qstates);
-                verbose(me->logstream, "FAILED push combinatoric.");
-                free_ofsm(ofsm);
-                return 1;
-            }
-
-            for (input_t input = 0; input < qinputs; ++input) {
-                *jumps++ = input;
-            }
-        }
-
-        const int status = calc_paths(flake, nflake);
-        if (status != 0) {
             ERRLOCATION(me->errstream);
-            msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, status);
-            verbose(me->logstream, "FAILED push combinatoric.");
-            free_ofsm(ofsm);
+            msg(me->errstream, "ofsm_builder_optimize_flake(me, flake, f) failed with %d as error code.\n", status);
+            verbose(me->logstream, "FAILED optimize flake %u.", current_nflake);
             return 1;
         }
-
-        prev = flake;
-        --nn;
-        ++dd;
     }
 
-    me->stack[me->stack_len++] = ofsm;
-    verbose(me->logstream, "DONE push combinatoric.");
-    return autoverify(me);
+    return complete_operation(me);
 }
 
 
 
-int ofsm_builder_product(struct ofsm_builder * restrict const me)
+int ofsm_builder_optimize_key(struct ofsm_builder * restrict const me, const unsigned int nflake, unsigned int qflakes, hash_key_func f, const size_t key_sz)
 {
-    verbose(me->logstream, "START product.");
+    if (skip_operation(me)) {
+        return 0;
+    }
 
-    if (me->stack_len < 2) {
+    const struct builder_op op = { .code = OP__OPTIMIZE_KEY, .m = nflake, .n = qflakes, .f.hash_key = f, .key_sz = key_sz };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "ofsm_builder_product(me) is called for too small OFSM stack, stack_len = %u.", me->stack_len);
-        verbose(me->logstream, "FAILED product.");
+        msg(me->errstream, "ofsm_builder_optimize_key(me) failed with NULL as error value.");
         return 1;
     }
 
-    struct ofsm * restrict const ofsm1 = me->stack[me->stack_len - 2];
-    struct ofsm * restrict const ofsm2 = me->stack[me->stack_len - 1];
+    if (nflake <= 0 || nflake >= ofsm->qflakes || key_sz == 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Invalid flake number (%u) or key size (%lu), expected flake might be in range 1 - %u.", nflake, key_sz, ofsm->qflakes - 1);
+        return 1;
+    }
 
-    const unsigned int saved_qflakes1 = ofsm1->qflakes;
-    const struct flake * const last1 = ofsm1->flakes + saved_qflakes1 - 1;
+    if (qflakes == 0) --qflakes;
 
-    for (int nflake2 = 1; nflake2 < ofsm2->qflakes; ++nflake2) {
-        const struct flake * const flake2 = ofsm2->flakes + nflake2;
-        struct flake * restrict const flake1 = ofsm_create_flake(ofsm1, flake2->qinputs, flake2->qoutputs * last1->qoutputs, flake2->qstates * last1->qoutputs);
-        if (flake1 == NULL) {
+    for (unsigned int i = 0; i < qflakes; ++i) {
+        const unsigned int current_nflake = nflake - i;
+        if (current_nflake <= 0) {
+            break;
+        }
+
+        struct flake * restrict const flake = ofsm->flakes + current_nflake;
+        verbose(me->logstream, "START optimize flake %u with %lu byte keys.", current_nflake, key_sz);
+
+        const state_t qstates = flake->qstates;
+        const size_t sizes[4] = { 0,
+            (size_t)qstates * key_sz,
+            (size_t)qstates * sizeof(state_t),
+            (size_t)qstates * sizeof(uint64_t),
+        };
+
+        void * ptrs[4];
+        multialloc(4, sizes, ptrs, 32);
+        void * const ptr = ptrs[0];
+
+        if (ptr == NULL) {
             ERRLOCATION(me->errstream);
-            msg(me->errstream, "ofsm_create_flake(ofsm1, %u, %u, %u) failed with NULL as result.", flake2->qinputs, flake2->qoutputs * last1->qoutputs, flake2->qstates * last1->qoutputs);
-            verbose(me->logstream, "FAILED product.");
-            ofsm_truncate(ofsm1, saved_qflakes1);
+            msg(me->errstream, "multialloc(4, {%lu, %lu, %lu, %lu}, ptrs, 32) failed for temporary key data.", sizes[0], sizes[1], sizes[2], sizes[3]);
+            verbose(me->logstream, "FAILED optimize flake %u.", current_nflake);
             return 1;
         }
 
-        state_t * jump1 = flake1->jumps[1];
-        for (unsigned int output1 = 0; output1 < last1->qoutputs; ++output1) {
-            const state_t * jump2 = flake2->jumps[1];
-            for (unsigned int state2 = 0; state2 < flake2->qstates; ++state2)
-            for (unsigned int input2 = 0; input2 < flake2->qinputs; ++input2) {
-                if (*jump2 == INVALID_STATE) {
-                    *jump1 = INVALID_STATE;
-                } else {
-                    *jump1 = (*jump2) + output1 * flake2->qoutputs;
-                }
-                ++jump1;
-                ++jump2;
+        uint8_t * restrict const keys = ptrs[1];
+        state_t * restrict const order = ptrs[2];
+        uint64_t * restrict const groups = ptrs[3];
+
+        verbose(me->logstream, "  --> calc state keys and group.");
+
+        const input_t * path = flake[-1].paths[1];
+        const state_t * jumps = flake->jumps[1];
+        const unsigned int path_len = current_nflake - 1;
+        state_t qorder = 0;
+        for (state_t state = 0; state < qstates; ++state) {
+            const int is_invalid = f(me->user_data, flake->qinputs, jumps, path_len, path, keys + state * key_sz) != 0;
+            if (is_invalid) {
+                groups[state] = INVALID_HASH;
+            } else {
+                order[qorder++] = state;
             }
+            jumps += flake->qinputs;
+            path += path_len;
         }
 
-        input_t * path1 = flake1->paths[1];
-        const unsigned int head_len = saved_qflakes1 - 1;
-        const unsigned int tail_len = nflake2;
+        const uint64_t qgroups = calc_key_groups(keys, key_sz, order, qorder, groups);
 
-        const input_t * head = last1->paths[1];
-        for (unsigned int output1 = 0; output1 < last1->qoutputs; ++output1) {
-            const input_t * tail = flake2->paths[1];
-            for (unsigned int output2 = 0; output2 < flake2->qoutputs; ++output2) {
-                if (head_len > 0) {
-                    memcpy(path1, head, head_len * sizeof(input_t));
-                    path1 += head_len;
-                }
-                memcpy(path1, tail, tail_len * sizeof(input_t));
-                path1 += tail_len;
-                tail += tail_len;
-            }
-            head += head_len;
+        verbose(me->logstream, "  <<< calc state keys and group, %lu groups.", qgroups);
+
+        const int status = ofsm_builder_optimize_flake(me, current_nflake, flake, NULL, groups);
+        free(ptr);
+
+        if (status == 0) {
+            verbose(me->logstream, "DONE optimize flake %u.", current_nflake);
+        } else {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_builder_optimize_flake(me, flake, NULL, groups) failed with %d as error code.\n", status);
+            verbose(me->logstream, "FAILED optimize flake %u.", current_nflake);
+            return 1;
         }
     }
 
-    free_ofsm(ofsm2);
-    --me->stack_len;
+    return complete_operation(me);
+}
 
-    verbose(me->logstream, "DONE product.");
-    return autoverify(me);
+
+
+static uint64_t get_row_hash(void * const user_data, const unsigned int qjumps, const state_t * jumps, const unsigned int path_len, const input_t * const path)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    int is_invalid = 1;
+
+    for (unsigned int i = 0; i < qjumps; ++i) {
+        const state_t jump = jumps[i];
+        is_invalid &= jump == INVALID_STATE;
+        hash ^= jump;
+        hash *= 0x100000001B3ull;
+    }
+
+    if (is_invalid || hash == INVALID_HASH) {
+        return is_invalid ? INVALID_HASH : 0;
+    }
+
+    return hash;
 }
 
+static void split_path(input_t * restrict const dest, const input_t * const src, const unsigned int path_len, const unsigned int pos, const input_t * const decode1, const input_t * const decode2)
+{
+    if (src[0] == INVALID_INPUT) {
+        for (unsigned int i = 0; i <= path_len; ++i) {
+            dest[i] = INVALID_INPUT;
+        }
+        return;
+    }
 
+    const input_t input = src[pos];
+    memcpy(dest, src, pos * sizeof(input_t));
+    dest[pos] = decode1[input];
+    dest[pos+1] = decode2[input];
+    memcpy(dest + pos + 2, src + pos + 1, (path_len - pos - 1) * sizeof(input_t));
+}
 
-int ofsm_builder_pack(struct ofsm_builder * restrict const me, pack_func f, const unsigned int flags)
+int ofsm_builder_split(struct ofsm_builder * restrict const me, const unsigned int nflake, const input_t qinputs1, const input_t qinputs2, const input_t * const table)
 {
-    verbose(me->logstream, "START packing.");
+    if (skip_operation(me)) {
+        return 0;
+    }
+
+    const struct builder_op op = { .code = OP__SPLIT, .m = nflake, .qinputs = qinputs1, .qinputs2 = qinputs2, .ptr = table };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
+
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START split flake %u into %u x %u.", nflake, qinputs1, qinputs2);
 
     struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
     if (ofsm == NULL) {
         ERRLOCATION(me->errstream);
         msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
-        verbose(me->logstream, "FAILED packing.");
+        verbose(me->logstream, "FAILED split.");
         return 1;
     }
 
-    if (ofsm->qflakes <= 1) {
+    if (nflake <= 0 || nflake >= ofsm->qflakes) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "Try to pack empty OFSM.");
-        verbose(me->logstream, "FAILED packing.");
+        msg(me->errstream, "Invalid flake number (%u), expected value might be in range 1 - %u.", nflake, ofsm->qflakes - 1);
+        verbose(me->logstream, "FAILED split.");
         return 1;
     }
 
-    const int skip_renumering = (flags & PACK_FLAG__SKIP_RENUMERING) != 0;
-    const unsigned int nflake = ofsm->qflakes - 1;
-    const struct flake oldman = ofsm->flakes[nflake];
-    const uint64_t old_qoutputs = oldman.qoutputs;
-
-    const size_t sizes[3] = { 0,
-        (1 + old_qoutputs) * sizeof(struct ofsm_pack_decode),
-        old_qoutputs * sizeof(state_t),
-    };
-
-    void * ptrs[3];
-    multialloc(3, sizes, ptrs, 32);
-    void * const ptr = ptrs[0];
-
-    if (ptr == NULL) {
+    if (ofsm->qflakes >= ofsm->max_flakes) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "  multialloc(4, {%lu, %lu, %lu}, ptrs, 32) failed for temporary packing data.", sizes[0], sizes[1], sizes[2]);
-        verbose(me->logstream, "FAILED packing.");
+        msg(me->errstream, "Overflow maximum flake count (%u), qflakes = %u.", ofsm->max_flakes, ofsm->qflakes);
+        verbose(me->logstream, "FAILED split.");
         return 1;
     }
 
-    struct ofsm_pack_decode * const decode_table = ptrs[1];
-    state_t * restrict const translate = ptrs[2];
-
+    const struct flake * const old = ofsm->flakes + nflake;
+    const input_t qinputs = old->qinputs;
+    const state_t qstates = old->qstates;
+    const unsigned int qpairs = qinputs1 * qinputs2;
 
+    if (qinputs1 == 0 || qinputs2 == 0 || qpairs < qinputs) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Factorization %u x %u can not cover %u inputs of flake %u.", qinputs1, qinputs2, qinputs, nflake);
+        verbose(me->logstream, "FAILED split.");
+        return 1;
+    }
 
-    pack_value_t max_value = 0;
+    const uint64_t qmiddle = (uint64_t)qstates * qinputs1;
+    if (qmiddle >= INVALID_STATE) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Too many intermediate states (%lu) for splitting flake %u.", qmiddle, nflake);
+        verbose(me->logstream, "FAILED split.");
+        return 1;
+    }
 
-    { verbose(me->logstream, "  --> calculate pack values.");
+    input_t decode1[256];
+    input_t decode2[256];
+    memset(decode1, INVALID_INPUT, sizeof(decode1));
+    memset(decode2, INVALID_INPUT, sizeof(decode2));
 
-        struct ofsm_pack_decode * restrict curr = decode_table;
-        const input_t * path = oldman.paths[1];
-        for (size_t output = 0; output < old_qoutputs; ++output) {
-            curr->output = output;
-            curr->value = f(me->user_data, nflake, path);
-            if (curr->value > max_value) max_value = curr->value;
-            path += nflake;
-            ++curr;
+    for (unsigned int i = 0; i < qpairs; ++i) {
+        const unsigned int input = table != NULL ? table[i] : i < qinputs ? i : INVALID_INPUT;
+        if (input == INVALID_INPUT) continue;
+        if (input >= qinputs) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Invalid factorization table, table[%u] = %u, but flake %u has only %u inputs.", i, input, nflake, qinputs);
+            verbose(me->logstream, "FAILED split.");
+            return 1;
         }
+        if (decode1[input] == INVALID_INPUT) {
+            decode1[input] = i / qinputs2;
+            decode2[input] = i % qinputs2;
+        }
+    }
 
-        curr->output = INVALID_STATE;
-        curr->value = INVALID_PACK_VALUE;
-
-    } verbose(me->logstream, "  <<< calculate pack values, max value is %lu (0x%lx).", max_value, max_value);
-
-
-
-    { verbose(me->logstream, "  --> sort new states.");
-        qsort(decode_table, old_qoutputs, sizeof(struct ofsm_pack_decode), &cmp_ofsm_pack_decode);
-    } verbose(me->logstream, "  <<< sort new states.");
-
-
-
-    state_t new_qoutputs = 0;
+    for (unsigned int input = 0; input < qinputs; ++input) {
+        if (decode1[input] == INVALID_INPUT) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Invalid factorization table, input %u of flake %u is not covered.", input, nflake);
+            verbose(me->logstream, "FAILED split.");
+            return 1;
+        }
+    }
 
-    if (skip_renumering) {
+    const unsigned int qflakes = ofsm->qflakes + 1;
+    const size_t flakes_sz = qflakes * sizeof(struct flake);
+    struct flake * restrict const flakes = malloc(flakes_sz);
+    if (flakes == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "malloc(%lu) failed with NULL as return value.", flakes_sz);
+        verbose(me->logstream, "FAILED split.");
+        return 1;
+    }
 
-        verbose(me->logstream, "  --> calc output_translate table without renumering.");
+    memcpy(flakes, ofsm->flakes, nflake * sizeof(struct flake));
+    memcpy(flakes + nflake + 2, ofsm->flakes + nflake + 1, (ofsm->qflakes - nflake - 1) * sizeof(struct flake));
 
-        new_qoutputs = max_value + 1;
+    unsigned int qallocated = 0;
+    int status = 0;
 
-        const struct ofsm_pack_decode * left = decode_table;
-        const struct ofsm_pack_decode * const end = decode_table + old_qoutputs;
+    { verbose(me->logstream, "  --> calc jumps.");
 
-        while (left != end) {
+        struct flake * restrict const flake1 = flakes + nflake;
+        status = flake_alloc(flake1, nflake, qinputs1, qmiddle, qstates);
+        qallocated = status == 0 ? nflake + 1 : nflake;
 
-            const struct ofsm_pack_decode * right = left + 1;
-            while (right != end && right->value == left->value) {
-                ++right;
-            }
+        struct flake * restrict const flake2 = flakes + nflake + 1;
+        if (status == 0) {
+            status = flake_alloc(flake2, nflake + 1, qinputs2, old->qoutputs, qmiddle);
+            qallocated = status == 0 ? nflake + 2 : nflake + 1;
+        }
 
-            const state_t new_output = left->value != INVALID_PACK_VALUE ? left->value : INVALID_STATE;
-            for (; left != right; ++left) {
-                translate[left->output] = new_output;
+        if (status == 0) {
+            flake2->flags = old->flags;
+        }
+
+        if (status == 0) {
+            state_t * restrict jump1 = flake1->jumps[1];
+            state_t * restrict jump2 = flake2->jumps[1];
+            state_t middle = 0;
+            for (state_t state = 0; state < qstates; ++state) {
+                const state_t * const row = old->jumps[1] + state * qinputs;
+                for (input_t input1 = 0; input1 < qinputs1; ++input1) {
+                    int is_invalid = 1;
+                    for (input_t input2 = 0; input2 < qinputs2; ++input2) {
+                        const unsigned int input = table != NULL ? table[input1 * qinputs2 + input2] : input1 * qinputs2 + input2;
+                        const state_t jump = input < qinputs ? row[input] : INVALID_STATE;
+                        is_invalid &= jump == INVALID_STATE;
+                        *jump2++ = jump;
+                    }
+                    *jump1++ = is_invalid ? INVALID_STATE : middle;
+                    ++middle;
+                }
             }
         }
 
-        verbose(me->logstream, "  <<< calc output_translate table without renumering.");
+    } verbose(me->logstream, "  <<< calc jumps.");
 
-    } else {
+    if (status == 0) {
 
-        verbose(me->logstream, "  --> calc output_translate table with renumering.");
+        verbose(me->logstream, "  --> calc paths.");
 
-        const struct ofsm_pack_decode * left = decode_table;
-        const struct ofsm_pack_decode * const end = decode_table + old_qoutputs;
+        status = calc_paths(flakes + nflake, nflake);
 
-        while (left != end) {
+        for (unsigned int i = nflake + 1; status == 0 && i < qflakes; ++i) {
+            struct flake * restrict const flake = flakes + i;
+            const struct flake * const src = ofsm->flakes + i - 1;
+            const size_t path_sizes[2] = { 0, (size_t)src->qoutputs * i * sizeof(input_t) };
+            void * path_ptrs[2];
 
-            const struct ofsm_pack_decode * right = left + 1;
-            while (right != end && right->value == left->value) {
-                ++right;
+            if (i > nflake + 1) {
+                multialloc(2, path_sizes, path_ptrs, 32);
+                if (path_ptrs[0] == NULL) {
+                    ERRLOCATION(me->errstream);
+                    msg(me->errstream, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for flake %u paths.", path_sizes[0], path_sizes[1], i);
+                    status = 1;
+                    break;
+                }
+                flake->paths[0] = path_ptrs[0];
+                flake->paths[1] = path_ptrs[1];
+                flake->path_refs = NULL;
+                flake->is_verified = 0;
+                ++qallocated;
             }
 
-            state_t new_output;
-            if (left->value != INVALID_PACK_VALUE) {
-                new_output = new_qoutputs++;
-            } else {
-                new_output = INVALID_STATE;
+            input_t * restrict dest = flake->paths[1];
+            const input_t * path = src->paths[1];
+            for (state_t output = 0; output < src->qoutputs; ++output) {
+                split_path(dest, path, i - 1, nflake - 1, decode1, decode2);
+                dest += i;
+                path += i - 1;
             }
+        }
 
-            for (; left != right; ++left) {
-                translate[left->output] = new_output;
+        verbose(me->logstream, "  <<< calc paths.");
+    }
+
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Building split flakes failed with %d as error code.", status);
+        for (unsigned int i = nflake; i < qallocated; ++i) {
+            if (i < nflake + 2) {
+                free(flakes[i].jumps[0]);
             }
+            free(flakes[i].paths[0]);
         }
+        free(flakes);
+        verbose(me->logstream, "FAILED split.");
+        return 1;
+    }
 
-        verbose(me->logstream, "  <<< calc output_translate table with renumering.");
+    flake_release_jumps(ofsm->flakes + nflake);
+    for (unsigned int i = nflake; i < ofsm->qflakes; ++i) {
+        flake_release_paths(ofsm->flakes + i);
     }
 
+    memcpy(ofsm->flakes, flakes, flakes_sz);
+    ofsm->qflakes = qflakes;
+    free(flakes);
+
+    for (unsigned int i = 0; i < 2; ++i) {
+        const unsigned int current_nflake = nflake + 1 - i;
+        struct flake * restrict const flake = ofsm->flakes + current_nflake;
+        verbose(me->logstream, "  --> optimize flake %u.", current_nflake);
 
+        status = ofsm_builder_optimize_flake(me, current_nflake, flake, get_row_hash, NULL);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_builder_optimize_flake(me, %u, flake, get_row_hash) failed with %d as error code.", current_nflake, status);
+            verbose(me->logstream, "FAILED split.");
+            return 1;
+        }
 
-    --ofsm->qflakes;
-    struct flake * restrict const infant = ofsm_create_flake(ofsm, oldman.qinputs, new_qoutputs, oldman.qstates);
-    if (infant == NULL) {
-        ERRLOCATION(me->errstream);
-        msg(me->errstream, "ofsm_create_flake(me, %u, %u, %u) faled with NULL as return value in pack step.", oldman.qinputs, new_qoutputs, oldman.qstates);
-        verbose(me->logstream, "FAILED packing.");
-        free(ptr);
-        return 1;
+        verbose(me->logstream, "  <<< optimize flake %u, qstates = %u.", current_nflake, flake->qstates);
     }
 
+    verbose(me->logstream, "DONE split.");
+    return complete_operation(me);
+}
 
 
-    { verbose(me->logstream, "  --> update data.");
-
-        const state_t * old = oldman.jumps[1];
-        const state_t * const end = old + oldman.qstates * oldman.qinputs;
-        state_t * restrict new = infant->jumps[1];
 
-        for (; old != end; ++old) {
-            if (*old != INVALID_STATE) {
-                *new++ = translate[*old];
-            } else {
-                *new++ = INVALID_STATE;
-            }
+static void swap_path_inputs(input_t * restrict path, const state_t qoutputs, const unsigned int path_len, const unsigned int pos)
+{
+    for (state_t output = 0; output < qoutputs; ++output) {
+        if (path[0] != INVALID_INPUT) {
+            const input_t tmp = path[pos];
+            path[pos] = path[pos+1];
+            path[pos+1] = tmp;
         }
+        path += path_len;
+    }
+}
 
-    } verbose(me->logstream, "  <<< update data.");
+static int ofsm_builder_swap_flakes(struct ofsm_builder * restrict const me, struct ofsm * restrict const ofsm, const unsigned int nflake)
+{
+    const struct flake * const old1 = ofsm->flakes + nflake;
+    const struct flake * const old2 = old1 + 1;
+    const input_t qinputs1 = old1->qinputs;
+    const input_t qinputs2 = old2->qinputs;
+    const state_t qstates = old1->qstates;
+
+    const uint64_t qmiddle = (uint64_t)qstates * qinputs2;
+    if (qmiddle >= INVALID_STATE) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Too many intermediate states (%lu) for swapping flakes %u and %u.", qmiddle, nflake, nflake + 1);
+        return 1;
+    }
 
+    struct flake flake1;
+    struct flake flake2;
 
+    if (flake_alloc(&flake1, nflake, qinputs2, qmiddle, qstates) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "flake_alloc(&flake1, %u, %u, %lu, %u) failed.", nflake, qinputs2, qmiddle, qstates);
+        return 1;
+    }
 
-    { verbose(me->logstream, "  --> update paths.");
+    if (flake_alloc(&flake2, nflake + 1, qinputs1, old2->qoutputs, qmiddle) != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "flake_alloc(&flake2, %u, %u, %u, %lu) failed.", nflake + 1, qinputs1, old2->qoutputs, qmiddle);
+        free(flake1.jumps[0]);
+        free(flake1.paths[0]);
+        return 1;
+    }
 
-        input_t * restrict new_path = infant->paths[1];
-        const input_t * const old_paths = oldman.paths[1];
-        const struct ofsm_pack_decode * decode = decode_table;
-        const size_t sz = sizeof(input_t) * nflake;
-        for (state_t output = 0; output < new_qoutputs; ++output) {
-            const pack_value_t value = decode->value;
-            const state_t old_output = decode->output;
-            const state_t new_output = translate[old_output];
-            if (output == new_output) {
-                memcpy(new_path, old_paths + old_output * nflake, sz);
-                new_path += nflake;
-                do ++decode; while (decode->value == value);
-            } else {
-                for (unsigned int i=0; i < nflake; ++i) {
-                    *new_path++ = INVALID_INPUT;
+    { verbose(me->logstream, "  --> swap jumps of flakes %u and %u.", nflake, nflake + 1);
+
+        state_t * restrict jump1 = flake1.jumps[1];
+        state_t * restrict jump2 = flake2.jumps[1];
+        state_t middle = 0;
+        for (state_t state = 0; state < qstates; ++state) {
+            const state_t * const row1 = old1->jumps[1] + state * qinputs1;
+            for (input_t input2 = 0; input2 < qinputs2; ++input2) {
+                int is_invalid = 1;
+                for (input_t input1 = 0; input1 < qinputs1; ++input1) {
+                    const state_t state2 = row1[input1];
+                    const state_t jump = state2 != INVALID_STATE ? old2->jumps[1][state2 * qinputs2 + input2] : INVALID_STATE;
+                    is_invalid &= jump == INVALID_STATE;
+                    *jump2++ = jump;
                 }
+                *jump1++ = is_invalid ? INVALID_STATE : middle;
+                ++middle;
             }
         }
 
-    } verbose(me->logstream, "  <<< update paths.");
-
-
-
-    free(oldman.jumps[0]);
-    free(oldman.paths[0]);
-    free(ptr);
-    verbose(me->logstream, "DONE pack step, new qoutputs = %u.", new_qoutputs);
+        const size_t path_sz = (size_t)old2->qoutputs * (nflake + 1) * sizeof(input_t);
+        memcpy(flake2.paths[1], old2->paths[1], path_sz);
+        swap_path_inputs(flake2.paths[1], flake2.qoutputs, nflake + 1, nflake - 1);
 
-    return autoverify(me);
-}
+        flake1.flags = old1->flags;
+        flake2.flags = old2->flags;
 
+    } verbose(me->logstream, "  <<< swap jumps of flakes %u and %u.", nflake, nflake + 1);
 
+    release_block(old1->jumps[0], old1->jump_refs);
+    release_block(old1->paths[0], old1->path_refs);
+    release_block(old2->jumps[0], old2->jump_refs);
+    release_block(old2->paths[0], old2->path_refs);
+    ofsm->flakes[nflake] = flake1;
+    ofsm->flakes[nflake + 1] = flake2;
 
-static uint64_t get_first_jump(void * const user_data, const unsigned int qjumps, const state_t * jumps, const unsigned int path_len, const input_t * const path)
-{
-    return *jumps != INVALID_STATE ? *jumps : INVALID_HASH;
-}
+    const int status = calc_paths(ofsm->flakes + nflake, nflake);
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "calc_paths(flake, %u) failed with %d as an error code.", nflake, status);
+        return 1;
+    }
 
-static int merge(const unsigned int qinputs, state_t * const restrict a, state_t * restrict const b)
-{
-    for (unsigned int i = 0; i < qinputs; ++i) {
-        if (a[i] == INVALID_STATE) continue;
-        if (b[i] == INVALID_STATE) continue;
-        if (a[i] != b[i]) return 0;
+    for (unsigned int i = nflake + 2; i < ofsm->qflakes; ++i) {
+        struct flake * restrict const flake = ofsm->flakes + i;
+        if (flake_own_paths(flake, i) != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "flake_own_paths(flake, %u) failed.", i);
+            return 1;
+        }
+        swap_path_inputs(flake->paths[1], flake->qoutputs, i, nflake - 1);
     }
 
-    for (unsigned int i = 0; i < qinputs; ++i) {
-        if (a[i] == INVALID_STATE) {
-            a[i] = b[i];
+    for (unsigned int i = 0; i < 2; ++i) {
+        const unsigned int current_nflake = nflake + 1 - i;
+        struct flake * restrict const flake = ofsm->flakes + current_nflake;
+        const int status = ofsm_builder_optimize_flake(me, current_nflake, flake, get_row_hash, NULL);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_builder_optimize_flake(me, %u, flake, get_row_hash) failed with %d as error code.", current_nflake, status);
+            return 1;
         }
     }
 
-    return 1;
+    return 0;
 }
 
-static int ofsm_builder_optimize_flake(struct ofsm_builder * restrict const me, const unsigned int nflake, struct flake * restrict const flake, hash_func * f)
+int ofsm_builder_permute(struct ofsm_builder * restrict const me, const unsigned int * const order)
 {
-    hash_func * const hash = f != NULL ? f : get_first_jump;
-    const state_t old_qstates = flake->qstates;
-    const input_t qinputs = flake->qinputs;
+    if (skip_operation(me)) {
+        return 0;
+    }
 
+    const struct builder_op op = { .code = OP__PERMUTE, .ptr = order };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
 
-    const size_t sizes[2] = { 0, old_qstates * sizeof(struct state_info) };
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
 
-    void * ptrs[2];
-    multialloc(2, sizes, ptrs, 32);
-    void * const ptr = ptrs[0];
+    verbose(me->logstream, "START permute.");
 
-    if (ptr == NULL) {
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "multialloc(2, {%lu, %lu}, ptrs, 32) failed for temporary optimizing data.", sizes[0], sizes[1]);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
+        verbose(me->logstream, "FAILED permute.");
         return 1;
     }
 
-    struct state_info * const state_infos = ptrs[1];
-
-
-
-    { verbose(me->logstream, "  --> calc state hashes and sort.");
-
-        uint64_t counter = 0;
-        double start = get_app_age();
+    const unsigned int n = ofsm->qflakes - 1;
+    unsigned int current[n + 1];
+    int used[n + 1];
+    memset(used, 0, sizeof(used));
 
-        const struct flake * const prev_flake = flake - 1;
-        if (prev_flake->qoutputs != old_qstates) {
+    for (unsigned int i = 0; i < n; ++i) {
+        if (order[i] >= n || used[order[i]]) {
             ERRLOCATION(me->errstream);
-            msg(me->errstream, "Previous flack outputs %u is not match to current flake states %u.", prev_flake->qoutputs, old_qstates);
+            msg(me->errstream, "Invalid permutation: order[%u] = %u is out of range 0 - %u or repeated.", i, order[i], n - 1);
+            verbose(me->logstream, "FAILED permute.");
             return 1;
         }
+        used[order[i]] = 1;
+        current[i] = i;
+    }
 
-        const state_t * jumps = flake->jumps[1];
-        struct state_info * restrict ptr = state_infos;
-        const struct state_info * const end = state_infos + old_qstates;
-        const input_t * path = prev_flake->paths[1];
-        const unsigned int path_len = nflake - 1;
-        state_t state = 0;
-        for (; ptr != end; ++ptr) {
-            ptr->old = state++;
-            ptr->hash = hash(me->user_data, qinputs, jumps, path_len, path);
-            jumps += qinputs;
-            path += path_len;
+    unsigned int qswaps = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int pos = i;
+        while (current[pos] != order[i]) {
+            ++pos;
+        }
 
-            if ((++counter & 0xFF) == 0) {
-                const double now = get_app_age();
-                if (now - start > 10.0) {
-                    const uint64_t processed = ptr - state_infos;
-                    verbose(me->logstream, "    processed %5.2f%% (%lu of %u).", 100.0 * processed / old_qstates, processed, old_qstates);
-                    start = now;
-                }
+        for (; pos > i; --pos) {
+            verbose(me->logstream, "  --> swap flakes %u and %u.", pos, pos + 1);
+
+            const int status = ofsm_builder_swap_flakes(me, ofsm, pos);
+            if (status != 0) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "ofsm_builder_swap_flakes(me, ofsm, %u) failed with %d as error code.", pos, status);
+                verbose(me->logstream, "FAILED permute.");
+                return 1;
             }
+
+            const unsigned int tmp = current[pos];
+            current[pos] = current[pos-1];
+            current[pos-1] = tmp;
+            ++qswaps;
+
+            verbose(me->logstream, "  <<< swap flakes %u and %u, qstates = %u.", pos, pos + 1, ofsm->flakes[pos+1].qstates);
         }
+    }
 
-        verbose(me->logstream, "    sorting...");
+    verbose(me->logstream, "DONE permute, %u swaps.", qswaps);
+    return complete_operation(me);
+}
 
-        qsort(state_infos, old_qstates, sizeof(struct state_info), cmp_state_info);
 
-    } verbose(me->logstream, "  <<< calc state hashes and sort.");
 
+int ofsm_builder_fuse(struct ofsm_builder * restrict const me, const unsigned int nflake, const unsigned int qflakes)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
 
+    const struct builder_op op = { .code = OP__FUSE, .m = nflake, .n = qflakes };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
 
-    state_t new_qstates = 0;
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
 
-    { verbose(me->logstream, "  --> merge states.");
+    verbose(me->logstream, "START fuse %u flakes from flake %u.", qflakes, nflake);
 
-        double start = get_app_age();
-        uint64_t counter = 0;
-        uint64_t merged = 0;
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
+        verbose(me->logstream, "FAILED fuse.");
+        return 1;
+    }
 
-        const struct state_info * const end = state_infos + old_qstates;
-        struct state_info * left = state_infos;
+    if (nflake <= 0 || qflakes < 2 || nflake + qflakes > ofsm->qflakes) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Invalid flake range %u - %u, expected values might be in range 1 - %u.", nflake, nflake + qflakes - 1, ofsm->qflakes - 1);
+        verbose(me->logstream, "FAILED fuse.");
+        return 1;
+    }
 
-        while (left != end) {
-            struct state_info * right = left + 1;
-            while (right != end && right->hash == left->hash) {
-                ++right;
-            }
+    for (unsigned int i = nflake; i < nflake + qflakes - 1; ++i) {
+        ofsm->flakes[i].flags |= FLAKE_FLAG__FUSE_NEXT;
+    }
 
-            struct state_info * base;
-            if (left->hash != INVALID_HASH || left == state_infos) {
-                base = left;
-                ++new_qstates;
-                left->new = left->old;
-                ++left;
-            } else {
-                base = state_infos;
-            }
+    verbose(me->logstream, "DONE fuse.");
+    return complete_operation(me);
+}
 
-            while (left != right) {
 
-                // Current state is unmerged by default
-                left->new = left->old;
 
-                // Try to merge
-                for (const struct state_info * ptr = base; ptr != left; ++ptr) {
+#define PRUNE__REACHABLE    1
+#define PRUNE__ALIVE        2
+#define PRUNE__KEEP         (PRUNE__REACHABLE | PRUNE__ALIVE)
 
-                    if (ptr->new != ptr->old) {
-                        // This state was merged with another one, no sence to merge.
-                        continue;
-                    }
+int ofsm_builder_prune(struct ofsm_builder * restrict const me)
+{
+    if (skip_operation(me)) {
+        return 0;
+    }
 
-                    // Try to merge
-                    state_t * const a = flake->jumps[1] + ptr->old * qinputs;
-                    state_t * const b = flake->jumps[1] + left->old * qinputs;
-                    const int was_merged = merge(qinputs, a, b) != 0;
+    const struct builder_op op = { .code = OP__PRUNE };
+    if (me->flags & OBF__DEFERRED) {
+        return defer_operation(me, &op);
+    }
 
-                    if (was_merged) {
-                        left->new = ptr->new;
-                        ++merged;
-                        break;
+    if (cache_lookup(me, &op) != 0) {
+        return complete_operation(me);
+    }
+
+    verbose(me->logstream, "START prune.");
+
+    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "do_ofsm_builder_get_ofsm(me) failed with NULL as error value.");
+        verbose(me->logstream, "FAILED prune.");
+        return 1;
+    }
+
+    if (ofsm->qflakes <= 1) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "Try to prune empty OFSM.");
+        verbose(me->logstream, "FAILED prune.");
+        return 1;
+    }
+
+    const unsigned int last = ofsm->qflakes - 1;
+
+    size_t sizes[last + 1];
+    sizes[0] = 0;
+    for (unsigned int nflake = 1; nflake <= last; ++nflake) {
+        sizes[nflake] = ofsm->flakes[nflake].qstates * sizeof(state_t);
+    }
+
+    void * ptrs[last + 1];
+    multialloc(last + 1, sizes, ptrs, 32);
+    if (ptrs[0] == NULL) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "multialloc(%u, sizes, ptrs, 32) failed for temporary pruning data.", last + 1);
+        verbose(me->logstream, "FAILED prune.");
+        return 1;
+    }
+
+    state_t * const * const marks = (state_t * const *)ptrs;
+    for (unsigned int nflake = 1; nflake <= last; ++nflake) {
+        memset(marks[nflake], 0, sizes[nflake]);
+    }
+
+
+
+    { verbose(me->logstream, "  --> forward reachability.");
+
+        marks[1][0] = PRUNE__REACHABLE;
+        for (unsigned int nflake = 1; nflake < last; ++nflake) {
+            const struct flake * const flake = ofsm->flakes + nflake;
+            const state_t * jump = flake->jumps[1];
+            for (state_t state = 0; state < flake->qstates; ++state) {
+                if ((marks[nflake][state] & PRUNE__REACHABLE) == 0) {
+                    jump += flake->qinputs;
+                    continue;
+                }
+                for (input_t input = 0; input < flake->qinputs; ++input) {
+                    const state_t output = *jump++;
+                    if (output != INVALID_STATE) {
+                        marks[nflake+1][output] |= PRUNE__REACHABLE;
                     }
                 }
+            }
+        }
 
-                if ((++counter & 0xFFF) == 0) {
-                    const double now = get_app_age();
-                    if (now - start > 60.0) {
-                        const uint64_t processed = left - state_infos;
-                        const uint64_t total = old_qstates;
-                        const double persent = 100.0 * processed / total;
-
-                        const uint64_t chunk_processed = left - base;
-                        const uint64_t chunk_total = right - base;
-                        const double chunk_persent = 100.0 * chunk_processed / chunk_total;
+    } verbose(me->logstream, "  <<< forward reachability.");
 
-                        verbose(me->logstream, "    processed total %5.2f%%, this chunk %5.2f%%: total %lu/%lu, chunk %lu/%lu, merged = %lu.",
-                            persent, chunk_persent, processed, total, chunk_processed, chunk_total, merged);
 
-                        start = now;
+
+    { verbose(me->logstream, "  --> backward liveness.");
+
+        for (unsigned int nflake = last; nflake >= 1; --nflake) {
+            const struct flake * const flake = ofsm->flakes + nflake;
+            const state_t * jump = flake->jumps[1];
+            for (state_t state = 0; state < flake->qstates; ++state) {
+                int is_alive = 0;
+                for (input_t input = 0; input < flake->qinputs; ++input) {
+                    const state_t output = *jump++;
+                    if (output == INVALID_STATE) continue;
+                    if (nflake == last || (marks[nflake+1][output] & PRUNE__ALIVE) != 0) {
+                        is_alive = 1;
                     }
                 }
-
-                new_qstates += left->new == left->old;
-                ++left;
+                if (is_alive) {
+                    marks[nflake][state] |= PRUNE__ALIVE;
+                }
             }
         }
-    } verbose(me->logstream, "  <<< merge states.");
 
+    } verbose(me->logstream, "  <<< backward liveness.");
 
 
-    { verbose(me->logstream, "  --> replace old jumps with a new one.");
 
-        state_t new_qstate = 0;
+    uint64_t removed = 0;
 
-        size_t sizes[2] = { 0, new_qstates * qinputs * sizeof(state_t) };
-        void * ptrs[2];
-        multialloc(2, sizes, ptrs, 32);
-        if (ptrs[0] == NULL) {
-            ERRLOCATION(me->errstream);
-            msg(me->errstream, "multialloc(2, { %lu, %lu }, ptrs, 32) failed with NULL value during reallocating new jump table.", sizes[0], sizes[1]);
-            free(ptr);
-            return 1;
+    { verbose(me->logstream, "  --> renumber states.");
+
+        for (unsigned int nflake = 1; nflake <= last; ++nflake) {
+            const state_t qstates = ofsm->flakes[nflake].qstates;
+            state_t * restrict const mark = marks[nflake];
+            state_t new_qstates = 0;
+            for (state_t state = 0; state < qstates; ++state) {
+                // The start state is always kept, even for an OFSM without valid paths.
+                if (mark[state] == PRUNE__KEEP || nflake == 1) {
+                    mark[state] = new_qstates++;
+                } else {
+                    mark[state] = INVALID_STATE;
+                }
+            }
+            removed += qstates - new_qstates;
+            sizes[nflake] = new_qstates;
         }
 
-        state_t * new_jumps = ptrs[1];
-        const state_t * old_jumps = flake->jumps[1];
-        struct state_info * restrict ptr = state_infos;
-        const struct state_info * end = state_infos + old_qstates;
-        for (; ptr != end; ++ptr) {
-            if (ptr->new != ptr->old) {
-                state_infos[ptr->old].index = state_infos[ptr->new].index;
+    } verbose(me->logstream, "  <<< renumber states, %lu states will be removed.", removed);
+
+
+
+    { verbose(me->logstream, "  --> rebuild flakes.");
+
+        // All new blocks are allocated first, so a failure leaves the OFSM untouched
+        void * jump_ptrs[last + 1][2];
+        void * path_ptrs[last + 1][2];
+        int is_changed[last + 1];
+
+        for (unsigned int nflake = 1; nflake <= last; ++nflake) {
+            const struct flake * const flake = ofsm->flakes + nflake;
+            const state_t new_qstates = sizes[nflake];
+            const state_t new_qoutputs = nflake < last ? sizes[nflake+1] : flake->qoutputs;
+            jump_ptrs[nflake][0] = NULL;
+            path_ptrs[nflake][0] = NULL;
+            is_changed[nflake] = new_qstates != flake->qstates || new_qoutputs != flake->qoutputs;
+            if (!is_changed[nflake]) {
                 continue;
             }
 
-            state_infos[ptr->old].index = new_qstate++;
-            memcpy(new_jumps, old_jumps + ptr->old * qinputs, qinputs * sizeof(state_t));
-            new_jumps += qinputs;
-        }
+            const size_t jump_sizes[2] = { 0, (size_t)new_qstates * flake->qinputs * sizeof(state_t) };
+            const size_t path_sizes[2] = { 0, (size_t)new_qoutputs * nflake * sizeof(input_t) };
 
-        free(flake->jumps[0]);
-        flake->jumps[0] = ptrs[0];
-        flake->jumps[1] = ptrs[1];
-        flake->qstates = new_qstates;
+            multialloc(2, jump_sizes, jump_ptrs[nflake], 32);
+            if (nflake < last && jump_ptrs[nflake][0] != NULL) {
+                multialloc(2, path_sizes, path_ptrs[nflake], 32);
+            }
 
-    } verbose(me->logstream, "  <<< replace old jumps with a new one.");
+            if (jump_ptrs[nflake][0] == NULL || (nflake < last && path_ptrs[nflake][0] == NULL)) {
+                ERRLOCATION(me->errstream);
+                msg(me->errstream, "multialloc(2, sizes, ptrs, 32) failed for flake %u during pruning.", nflake);
+                verbose(me->logstream, "FAILED prune.");
+                for (unsigned int i = 1; i <= nflake; ++i) {
+                    free(jump_ptrs[i][0]);
+                    free(path_ptrs[i][0]);
+                }
+                free(ptrs[0]);
+                return 1;
+            }
+        }
 
+        for (unsigned int nflake = 1; nflake <= last; ++nflake) {
+            if (!is_changed[nflake]) {
+                continue;
+            }
 
+            struct flake * restrict const flake = ofsm->flakes + nflake;
+            const input_t qinputs = flake->qinputs;
+            const state_t * const translate = nflake < last ? marks[nflake+1] : NULL;
+            const state_t * old_jump = flake->jumps[1];
+            state_t * restrict new_jump = jump_ptrs[nflake][1];
+            for (state_t state = 0; state < flake->qstates; ++state) {
+                if (marks[nflake][state] == INVALID_STATE) {
+                    old_jump += qinputs;
+                    continue;
+                }
+                for (input_t input = 0; input < qinputs; ++input) {
+                    const state_t output = *old_jump++;
+                    if (output == INVALID_STATE || translate == NULL) {
+                        *new_jump++ = output;
+                    } else {
+                        *new_jump++ = translate[output];
+                    }
+                }
+            }
 
-    { verbose(me->logstream, "  --> decode output states in the previous flake.");
+            flake_release_jumps(flake);
+            flake->jumps[0] = jump_ptrs[nflake][0];
+            flake->jumps[1] = jump_ptrs[nflake][1];
+            flake->qstates = sizes[nflake];
+
+            if (nflake < last) {
+                const input_t * old_path = flake->paths[1];
+                input_t * restrict const new_paths = path_ptrs[nflake][1];
+                for (state_t output = 0; output < flake->qoutputs; ++output) {
+                    const state_t new_output = translate[output];
+                    if (new_output != INVALID_STATE) {
+                        memcpy(new_paths + (size_t)new_output * nflake, old_path, nflake * sizeof(input_t));
+                    }
+                    old_path += nflake;
+                }
 
-        const struct flake * prev = flake - 1;
-        state_t * restrict jump = prev->jumps[1];
-        const state_t * end = jump + prev->qinputs * prev->qstates;
-        for (; jump != end; ++jump) {
-            if (*jump != INVALID_STATE) {
-                *jump = state_infos[*jump].index;
+                flake_release_paths(flake);
+                flake->paths[0] = path_ptrs[nflake][0];
+                flake->paths[1] = path_ptrs[nflake][1];
+                flake->qoutputs = sizes[nflake+1];
             }
         }
 
-        flake[-1].qoutputs = flake->qstates;
+    } verbose(me->logstream, "  <<< rebuild flakes.");
 
-    } verbose(me->logstream, "  <<< decode output states in the previous flake.");
 
-    if (nflake > 1) {
 
-        verbose(me->logstream, "  --> update path from previous flake.");
+    free(ptrs[0]);
+    verbose(me->logstream, "DONE prune, %lu states were removed.", removed);
+    return complete_operation(me);
+}
 
-        const struct flake * const prev = flake - 1;
-        const size_t path_len = nflake - 1;
-        const size_t new_path_len = prev->qoutputs * path_len;
-        const size_t new_path_sizes[2] = { 0, new_path_len * sizeof(input_t) };
-        void * new_path_ptrs[2];
-        multialloc(2, new_path_sizes, new_path_ptrs, 32);
 
-        if (new_path_ptrs[0] == NULL) {
-            ERRLOCATION(me->errstream);
-            msg(me->errstream, "multialloc(2, { %lu, %lu }, ptrs, 32) failed with NULL value during reallocating new jump table.", new_path_sizes[0], new_path_sizes[1]);
-            free(ptr);
-            return 1;
-        }
 
-        input_t * restrict new_path = new_path_ptrs[1];
-        for (size_t i=0; i<new_path_len; ++i) {
-            new_path[i] = INVALID_INPUT;
-        }
+/* Auto-tuning of optimization steps */
 
-        const size_t path_sz = path_len * sizeof(input_t);
-        for (size_t old_state = 0; old_state < old_qstates; ++old_state) {
-            const state_t index = state_infos[old_state].index;
-            const size_t new_path_index = index * path_len;
-            const size_t old_path_index = old_state * path_len;
-            if (new_path[new_path_index] == INVALID_INPUT) {
-                void * new_input = new_path + new_path_index;
-                const void * old_input = prev->paths[1] + old_path_index;
-                memcpy(new_input, old_input, path_sz);
-            }
-        }
+struct tune_state
+{
+    FILE * logstream;
+    const char * cache_dir;
+    const char * checkpoint_path;
+    int flags;
+    unsigned int qops;
+    unsigned int qskip;
+    unsigned int stack_len;
+};
 
-        free(flake[-1].paths[0]);
-        flake[-1].paths[0] = new_path_ptrs[0];
-        flake[-1].paths[1] = new_path_ptrs[1];
+static void tune_silence(struct ofsm_builder * restrict const me, struct tune_state * restrict const saved)
+{
+    saved->logstream = me->logstream;
+    saved->cache_dir = me->cache_dir;
+    saved->checkpoint_path = me->checkpoint_path;
+    saved->flags = me->flags;
+    saved->qops = me->qops;
+    saved->qskip = me->qskip;
+    saved->stack_len = me->stack_len;
+
+    /*
+     * Trials are thrown away, so they are neither logged, cached, checkpointed nor verified.
+     * They must run immediately and must not consume operations to skip after load of a checkpoint.
+     */
+    me->logstream = NULL;
+    me->cache_dir = NULL;
+    me->checkpoint_path = NULL;
+    me->flags &= ~(OBF__AUTO_VERIFY | OBF__AUTO_VERIFY_SAMPLED | OBF__DEFERRED);
+    me->qskip = 0;
+}
 
-        verbose(me->logstream, "  <<< update path from previous flake.");
+static void tune_restore(struct ofsm_builder * restrict const me, const struct tune_state * const saved)
+{
+    while (me->stack_len > saved->stack_len) {
+        ofsm_builder_drop(me);
     }
 
-    free(ptr);
+    me->logstream = saved->logstream;
+    me->cache_dir = saved->cache_dir;
+    me->checkpoint_path = saved->checkpoint_path;
+    me->flags = saved->flags;
+    me->qops = saved->qops;
+    me->qskip = saved->qskip;
+}
+
+static int measure_export_len(const struct ofsm_builder * const me, const unsigned int export_flags, uint64_t * restrict const len)
+{
+    struct ofsm_array array;
+    const int status = ofsm_export_array(me->stack[me->stack_len - 1], 0, export_flags, &array);
+    if (status != 0) {
+        return status;
+    }
+
+    *len = array.len;
+    free(array.array);
     return 0;
 }
 
-int ofsm_builder_optimize(struct ofsm_builder * restrict const me, const unsigned int nflake, unsigned int qflakes, hash_func f)
+static int try_tune_step(struct ofsm_builder * restrict const me, const struct ofsm_recipe_step * const step, const unsigned int export_flags, uint64_t * restrict const len)
 {
-    struct ofsm * restrict const ofsm = do_ofsm_builder_get_ofsm(me);
-    if (ofsm == NULL) {
+    const int status = 0
+        || ofsm_builder_dup(me)
+        || ofsm_builder_optimize(me, step->nflake, step->qflakes, step->f)
+        || measure_export_len(me, export_flags, len)
+    ;
+
+    const int drop_status = me->stack_len > 0 ? ofsm_builder_drop(me) : 0;
+    return status != 0 ? status : drop_status;
+}
+
+/*
+ * Greedy search: every pass tries each candidate hash on each flake alone and on the range down to the first flake,
+ * the step with the shortest export is appended to the recipe. Passes repeat until nothing improves.
+ */
+int ofsm_builder_autotune(struct ofsm_builder * restrict const me, const unsigned int qhashes, const struct ofsm_tune_hash * const hashes, const unsigned int export_flags, struct ofsm_recipe * restrict const recipe)
+{
+    verbose(me->logstream, "START autotune.");
+
+    if ((me->flags & OBF__DEFERRED) && ofsm_builder_execute(me) != 0) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "ofsm_builder_optimize(me) failed with NULL as error value.");
+        msg(me->errstream, "ofsm_builder_execute(me) failed before autotune.");
+        verbose(me->logstream, "FAILED autotune.");
         return 1;
     }
 
-    if (nflake <= 0 || nflake >= ofsm->qflakes) {
+    const struct ofsm * const ofsm = do_ofsm_builder_get_ofsm(me);
+    if (ofsm == NULL || ofsm->qflakes <= 1 || me->stack_len + 2 > OFSM_STACK_SZ) {
         ERRLOCATION(me->errstream);
-        msg(me->errstream, "Invalid flake number (%u), expected value might be in range 1 - %u.", nflake, ofsm->qflakes - 1);
+        msg(me->errstream, "Autotune requires not empty OFSM on the top and two free stack slots, stack_len = %u.", me->stack_len);
+        verbose(me->logstream, "FAILED autotune.");
         return 1;
     }
 
-    if (qflakes == 0) --qflakes;
+    const unsigned int last = ofsm->qflakes - 1;
+    const unsigned int qcandidates = 2 + qhashes;
+    struct ofsm_tune_hash candidates[qcandidates];
+    candidates[0] = (struct ofsm_tune_hash) { NULL, 0 };
+    candidates[1] = (struct ofsm_tune_hash) { get_row_hash, 0 };
+    for (unsigned int i = 0; i < qhashes; ++i) {
+        candidates[2 + i] = hashes[i];
+    }
 
-    for (unsigned int i = 0; i < qflakes; ++i) {
-        const unsigned int current_nflake = nflake - i;
-        if (current_nflake <= 0) {
+    recipe->qsteps = 0;
+
+    struct tune_state saved;
+    tune_silence(me, &saved);
+
+    int status = 0
+        || measure_export_len(me, export_flags, &recipe->base_len)
+        || ofsm_builder_dup(me)
+    ;
+
+    recipe->len = recipe->base_len;
+    verbose(saved.logstream, "  initial export length is %lu.", recipe->base_len);
+
+    while (status == 0 && recipe->qsteps < OFSM_RECIPE_SZ) {
+
+        if (is_cancelled(me)) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "Autotune is interrupted after %u steps.", recipe->qsteps);
+            status = 1;
             break;
         }
 
-        struct flake * restrict const flake = ofsm->flakes + current_nflake;
-        verbose(me->logstream, "START optimize flake %u.", current_nflake);
+        verbose(saved.logstream, "  --> pass %u.", recipe->qsteps + 1);
 
-        const int status = ofsm_builder_optimize_flake(me, current_nflake, flake, f);
-        if (status == 0) {
-            verbose(me->logstream, "DONE optimize flake %u.", current_nflake);
-        } else {
+        struct ofsm_recipe_step best = { 0, 0, NULL, 0 };
+        uint64_t best_len = recipe->len;
+
+        for (unsigned int nflake = last; status == 0 && nflake > 0; --nflake) {
+            const unsigned int ranges[2] = { 1, nflake };
+            const unsigned int qranges = nflake > 1 ? 2 : 1;
+
+            for (unsigned int nrange = 0; status == 0 && nrange < qranges; ++nrange) {
+                const unsigned int qflakes = ranges[nrange];
+
+                for (unsigned int nhash = 0; nhash < qcandidates; ++nhash) {
+                    const struct ofsm_tune_hash * const candidate = candidates + nhash;
+                    if (candidate->nflake != 0 && (candidate->nflake != nflake || qflakes != 1)) {
+                        continue;
+                    }
+
+                    const struct ofsm_recipe_step step = { nflake, qflakes, candidate->f, nhash };
+                    uint64_t len;
+                    status = try_tune_step(me, &step, export_flags, &len);
+                    if (status != 0) {
+                        ERRLOCATION(me->errstream);
+                        msg(me->errstream, "Trial of optimize(%u, %u) with hash %u failed with %d as error code.", nflake, qflakes, nhash, status);
+                        break;
+                    }
+
+                    verbose(saved.logstream, "      optimize(%u, %u) with hash %u gives %lu.", nflake, qflakes, nhash, len);
+                    if (len < best_len) {
+                        best_len = len;
+                        best = step;
+                    }
+                }
+            }
+        }
+
+        if (status != 0 || best_len >= recipe->len) {
+            verbose(saved.logstream, "  <<< pass %u, no improvement.", recipe->qsteps + 1);
+            break;
+        }
+
+        status = ofsm_builder_optimize(me, best.nflake, best.qflakes, best.f);
+        if (status != 0) {
             ERRLOCATION(me->errstream);
-            msg(me->errstream, "ofsm_builder_optimize_flake(me, flake, f) failed with %d as error code.\n", status);
-            verbose(me->logstream, "FAILED optimize flake %u.", current_nflake);
+            msg(me->errstream, "ofsm_builder_optimize(me, %u, %u, f) failed with %d as error code.", best.nflake, best.qflakes, status);
+            break;
+        }
+
+        recipe->steps[recipe->qsteps++] = best;
+        recipe->len = best_len;
+        verbose(saved.logstream, "  <<< pass %u, optimize(%u, %u) with hash %u gives %lu.", recipe->qsteps, best.nflake, best.qflakes, best.nhash, best_len);
+    }
+
+    tune_restore(me, &saved);
+
+    if (status != 0) {
+        verbose(me->logstream, "FAILED autotune.");
+        return 1;
+    }
+
+    verbose(me->logstream, "  --> apply recipe of %u steps.", recipe->qsteps);
+    status = ofsm_builder_apply_recipe(me, recipe);
+    verbose(me->logstream, "  <<< apply recipe of %u steps.", recipe->qsteps);
+
+    if (status != 0) {
+        ERRLOCATION(me->errstream);
+        msg(me->errstream, "ofsm_builder_apply_recipe(me, recipe) failed with %d as error code.", status);
+        verbose(me->logstream, "FAILED autotune.");
+        return 1;
+    }
+
+    verbose(me->logstream, "DONE autotune, export length %lu -> %lu.", recipe->base_len, recipe->len);
+    return 0;
+}
+
+int ofsm_builder_apply_recipe(struct ofsm_builder * restrict const me, const struct ofsm_recipe * const recipe)
+{
+    for (unsigned int i = 0; i < recipe->qsteps; ++i) {
+        const struct ofsm_recipe_step * const step = recipe->steps + i;
+        const int status = ofsm_builder_optimize(me, step->nflake, step->qflakes, step->f);
+        if (status != 0) {
+            ERRLOCATION(me->errstream);
+            msg(me->errstream, "ofsm_builder_optimize(me, %u, %u, f) failed with %d as error code on recipe step %u.", step->nflake, step->qflakes, status, i);
             return 1;
         }
     }
 
-    return autoverify(me);
+    return 0;
 }
 
 
@@ -1335,7 +6618,7 @@ int ofsm_builder_verify(const struct ofsm_builder * const me)
 
     for (size_t i=0; i < me->stack_len; ++i) {
         const struct ofsm * const ofsm= me->stack[i];
-        const int status = ofsm_verify(ofsm, me->errstream);
+        const int status = ofsm_verify(me, ofsm);
         if (status != 0) {
             return status;
         }
@@ -1345,6 +6628,51 @@ int ofsm_builder_verify(const struct ofsm_builder * const me)
     return 0;
 }
 
+int ofsm_builder_verify_sampled(const struct ofsm_builder * const me, const uint64_t qsamples, const double seconds, uint64_t * restrict const qchecked)
+{
+    verbose(me->logstream, "START sampled verification.");
+
+    unsigned int qtotal = 0;
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        const struct ofsm * const ofsm = me->stack[i];
+        qtotal += ofsm->qflakes - 1;
+    }
+
+    // Flake k gets time until its share of the budget ends, time left by fast flakes goes to the next ones
+    const double start = get_monotonic_time();
+    unsigned int nchecked_flakes = 0;
+    uint64_t qoutputs = 0;
+    *qchecked = 0;
+
+    for (unsigned int i = 0; i < me->stack_len; ++i) {
+        const struct ofsm * const ofsm = me->stack[i];
+        if (verify_flake_links(ofsm, me->errstream) != 0) {
+            verbose(me->logstream, "FAILED sampled verification.");
+            return 1;
+        }
+
+        for (unsigned int nflake = 1; nflake < ofsm->qflakes; ++nflake) {
+            const double deadline = seconds > 0 ? start + seconds * (nchecked_flakes + 1) / qtotal : 0;
+            uint64_t qflake_checked = 0;
+            const int status = verify_flake_sampled(me, ofsm, nflake, qsamples, deadline, &qflake_checked);
+
+            *qchecked += qflake_checked;
+            qoutputs += ofsm->flakes[nflake].qoutputs;
+            ++nchecked_flakes;
+
+            if (status != 0) {
+                verbose(me->logstream, "FAILED sampled verification.");
+                return 1;
+            }
+
+            verbose(me->logstream, "  item %u flake %u: %lu of %u paths are checked.", i, nflake, qflake_checked, ofsm->flakes[nflake].qoutputs);
+        }
+    }
+
+    verbose(me->logstream, "DONE sampled verification, %lu of %lu paths are checked.", *qchecked, qoutputs);
+    return 0;
+}
+
 
 
 const void * ofsm_builder_get_ofsm(const struct ofsm_builder * const me)
@@ -1362,9 +6690,26 @@ state_t ofsm_execute(const void * const ofsm, const unsigned int n, const input_
     return do_ofsm_execute(ofsm, n, inputs);
 }
 
+const pack_value_t * ofsm_get_records(const void * const ofsm, unsigned int * restrict const qvalues, state_t * restrict const qrecords)
+{
+    const struct ofsm * const me = ofsm;
+    if (qvalues != NULL) {
+        *qvalues = me->qvalues;
+    }
+    if (qrecords != NULL) {
+        *qrecords = me->qrecords;
+    }
+    return me->records;
+}
+
 int ofsm_get_array(const void * const ofsm, const unsigned int delta_last, struct ofsm_array * restrict const out)
 {
-    return do_ofsm_get_array(ofsm, delta_last, out);
+    return do_ofsm_get_array(ofsm, delta_last, 0, out);
+}
+
+int ofsm_export_array(const void * const ofsm, const unsigned int delta_last, const unsigned int flags, struct ofsm_array * restrict const out)
+{
+    return do_ofsm_get_array(ofsm, delta_last, flags, out);
 }
 
 
@@ -1387,12 +6732,18 @@ int ofsm_array_print(const struct ofsm_array * const array, FILE * const f, cons
     return 0;
 }
 
+// Class table row has one byte per input value
+#define MAX_CLASSES_WIDTH   (1u << (8 * sizeof(input_t)))
+
 int ofsm_array_save_binary(const struct ofsm_array * const array, FILE * f, const char * const name)
 {
     struct array_header header;
     memset(header.name, 0, 16);
     header.start_from = array->start_from;
-    header.qflakes = array->qflakes;
+    header.qflakes = array->qflakes
+        | (array->classes != NULL ? ARRAY_HEADER__CLASSES : 0)
+        | (array->flags & EXPORT_FLAG__ORDERED_INPUTS ? ARRAY_HEADER__ORDERED : 0)
+    ;
     header.len = array->len;
     strncpy(header.name, name, 16);
 
@@ -1408,5 +6759,84 @@ int ofsm_array_save_binary(const struct ofsm_array * const array, FILE * f, cons
         return 1;
     }
 
+    if (array->classes != NULL) {
+        const size_t classes_sz = (size_t)array->qflakes * array->classes_width;
+        const size_t written3 = fwrite(&array->classes_width, 1, sizeof(uint32_t), f);
+        const size_t written4 = fwrite(array->classes, 1, classes_sz, f);
+        if (written3 != sizeof(uint32_t) || written4 != classes_sz) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int ofsm_array_load_binary(struct ofsm_array * restrict const array, FILE * f, char * const name)
+{
+    memset(array, 0, sizeof(struct ofsm_array));
+
+    struct array_header header;
+    const size_t header_sz = sizeof(struct array_header);
+    const size_t was_read1 = fread(&header, 1, header_sz, f);
+    if (was_read1 != header_sz) {
+        return 1;
+    }
+
+    if (header.len > SIZE_MAX / sizeof(uint32_t)) {
+        return 1;
+    }
+
+    const size_t sz = header.len * sizeof(uint32_t);
+    uint32_t * data = malloc(sz);
+    if (data == NULL) {
+        return 1;
+    }
+
+    const size_t was_read2 = fread(data, 1, sz, f);
+    if (was_read2 != sz) {
+        free(data);
+        return 1;
+    }
+
+    const uint32_t qflakes = header.qflakes & ~(ARRAY_HEADER__CLASSES | ARRAY_HEADER__ORDERED);
+
+    if (header.qflakes & ARRAY_HEADER__CLASSES) {
+        // Input class tables are written as a trailer, keep them in the same block
+        uint32_t classes_width;
+        const size_t was_read3 = fread(&classes_width, 1, sizeof(uint32_t), f);
+        if (was_read3 != sizeof(uint32_t) || classes_width == 0 || classes_width > MAX_CLASSES_WIDTH) {
+            free(data);
+            return 1;
+        }
+
+        const size_t classes_sz = (size_t)qflakes * classes_width;
+        uint32_t * const tmp = realloc(data, sz + classes_sz);
+        if (tmp == NULL) {
+            free(data);
+            return 1;
+        }
+        data = tmp;
+
+        const size_t was_read4 = fread(data + header.len, 1, classes_sz, f);
+        if (was_read4 != classes_sz) {
+            free(data);
+            return 1;
+        }
+
+        array->classes_width = classes_width;
+        array->classes = (uint8_t *)(data + header.len);
+    }
+
+    if (name != NULL) {
+        memcpy(name, header.name, 16);
+        name[16] = '\0';
+    }
+
+    array->start_from = header.start_from;
+    array->qflakes = qflakes;
+    array->flags = header.qflakes & ARRAY_HEADER__ORDERED ? EXPORT_FLAG__ORDERED_INPUTS : 0;
+    array->len = header.len;
+    array->array = data;
     return 0;
 }
+
@@ -1,10 +1,39 @@
 #include "yoo-ofsm.h"
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
-
-
-
+#include <unistd.h>
+
+
+
+int parallel_verify_failure_test(void);
+int deferred_cancel_test(void);
+int sampled_verify_failure_test(void);
+int sampled_verify_test(void);
+int parallel_verify_test(void);
+int incremental_verify_test(void);
+int autotune_test(void);
+int shard_test(void);
+int cache_test(void);
+int deferred_test(void);
+int async_test(void);
+int checkpoint_test(void);
+int buckets_test(void);
+int dup_test(void);
+int push_array_test(void);
+int compose_test(void);
+int nary_product_test(void);
+int ordered_test(void);
+int pack_key_test(void);
+int pack_multi_test(void);
+int compress_test(void);
+int permute_test(void);
+int fuse_test(void);
+int split_test(void);
+int prune_test(void);
+int custom_test(void);
+int comb_94_test(void);
 int optimize_with_hash_path_test(void);
 int optimize_with_invalid_hash_test(void);
 int optimize_with_zero_hash_test(void);
@@ -34,6 +63,33 @@ struct test_item
 #define TEST_ITEM(name) { #name, &name##_test }
 struct test_item tests[] = {
     TEST_ITEM(empty),
+    TEST_ITEM(parallel_verify_failure),
+    TEST_ITEM(deferred_cancel),
+    TEST_ITEM(sampled_verify_failure),
+    TEST_ITEM(sampled_verify),
+    TEST_ITEM(parallel_verify),
+    TEST_ITEM(incremental_verify),
+    TEST_ITEM(autotune),
+    TEST_ITEM(shard),
+    TEST_ITEM(cache),
+    TEST_ITEM(deferred),
+    TEST_ITEM(async),
+    TEST_ITEM(checkpoint),
+    TEST_ITEM(buckets),
+    TEST_ITEM(dup),
+    TEST_ITEM(push_array),
+    TEST_ITEM(compose),
+    TEST_ITEM(nary_product),
+    TEST_ITEM(ordered),
+    TEST_ITEM(pack_key),
+    TEST_ITEM(pack_multi),
+    TEST_ITEM(compress),
+    TEST_ITEM(permute),
+    TEST_ITEM(fuse),
+    TEST_ITEM(split),
+    TEST_ITEM(prune),
+    TEST_ITEM(custom),
+    TEST_ITEM(comb_94),
     TEST_ITEM(optimize_with_hash_path),
     TEST_ITEM(optimize_with_invalid_hash),
     TEST_ITEM(optimize_with_zero_hash),
@@ -1235,3 +1291,2607 @@ int optimize_with_hash_path_test(void)
     free_ofsm_builder(me);
     return 0;
 }
+
+
+
+int comb_94_test(void)
+{
+    static const unsigned int NFLAKE = 4;
+    static const unsigned int QINPUTS = 9;
+    static const state_t QOUTS = 126;
+    static const unsigned int DELTA = 1;
+    static const int EXPECTED_STAT = 24;
+
+    int status;
+    int stat[QOUTS];
+    memset(stat, 0, sizeof(stat));
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+    me->qthreads = 3;
+
+    status = ofsm_builder_push_comb(me, QINPUTS, NFLAKE);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_push_comb(me, %u, %u) failed with %d as error code.\n", QINPUTS, NFLAKE, status);
+        return 1;
+    }
+
+    struct ofsm_array array;
+    status = ofsm_builder_make_array(me, DELTA, &array);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    const void * const ofsm = ofsm_builder_get_ofsm(me);
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<QINPUTS; ++c[0])
+    for (c[1]=0; c[1]<QINPUTS; ++c[1])
+    for (c[2]=0; c[2]<QINPUTS; ++c[2])
+    for (c[3]=0; c[3]<QINPUTS; ++c[3]) {
+        const unsigned int value = run_array(&array, c);
+        const state_t state = ofsm_execute(ofsm, NFLAKE, c);
+
+        uint64_t mask = 0;
+        for (unsigned int i=0; i<NFLAKE; ++i) {
+            mask |= 1ull << c[i];
+        }
+
+        if (__builtin_popcountll(mask) != NFLAKE) {
+            if (value != 0 || state != INVALID_STATE) {
+                fprintf(stderr, "Invalid value (%u) or state (%u) for repeated inputs, expected 0 and INVALID_STATE.\n", value, state);
+                print_path("input =", c, NFLAKE);
+                return 1;
+            }
+            continue;
+        }
+
+        state_t expected = 0;
+        unsigned int k = 0;
+        for (unsigned int input = 0; input < QINPUTS; ++input) {
+            if (mask & (1ull << input)) {
+                unsigned int n = input, r = ++k;
+                uint64_t binomial = 1;
+                for (unsigned int j = 1; j <= r; ++j) {
+                    binomial = binomial * (n - r + j) / j;
+                }
+                expected += r <= n ? binomial : 0;
+            }
+        }
+
+        if (state != expected) {
+            fprintf(stderr, "Unexpected state (%u) after script_execute: expected colex rank %u.\n", state, expected);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+
+        if (state != value - DELTA) {
+            fprintf(stderr, "state & value-DELTA mismatch: state = %u, value = %u, DELTA = %u.\n", state, value, DELTA);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+
+        ++stat[state];
+    }
+
+    for (int i=0; i<QOUTS; ++i) {
+        if (stat[i] != EXPECTED_STAT) {
+            fprintf(stderr, "Invalid stat[%d] = %d, excpected value is %d.\n", i, stat[i], EXPECTED_STAT);
+            return 1;
+        }
+    }
+
+    free(array.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static state_t nondecreasing_jump(void * const user_data, const unsigned int nflake, const state_t state, const input_t input)
+{
+    // State is last input * 16 + sum of inputs
+    const unsigned int last = state / 16;
+    const unsigned int sum = state % 16;
+    if (nflake > 1 && input < last) {
+        return INVALID_STATE;
+    }
+    return input * 16 + sum + input;
+}
+
+static pack_value_t sum_mod3(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    unsigned int sum = 0;
+    for (unsigned int i=0; i<n; ++i) {
+        sum += path[i];
+    }
+    return sum % 3;
+}
+
+// Pack callbacks index tables by inputs, so every path passed to them must be valid
+static pack_value_t strict_sum_mod3(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    static const input_t QINPUTS[3] = { 2, 3, 4 };
+    for (unsigned int i=0; i<n; ++i) {
+        if (path[i] >= QINPUTS[i]) {
+            ++*(unsigned int *)user_data;
+        }
+    }
+    return sum_mod3(NULL, n, path);
+}
+
+// Outputs of custom OFSM are numbered in increasing order of states returned by nondecreasing_jump
+static void calc_nondecreasing_ranks(const input_t * const qinputs, state_t * restrict const ranks, const unsigned int qranks)
+{
+    for (unsigned int i=0; i<qranks; ++i) {
+        ranks[i] = INVALID_STATE;
+    }
+
+    input_t c[3];
+    for (c[0]=0; c[0]<qinputs[0]; ++c[0])
+    for (c[1]=c[0]; c[1]<qinputs[1]; ++c[1])
+    for (c[2]=c[1]; c[2]<qinputs[2]; ++c[2]) {
+        ranks[c[2] * 16 + c[0] + c[1] + c[2]] = 0;
+    }
+
+    state_t qstates = 0;
+    for (unsigned int i=0; i<qranks; ++i) {
+        if (ranks[i] == 0) {
+            ranks[i] = qstates++;
+        }
+    }
+}
+
+int custom_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const input_t QINPUTS[3] = { 2, 3, 4 };
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    unsigned int qinvalid = 0;
+    me->flags |= OBF__AUTO_VERIFY;
+    me->user_data = &qinvalid;
+
+    status = ofsm_builder_push_custom(me, NFLAKE, QINPUTS, nondecreasing_jump);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_push_custom(me, %u, QINPUTS, nondecreasing_jump) failed with %d as error code.\n", NFLAKE, status);
+        return 1;
+    }
+
+    state_t ranks[64];
+    calc_nondecreasing_ranks(QINPUTS, ranks, 64);
+
+    const void * const ofsm = ofsm_builder_get_ofsm(me);
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<QINPUTS[0]; ++c[0])
+    for (c[1]=0; c[1]<QINPUTS[1]; ++c[1])
+    for (c[2]=0; c[2]<QINPUTS[2]; ++c[2]) {
+        const state_t state = ofsm_execute(ofsm, NFLAKE, c);
+        const int is_valid = c[0] <= c[1] && c[1] <= c[2];
+        const state_t expected = is_valid ? ranks[c[2] * 16 + c[0] + c[1] + c[2]] : INVALID_STATE;
+        if (state != expected) {
+            fprintf(stderr, "Unexpected state (%u) after script_execute: expected %u.\n", state, expected);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    status = ofsm_builder_pack(me, strict_sum_mod3, 0);
+    if (status != 0 || qinvalid != 0) {
+        fprintf(stderr, "ofsm_builder_pack(me, strict_sum_mod3, 0) failed with %d as error code, %u invalid paths.\n", status, qinvalid);
+        return 1;
+    }
+
+    status = ofsm_builder_optimize(me, NFLAKE, 0, NULL);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_optimize(me, %u, 0, NULL) failed with %d as error code.\n", NFLAKE, status);
+        return 1;
+    }
+
+    struct ofsm_array array;
+    status = ofsm_builder_make_array(me, 1, &array);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    for (c[0]=0; c[0]<QINPUTS[0]; ++c[0])
+    for (c[1]=0; c[1]<QINPUTS[1]; ++c[1])
+    for (c[2]=0; c[2]<QINPUTS[2]; ++c[2]) {
+        if (c[0] > c[1] || c[1] > c[2]) {
+            continue;
+        }
+
+        const unsigned int value = run_array(&array, c);
+        const unsigned int expected = (c[0] + c[1] + c[2]) % 3 + 1;
+        if (value != expected) {
+            fprintf(stderr, "Unexpected value (%u) after run_array: expected %u.\n", value, expected);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t dead_first_zero(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    if (path[0] == 0) {
+        return INVALID_PACK_VALUE;
+    }
+    return (path[0] + path[1] + path[2]) % 5;
+}
+
+int prune_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const unsigned int DELTA = 1;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_pow(me, 4, NFLAKE)
+        || ofsm_builder_pack(me, dead_first_zero, 0)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building pow(4, 3) OFSM with dead states failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array1;
+    status = ofsm_builder_make_array(me, DELTA, &array1);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    status = ofsm_builder_prune(me);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_prune(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array2;
+    status = ofsm_builder_make_array(me, DELTA, &array2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    // Flake 1 loses output 0, flake 2 loses state 0, flake 3 loses states 0-3.
+    if (array1.len != 88 || array2.len != 68) {
+        fprintf(stderr, "Unexpected array lengths before (%lu) and after (%lu) pruning, expected 88 and 68.\n", array1.len, array2.len);
+        return 1;
+    }
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<4; ++c[0])
+    for (c[1]=0; c[1]<4; ++c[1])
+    for (c[2]=0; c[2]<4; ++c[2]) {
+        const unsigned int value1 = run_array(&array1, c);
+        const unsigned int value2 = run_array(&array2, c);
+        if (value1 != value2) {
+            fprintf(stderr, "Value mismatch after pruning: %u before and %u after.\n", value1, value2);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array1.array);
+    free(array2.array);
+
+
+
+    static const input_t QINPUTS[3] = { 2, 3, 4 };
+
+    status = ofsm_builder_push_custom(me, NFLAKE, QINPUTS, nondecreasing_jump);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_push_custom(me, %u, QINPUTS, nondecreasing_jump) failed with %d as error code.\n", NFLAKE, status);
+        return 1;
+    }
+
+    status = ofsm_builder_prune(me);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_prune(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    state_t ranks[64];
+    calc_nondecreasing_ranks(QINPUTS, ranks, 64);
+
+    const void * const ofsm = ofsm_builder_get_ofsm(me);
+
+    for (c[0]=0; c[0]<QINPUTS[0]; ++c[0])
+    for (c[1]=0; c[1]<QINPUTS[1]; ++c[1])
+    for (c[2]=0; c[2]<QINPUTS[2]; ++c[2]) {
+        const state_t state = ofsm_execute(ofsm, NFLAKE, c);
+        const int is_valid = c[0] <= c[1] && c[1] <= c[2];
+        const state_t expected = is_valid ? ranks[c[2] * 16 + c[0] + c[1] + c[2]] : INVALID_STATE;
+        if (state != expected) {
+            fprintf(stderr, "Unexpected state (%u) after pruning custom OFSM: expected %u.\n", state, expected);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    // Only states 0 and 17 of the first flake are used, they are outputs 0 and 1.
+    struct ofsm_array array3;
+    status = ofsm_builder_make_array(me, 0, &array3);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (array3.array[array3.start_from] != array3.start_from + 2 || array3.array[array3.start_from + 1] != array3.start_from + 2 + 3) {
+        fprintf(stderr, "Unreachable states of the first custom flake were not removed.\n");
+        return 1;
+    }
+
+    free(array3.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t sum_mod5(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    unsigned int sum = 0;
+    for (unsigned int i=0; i<n; ++i) {
+        sum += path[i];
+    }
+    return sum % 5;
+}
+
+int split_test(void)
+{
+    static const unsigned int NFLAKE = 2;
+    static const unsigned int DELTA = 1;
+
+    // Transposed factorization for the second flake: input = input2 * 3 + input1 with input1 < 4, input2 < 3.
+    input_t transposed[12];
+    for (unsigned int input1 = 0; input1 < 4; ++input1)
+    for (unsigned int input2 = 0; input2 < 3; ++input2) {
+        const unsigned int input = input2 * 4 + input1;
+        transposed[input1 * 3 + input2] = input < 11 ? input : INVALID_INPUT;
+    }
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_pow(me, 12, 1)
+        || ofsm_builder_push_pow(me, 11, 1)
+        || ofsm_builder_product(me)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building 12 x 11 OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array1;
+    status = ofsm_builder_make_array(me, DELTA, &array1);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    status = 0
+        || ofsm_builder_split(me, 2, 4, 3, transposed)
+        || ofsm_builder_split(me, 1, 3, 4, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Splitting flakes failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array2;
+    status = ofsm_builder_make_array(me, DELTA, &array2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (array2.qflakes != 2 * NFLAKE) {
+        fprintf(stderr, "Unexpected flake count after split: %u, expected %u.\n", array2.qflakes, 2 * NFLAKE);
+        return 1;
+    }
+
+    const void * const ofsm = ofsm_builder_get_ofsm(me);
+
+    for (unsigned int a = 0; a < 12; ++a)
+    for (unsigned int b = 0; b < 11; ++b) {
+        const input_t inputs[2] = { a, b };
+        const input_t split_inputs[4] = { a / 4, a % 4, b % 4, b / 4 };
+        const unsigned int expected = run_array(&array1, inputs);
+        const unsigned int value = run_array(&array2, split_inputs);
+        const state_t state = ofsm_execute(ofsm, 2 * NFLAKE, split_inputs);
+        if (value != expected || state + DELTA != expected) {
+            fprintf(stderr, "Value mismatch after split: expected %u, array %u, execute %u.\n", expected, value, state);
+            print_path("input =", inputs, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array1.array);
+    free(array2.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+int fuse_test(void)
+{
+    static const unsigned int NFLAKE = 4;
+    static const unsigned int DELTA = 1;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_comb(me, 5, NFLAKE)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building comb(5, 4) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array1;
+    status = ofsm_builder_make_array(me, DELTA, &array1);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    status = ofsm_builder_fuse(me, 1, 2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_fuse(me, 1, 2) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array2;
+    status = ofsm_builder_make_array(me, DELTA, &array2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    status = ofsm_builder_fuse(me, 3, 2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_fuse(me, 3, 2) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array3;
+    status = ofsm_builder_make_array(me, DELTA, &array3);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (array2.qflakes != 3 || array2.start_from != 25 || array3.qflakes != 2 || array3.start_from != 25) {
+        fprintf(stderr, "Unexpected fused arrays: qflakes = %u and %u, start_from = %u and %u.\n", array2.qflakes, array3.qflakes, array2.start_from, array3.start_from);
+        return 1;
+    }
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<5; ++c[0])
+    for (c[1]=0; c[1]<5; ++c[1])
+    for (c[2]=0; c[2]<5; ++c[2])
+    for (c[3]=0; c[3]<5; ++c[3]) {
+        const input_t pair_inputs2[3] = { c[0] * 5 + c[1], c[2], c[3] };
+        const input_t pair_inputs3[2] = { c[0] * 5 + c[1], c[2] * 5 + c[3] };
+        const unsigned int expected = run_array(&array1, c);
+        const unsigned int value2 = run_array(&array2, pair_inputs2);
+        const unsigned int value3 = run_array(&array3, pair_inputs3);
+        if (value2 != expected || value3 != expected) {
+            fprintf(stderr, "Value mismatch after fuse: expected %u, got %u and %u.\n", expected, value2, value3);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array1.array);
+    free(array2.array);
+    free(array3.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t weighted_mod7(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    return (path[0] + path[1] * path[1] + 3 * path[2] + path[3] * path[0]) % 7;
+}
+
+int permute_test(void)
+{
+    static const unsigned int NFLAKE = 4;
+    static const unsigned int DELTA = 1;
+    static const unsigned int ORDER[4] = { 3, 1, 0, 2 };
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_comb(me, 6, 3)
+        || ofsm_builder_push_pow(me, 4, 1)
+        || ofsm_builder_product(me)
+        || ofsm_builder_pack(me, weighted_mod7, 0)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building comb(6, 3) x pow(4, 1) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array1;
+    status = ofsm_builder_make_array(me, DELTA, &array1);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    status = ofsm_builder_permute(me, ORDER);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_permute(me, ORDER) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array2;
+    status = ofsm_builder_make_array(me, DELTA, &array2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<6; ++c[0])
+    for (c[1]=0; c[1]<6; ++c[1])
+    for (c[2]=0; c[2]<6; ++c[2])
+    for (c[3]=0; c[3]<4; ++c[3]) {
+        input_t permuted[NFLAKE];
+        for (unsigned int i=0; i<NFLAKE; ++i) {
+            permuted[i] = c[ORDER[i]];
+        }
+
+        const unsigned int expected = run_array(&array1, c);
+        const unsigned int value = run_array(&array2, permuted);
+        if (value != expected) {
+            fprintf(stderr, "Value mismatch after permute: expected %u, got %u.\n", expected, value);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array1.array);
+    free(array2.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t parity_mix(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    return (path[0] & 1) + 2 * (path[1] % 3) + 6 * (path[2] >= 3);
+}
+
+static unsigned int run_compressed_array(const struct ofsm_array * const array, const input_t * const input)
+{
+    const unsigned int n = array->qflakes;
+    unsigned int current = array->start_from;
+    for (unsigned int i=0; i<n; ++i) {
+        current = array->array[current + array->classes[i * array->classes_width + input[i]]];
+    }
+    return current;
+}
+
+int compress_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const unsigned int DELTA = 1;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_pow(me, 6, NFLAKE)
+        || ofsm_builder_pack(me, parity_mix, 0)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building pow(6, 3) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array1;
+    status = ofsm_builder_make_array(me, DELTA, &array1);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array2;
+    status = ofsm_builder_export_array(me, DELTA, EXPORT_FLAG__COMPRESS_INPUTS, &array2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_export_array(me, DELTA, EXPORT_FLAG__COMPRESS_INPUTS) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (array1.classes != NULL || array2.classes == NULL || array2.classes_width != 6) {
+        fprintf(stderr, "Unexpected class tables: %p and %p, width = %u.\n", (void *)array1.classes, (void *)array2.classes, array2.classes_width);
+        return 1;
+    }
+
+    // Rows shrink to 2, 3 and 2 classes: 3 + 2*1 + 3*2 + 2*6 = 23 instead of 6 + 6*1 + 6*2 + 6*6 = 60.
+    if (array1.len != 60 || array2.len != 23 || array2.start_from != 3) {
+        fprintf(stderr, "Unexpected compressed array: len %lu -> %lu, start_from = %u.\n", array1.len, array2.len, array2.start_from);
+        return 1;
+    }
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<6; ++c[0])
+    for (c[1]=0; c[1]<6; ++c[1])
+    for (c[2]=0; c[2]<6; ++c[2]) {
+        const unsigned int expected = run_array(&array1, c);
+        const unsigned int value = run_compressed_array(&array2, c);
+        if (value != expected) {
+            fprintf(stderr, "Value mismatch after compression: expected %u, got %u.\n", expected, value);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array1.array);
+    free(array2.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static void high_low(void * const user_data, const unsigned int n, const input_t * const path, pack_value_t * const values)
+{
+    input_t high = path[0];
+    input_t low = path[0];
+    for (unsigned int i=1; i<n; ++i) {
+        if (path[i] > high) high = path[i];
+        if (path[i] < low) low = path[i];
+    }
+
+    values[0] = high;
+    values[1] = low < 3 ? low : INVALID_PACK_VALUE - 1;
+}
+
+int pack_multi_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const unsigned int DELTA = 0;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_comb(me, 7, NFLAKE)
+        || ofsm_builder_pack_multi(me, high_low, 2)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building comb(7, 3) high-low OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    const void * const ofsm = ofsm_builder_get_ofsm(me);
+
+    unsigned int qvalues;
+    state_t qrecords;
+    const pack_value_t * const records = ofsm_get_records(ofsm, &qvalues, &qrecords);
+
+    // High card is 2..6, low card is 0..2 (below high-1) or “no low” when all cards are 3 and more.
+    if (records == NULL || qvalues != 2 || qrecords != 14) {
+        fprintf(stderr, "Unexpected records: %p, qvalues = %u, qrecords = %u.\n", (const void *)records, qvalues, qrecords);
+        return 1;
+    }
+
+    struct ofsm_array array;
+    status = ofsm_builder_make_array(me, DELTA, &array);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<7; ++c[0])
+    for (c[1]=0; c[1]<7; ++c[1])
+    for (c[2]=0; c[2]<7; ++c[2]) {
+        if (c[0] == c[1] || c[0] == c[2] || c[1] == c[2]) {
+            continue;
+        }
+
+        pack_value_t expected[2];
+        high_low(NULL, NFLAKE, c, expected);
+
+        const unsigned int record = run_array(&array, c);
+        if (record >= qrecords) {
+            fprintf(stderr, "Invalid record index %u, qrecords = %u.\n", record, qrecords);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+
+        const pack_value_t * const values = records + record * qvalues;
+        if (values[0] != expected[0] || values[1] != expected[1]) {
+            fprintf(stderr, "Record mismatch: got (%lu, %lu), expected (%lu, %lu).\n", values[0], values[1], expected[0], expected[1]);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t multiset_value(const unsigned int n, const input_t * const path)
+{
+    pack_value_t result = 0;
+    for (unsigned int i=0; i<n; ++i) {
+        result += 1ull << (4 * path[i]);
+    }
+    return result;
+}
+
+static void multiset_key(const unsigned int n, const input_t * const path, uint8_t * const key, const size_t key_sz)
+{
+    memset(key, 0, key_sz);
+    for (unsigned int i=0; i<n; ++i) {
+        ++key[key_sz - 1 - path[i]];
+    }
+}
+
+static pack_value_t multiset_pack(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    return multiset_value(n, path);
+}
+
+static uint64_t multiset_hash(void * const user_data, const unsigned int qjumps, const state_t * const jumps, const unsigned int path_len, const input_t * const path)
+{
+    return multiset_value(path_len, path);
+}
+
+static int multiset_pack_key10(void * const user_data, const unsigned int n, const input_t * const path, void * const key)
+{
+    multiset_key(n, path, key, 10);
+    return 0;
+}
+
+static int multiset_pack_key16(void * const user_data, const unsigned int n, const input_t * const path, void * const key)
+{
+    multiset_key(n, path, key, 16);
+    return 0;
+}
+
+static int multiset_hash_key16(void * const user_data, const unsigned int qjumps, const state_t * const jumps, const unsigned int path_len, const input_t * const path, void * const key)
+{
+    multiset_key(path_len, path, key, 16);
+    return 0;
+}
+
+int pack_key_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const unsigned int DELTA = 1;
+
+    pack_key_func * const pack_keys[2] = { multiset_pack_key10, multiset_pack_key16 };
+    const size_t key_sizes[2] = { 10, 16 };
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_pow(me, 10, NFLAKE)
+        || ofsm_builder_pack(me, multiset_pack, 0)
+        || ofsm_builder_optimize(me, NFLAKE, 1, multiset_hash)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building reference pow(10, 3) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array expected;
+    status = ofsm_builder_make_array(me, DELTA, &expected);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    for (unsigned int i=0; i<2; ++i) {
+        status = 0
+            || ofsm_builder_push_pow(me, 10, NFLAKE)
+            || ofsm_builder_pack_key(me, pack_keys[i], key_sizes[i])
+            || ofsm_builder_optimize_key(me, NFLAKE, 1, multiset_hash_key16, 16)
+        ;
+
+        if (status != 0) {
+            fprintf(stderr, "Building pow(10, 3) OFSM with %lu byte keys failed with %d as error code.\n", key_sizes[i], status);
+            return 1;
+        }
+
+        struct ofsm_array array;
+        status = ofsm_builder_make_array(me, DELTA, &array);
+        if (status != 0) {
+            fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+            return 1;
+        }
+
+        // Counters are stored from the last key byte, so keys sort exactly like nibble counters in pack values.
+        if (array.len != expected.len || memcmp(array.array, expected.array, array.len * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "Array for %lu byte keys differs from the reference one, len = %lu, expected %lu.\n", key_sizes[i], array.len, expected.len);
+            return 1;
+        }
+
+        free(array.array);
+    }
+
+    free(expected.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t ordered_value(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    return (path[0] + 3 * path[1] + 5 * path[2]) % 23;
+}
+
+static unsigned int run_ordered_array(const struct ofsm_array * const array, uint64_t mask)
+{
+    unsigned int current = array->start_from;
+    while (mask != 0) {
+        const unsigned int input = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        current = array->array[current + input];
+    }
+    return current;
+}
+
+int ordered_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const unsigned int QINPUTS = 10;
+    static const unsigned int DELTA = 1;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_ordered_comb(me, QINPUTS, NFLAKE)
+        || ofsm_builder_pack(me, ordered_value, 0)
+        || ofsm_builder_prune(me)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building ordered comb(10, 3) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array1;
+    status = ofsm_builder_make_array(me, DELTA, &array1);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array array2;
+    status = ofsm_builder_export_array(me, DELTA, EXPORT_FLAG__ORDERED_INPUTS, &array2);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_export_array(me, DELTA, EXPORT_FLAG__ORDERED_INPUTS) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (array2.len >= array1.len) {
+        fprintf(stderr, "Ordered array is not smaller: %lu vs %lu.\n", array2.len, array1.len);
+        return 1;
+    }
+
+    // Ordered layout survives saving and can not be read as a plain array
+    FILE * const f = tmpfile();
+    if (f == NULL) {
+        fprintf(stderr, "tmpfile() failed with NULL as a result.\n");
+        return 1;
+    }
+
+    struct ofsm_array loaded;
+    status = ofsm_array_save_binary(&array2, f, "Ordered");
+    rewind(f);
+    status = status || ofsm_array_load_binary(&loaded, f, NULL);
+    fclose(f);
+
+    if (status != 0 || (array2.flags & EXPORT_FLAG__ORDERED_INPUTS) == 0 || loaded.flags != array2.flags || loaded.qflakes != array2.qflakes) {
+        fprintf(stderr, "Ordered array is not marked after save and load, status = %d, flags = %u and %u.\n", status, array2.flags, loaded.flags);
+        return 1;
+    }
+
+    if (ofsm_builder_push_array(me, &loaded, NULL, DELTA) == 0) {
+        fprintf(stderr, "Ordered array is pushed as a plain one.\n");
+        return 1;
+    }
+
+    free(loaded.array);
+
+    const void * const ofsm = ofsm_builder_get_ofsm(me);
+
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<QINPUTS; ++c[0])
+    for (c[1]=0; c[1]<QINPUTS; ++c[1])
+    for (c[2]=0; c[2]<QINPUTS; ++c[2]) {
+        // Optimize might merge invalid jumps, so unordered inputs are undefined
+        if (c[0] >= c[1] || c[1] >= c[2]) {
+            continue;
+        }
+
+        const state_t state = ofsm_execute(ofsm, NFLAKE, c);
+        const unsigned int value1 = run_array(&array1, c);
+        const uint64_t mask = (1ull << c[0]) | (1ull << c[1]) | (1ull << c[2]);
+        const unsigned int expected = ordered_value(NULL, NFLAKE, c) + DELTA;
+        const unsigned int value2 = run_ordered_array(&array2, mask);
+        if (state + DELTA != expected || value1 != expected || value2 != expected) {
+            fprintf(stderr, "Value mismatch for ordered input: expected %u, got %u, %u and %u.\n", expected, state + DELTA, value1, value2);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+    }
+
+    free(array1.array);
+    free(array2.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t three_parts(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    return (path[0] * path[1] + path[2] + 2 * path[3] + 3 * path[4]) % 11;
+}
+
+static int build_three_parts(struct ofsm_builder * restrict const me)
+{
+    return 0
+        || ofsm_builder_push_pow(me, 4, 2)
+        || ofsm_builder_push_comb(me, 5, 2)
+        || ofsm_builder_push_pow(me, 3, 1)
+    ;
+}
+
+int nary_product_test(void)
+{
+    static const unsigned int DELTA = 1;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+    me->qthreads = 2;
+
+    struct ofsm_array arrays[4];
+    for (unsigned int i=0; i<4; ++i) {
+        status = build_three_parts(me);
+        switch (i) {
+            case 0:
+                status = status || ofsm_builder_product(me) || ofsm_builder_product(me);
+                break;
+            case 1:
+                status = status || ofsm_builder_nary_product(me, 3, NULL, 0);
+                break;
+            case 2:
+                status = status || ofsm_builder_product(me) || ofsm_builder_product(me) || ofsm_builder_pack(me, three_parts, 0);
+                break;
+            case 3:
+                status = status || ofsm_builder_nary_product(me, 3, three_parts, 0);
+                break;
+        }
+
+        if (status != 0) {
+            fprintf(stderr, "Building product variant %u failed with %d as error code.\n", i, status);
+            return 1;
+        }
+
+        status = ofsm_builder_make_array(me, DELTA, arrays + i);
+        if (status != 0) {
+            fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+            return 1;
+        }
+    }
+
+    if (me->stack_len != 4) {
+        fprintf(stderr, "Unexpected stack length %u after products, expected 4.\n", me->stack_len);
+        return 1;
+    }
+
+    for (unsigned int i=0; i<4; i+=2) {
+        const struct ofsm_array * const a = arrays + i;
+        const struct ofsm_array * const b = arrays + i + 1;
+        if (a->len != b->len || memcmp(a->array, b->array, a->len * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "Pairwise product %u differs from n-ary one, len = %lu and %lu.\n", i, a->len, b->len);
+            return 1;
+        }
+    }
+
+    for (unsigned int i=0; i<4; ++i) {
+        free(arrays[i].array);
+    }
+
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t hole_class(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    const input_t a = path[0] < path[1] ? path[0] : path[1];
+    const input_t b = path[0] < path[1] ? path[1] : path[0];
+    return (a + b) % 4;
+}
+
+static pack_value_t board_value(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    return (7 * path[0] + path[1] + 2 * path[2]) % 9;
+}
+
+int compose_test(void)
+{
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    // Outer machine: class of hole cards and two board inputs
+    status = 0
+        || ofsm_builder_push_pow(me, 4, 1)
+        || ofsm_builder_push_pow(me, 5, 2)
+        || ofsm_builder_product(me)
+        || ofsm_builder_pack(me, board_value, PACK_FLAG__SKIP_RENUMERING)
+        || ofsm_builder_optimize(me, 3, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building outer OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array outer;
+    status = ofsm_builder_make_array(me, 0, &outer);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    // Inner machine: two hole cards to the class
+    status = 0
+        || ofsm_builder_push_comb(me, 6, 2)
+        || ofsm_builder_pack(me, hole_class, PACK_FLAG__SKIP_RENUMERING)
+        || ofsm_builder_optimize(me, 2, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building inner OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array inner;
+    status = ofsm_builder_make_array(me, 0, &inner);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    status = ofsm_builder_compose(me);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_compose(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array composed;
+    status = ofsm_builder_make_array(me, 0, &composed);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (me->stack_len != 1 || composed.qflakes != 4) {
+        fprintf(stderr, "Unexpected composition: stack_len = %u, qflakes = %u.\n", me->stack_len, composed.qflakes);
+        return 1;
+    }
+
+    input_t c[4];
+    for (c[0]=0; c[0]<6; ++c[0])
+    for (c[1]=0; c[1]<6; ++c[1])
+    for (c[2]=0; c[2]<5; ++c[2])
+    for (c[3]=0; c[3]<5; ++c[3]) {
+        if (c[0] == c[1]) {
+            continue;
+        }
+
+        const input_t class = run_array(&inner, c);
+        const input_t board[3] = { class, c[2], c[3] };
+        const unsigned int expected = run_array(&outer, board);
+        const unsigned int value = run_array(&composed, c);
+        if (value != expected || expected != board_value(NULL, 3, board)) {
+            fprintf(stderr, "Value mismatch after compose: expected %u, got %u.\n", expected, value);
+            print_path("input =", c, 4);
+            return 1;
+        }
+    }
+
+    // Custom OFSM without flakes is empty, composition with it is rejected and keeps the stack
+    status = ofsm_builder_push_custom(me, 0, NULL, NULL);
+    if (status != 0 || ofsm_builder_compose(me) == 0 || me->stack_len != 2) {
+        fprintf(stderr, "Composition with empty OFSM is not rejected, status = %d, stack_len = %u.\n", status, me->stack_len);
+        return 1;
+    }
+
+    free(outer.array);
+    free(inner.array);
+    free(composed.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+int push_array_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const unsigned int DELTA = 1;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_comb(me, 8, NFLAKE)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building comb(8, 3) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array saved[2];
+    status = 0
+        || ofsm_builder_make_array(me, DELTA, saved + 0)
+        || ofsm_builder_export_array(me, DELTA, EXPORT_FLAG__COMPRESS_INPUTS, saved + 1)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Exporting arrays failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    for (unsigned int i=0; i<2; ++i) {
+        FILE * const f = tmpfile();
+        if (f == NULL) {
+            fprintf(stderr, "tmpfile() failed with NULL as a result.\n");
+            return 1;
+        }
+
+        status = ofsm_array_save_binary(saved + i, f, "Comb 8 3");
+        if (status != 0) {
+            fprintf(stderr, "ofsm_array_save_binary failed with %d as error code.\n", status);
+            return 1;
+        }
+
+        rewind(f);
+
+        // Readers of plain arrays compare qflakes, so they reject arrays with class tables
+        struct array_header header;
+        const int is_marked = fread(&header, 1, sizeof(header), f) == sizeof(header) && (header.qflakes & ARRAY_HEADER__CLASSES) != 0;
+        if (is_marked != (saved[i].classes != NULL)) {
+            fprintf(stderr, "Header of array %u has wrong class tables flag.\n", i);
+            return 1;
+        }
+
+        rewind(f);
+
+        char name[17];
+        struct ofsm_array loaded;
+        status = ofsm_array_load_binary(&loaded, f, name);
+        fclose(f);
+
+        if (status != 0) {
+            fprintf(stderr, "ofsm_array_load_binary failed with %d as error code.\n", status);
+            return 1;
+        }
+
+        const int is_same = 1
+            && strcmp(name, "Comb 8 3") == 0
+            && loaded.start_from == saved[i].start_from
+            && loaded.qflakes == saved[i].qflakes
+            && loaded.len == saved[i].len
+            && loaded.classes_width == saved[i].classes_width
+            && (loaded.classes == NULL) == (saved[i].classes == NULL)
+            && memcmp(loaded.array, saved[i].array, loaded.len * sizeof(uint32_t)) == 0
+            && (loaded.classes == NULL || memcmp(loaded.classes, saved[i].classes, loaded.qflakes * loaded.classes_width) == 0)
+        ;
+
+        if (!is_same) {
+            fprintf(stderr, "Loaded array %u differs from the saved one.\n", i);
+            return 1;
+        }
+
+        free(loaded.array);
+    }
+
+    // Bytes after a plain array are not class tables, a flagged array with too wide class tables is rejected
+    for (unsigned int i=0; i<2; ++i) {
+        FILE * const f = tmpfile();
+        if (f == NULL) {
+            fprintf(stderr, "tmpfile() failed with NULL as a result.\n");
+            return 1;
+        }
+
+        const uint32_t trailer = 0xFFFFFFFF;
+        status = ofsm_array_save_binary(saved + i, f, "Comb 8 3");
+        if (i != 0) {
+            fseek(f, sizeof(struct array_header) + saved[i].len * sizeof(uint32_t), SEEK_SET);
+        }
+        fwrite(&trailer, 1, sizeof(trailer), f);
+        rewind(f);
+
+        struct ofsm_array loaded;
+        const int load_status = ofsm_array_load_binary(&loaded, f, NULL);
+        fclose(f);
+
+        const int is_expected = i == 0 ? load_status == 0 && loaded.classes == NULL : load_status != 0;
+        if (status != 0 || !is_expected) {
+            fprintf(stderr, "Loading of array %u with broken trailer returns %d.\n", i, load_status);
+            return 1;
+        }
+
+        if (load_status == 0) {
+            free(loaded.array);
+        }
+    }
+
+    status = ofsm_builder_push_array(me, saved, NULL, DELTA);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_push_array(me, saved, NULL, DELTA) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array rebuilt;
+    status = ofsm_builder_make_array(me, DELTA, &rebuilt);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_get_array(me) failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (rebuilt.len != saved[0].len || memcmp(rebuilt.array, saved[0].array, rebuilt.len * sizeof(uint32_t)) != 0) {
+        fprintf(stderr, "Array of rebuilt OFSM differs from the original one, len = %lu and %lu.\n", rebuilt.len, saved[0].len);
+        return 1;
+    }
+
+    // Rebuilt OFSM can feed further operations
+    status = 0
+        || ofsm_builder_push_pow(me, 2, 1)
+        || ofsm_builder_product(me)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Product with rebuilt OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    free(rebuilt.array);
+    free(saved[0].array);
+    free(saved[1].array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static int is_same_array(const struct ofsm_array * const a, const struct ofsm_array * const b)
+{
+    return a->len == b->len && a->start_from == b->start_from && memcmp(a->array, b->array, a->len * sizeof(uint32_t)) == 0;
+}
+
+static int check_top_array(struct ofsm_builder * restrict const me, const struct ofsm_array * const expected, const char * const what)
+{
+    struct ofsm_array array;
+    const int status = ofsm_builder_make_array(me, 1, &array);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_make_array failed with %d as error code for %s.\n", status, what);
+        return 1;
+    }
+
+    const int is_same = is_same_array(&array, expected);
+    free(array.array);
+
+    if (!is_same) {
+        fprintf(stderr, "Array of %s differs from the expected one.\n", what);
+        return 1;
+    }
+
+    return 0;
+}
+
+int dup_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = 0
+        || ofsm_builder_push_comb(me, 8, NFLAKE)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building comb(8, 3) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array original;
+    status = ofsm_builder_make_array(me, 1, &original);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_make_array failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    // Three items share the same flakes, every optimize must copy before writing
+    status = 0
+        || ofsm_builder_dup(me)
+        || ofsm_builder_dup(me)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Optimizing duplicate failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array optimized;
+    status = ofsm_builder_make_array(me, 1, &optimized);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_make_array failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (optimized.len >= original.len) {
+        fprintf(stderr, "Optimized array is not shorter, len = %lu and %lu.\n", optimized.len, original.len);
+        return 1;
+    }
+
+    status = 0
+        || ofsm_builder_drop(me)
+        || check_top_array(me, &original, "first duplicate")
+        || ofsm_builder_split(me, 2, 2, 4, NULL)
+        || ofsm_builder_drop(me)
+        || check_top_array(me, &original, "original")
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+        || check_top_array(me, &optimized, "optimized original")
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Checking items after dup failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (me->stack_len != 1 || ofsm_builder_drop(me) != 0 || ofsm_builder_drop(me) == 0) {
+        fprintf(stderr, "Unexpected stack after dropping duplicates.\n");
+        return 1;
+    }
+
+    free(original.array);
+    free(optimized.array);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t plain_sum(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    pack_value_t sum = 0;
+    for (unsigned int i=0; i<n; ++i) {
+        sum += path[i];
+    }
+    return sum;
+}
+
+static double segment_error(const unsigned int * const weights, const unsigned int from, const unsigned int to)
+{
+    double w = 0, wx = 0;
+    for (unsigned int x = from; x < to; ++x) {
+        w += weights[x];
+        wx += weights[x] * (double)x;
+    }
+
+    double result = 0;
+    for (unsigned int x = from; x < to; ++x) {
+        const double d = x - wx / w;
+        result += weights[x] * d * d;
+    }
+    return result;
+}
+
+int buckets_test(void)
+{
+    static const unsigned int NFLAKE = 3;
+    static const unsigned int QBUCKETS = 4;
+    static const unsigned int QSUMS = 22;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    double error = -1;
+    status = 0
+        || ofsm_builder_push_comb(me, 8, NFLAKE)
+        || ofsm_builder_pack_buckets(me, plain_sum, QBUCKETS, &error)
+        || ofsm_builder_optimize(me, NFLAKE, 0, NULL)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Building bucketed comb(8, 3) OFSM failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    const void * const ofsm = ofsm_builder_get_ofsm(me);
+
+    unsigned int weights[QSUMS];
+    state_t bucket_of_sum[QSUMS];
+    memset(weights, 0, sizeof(weights));
+    for (unsigned int i=0; i<QSUMS; ++i) {
+        bucket_of_sum[i] = INVALID_STATE;
+    }
+
+    unsigned int total = 0;
+    input_t c[NFLAKE];
+    for (c[0]=0; c[0]<8; ++c[0])
+    for (c[1]=c[0]+1; c[1]<8; ++c[1])
+    for (c[2]=c[1]+1; c[2]<8; ++c[2]) {
+        const unsigned int sum = c[0] + c[1] + c[2];
+        const state_t state = ofsm_execute(ofsm, NFLAKE, c);
+
+        if (state >= QBUCKETS) {
+            fprintf(stderr, "Invalid bucket %u, expected less than %u.\n", state, QBUCKETS);
+            print_path("input =", c, NFLAKE);
+            return 1;
+        }
+
+        if (bucket_of_sum[sum] != INVALID_STATE && bucket_of_sum[sum] != state) {
+            fprintf(stderr, "Sum %u is mapped to buckets %u and %u.\n", sum, bucket_of_sum[sum], state);
+            return 1;
+        }
+
+        bucket_of_sum[sum] = state;
+        ++weights[sum];
+        ++total;
+    }
+
+    // Buckets are contiguous ranges of sums in increasing order
+    state_t last = 0;
+    for (unsigned int sum = 0; sum < QSUMS; ++sum) {
+        if (bucket_of_sum[sum] == INVALID_STATE) continue;
+        if (bucket_of_sum[sum] < last || bucket_of_sum[sum] > last + 1) {
+            fprintf(stderr, "Bucket %u of sum %u breaks the order, previous is %u.\n", bucket_of_sum[sum], sum, last);
+            return 1;
+        }
+        last = bucket_of_sum[sum];
+    }
+
+    // Brute force over all cuts of sums 3 - 18 into four ranges
+    double best = -1;
+    for (unsigned int a = 4; a < 19; ++a)
+    for (unsigned int b = a + 1; b < 19; ++b)
+    for (unsigned int d = b + 1; d < 19; ++d) {
+        const double value = 0
+            + segment_error(weights, 3, a)
+            + segment_error(weights, a, b)
+            + segment_error(weights, b, d)
+            + segment_error(weights, d, 19)
+        ;
+        if (best < 0 || value < best) {
+            best = value;
+        }
+    }
+
+    const double expected = best / total;
+    if (error < expected - 1e-9 || error > expected + 1e-9) {
+        fprintf(stderr, "Reported error %g differs from optimal %g.\n", error, expected);
+        return 1;
+    }
+
+    // Operation restored from checkpoint is not calculated, its error is unknown
+    me->qskip = 1;
+    status = ofsm_builder_pack_buckets(me, plain_sum, QBUCKETS, &error);
+    if (status != 0 || !isnan(error)) {
+        fprintf(stderr, "Skipped bucket packing returns %d with error %g.\n", status, error);
+        return 1;
+    }
+
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static int checkpoint_pipeline(struct ofsm_builder * restrict const me, const unsigned int qsteps)
+{
+    return 0
+        || (qsteps > 0 && ofsm_builder_push_comb(me, 8, 3))
+        || (qsteps > 1 && ofsm_builder_pack(me, sum_mod5, 0))
+        || (qsteps > 2 && ofsm_builder_dup(me))
+        || (qsteps > 3 && ofsm_builder_drop(me))
+        || (qsteps > 4 && ofsm_builder_optimize(me, 3, 0, NULL))
+    ;
+}
+
+int checkpoint_test(void)
+{
+    static const unsigned int QSTEPS = 5;
+
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+
+    status = checkpoint_pipeline(me, QSTEPS);
+    if (status != 0) {
+        fprintf(stderr, "Reference pipeline failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_array expected;
+    status = ofsm_builder_make_array(me, 1, &expected);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_make_array failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    free_ofsm_builder(me);
+
+    char path[] = "/tmp/yoo-ofsm-checkpoint-XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp(\"%s\") failed.\n", path);
+        return 1;
+    }
+    close(fd);
+
+    // Interrupted run: only the first steps are done, every one is checkpointed
+    struct ofsm_builder * restrict const first = create_ofsm_builder(NULL, stderr);
+    if (first == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    first->checkpoint_path = path;
+    status = checkpoint_pipeline(first, 3);
+    free_ofsm_builder(first);
+    if (status != 0) {
+        fprintf(stderr, "Interrupted pipeline failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_builder * restrict const second = create_ofsm_builder(NULL, stderr);
+    if (second == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    second->flags |= OBF__AUTO_VERIFY;
+
+    FILE * f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Checkpoint file “%s” is not created.\n", path);
+        return 1;
+    }
+
+    status = ofsm_builder_load_checkpoint(second, f);
+    fclose(f);
+    if (status != 0 || second->stack_len != 2 || second->qskip != 3) {
+        fprintf(stderr, "ofsm_builder_load_checkpoint failed, status = %d, stack_len = %u, qskip = %u.\n", status, second->stack_len, second->qskip);
+        return 1;
+    }
+
+    second->checkpoint_path = path;
+    status = checkpoint_pipeline(second, QSTEPS);
+    if (status != 0 || second->qops != QSTEPS) {
+        fprintf(stderr, "Resumed pipeline failed, status = %d, qops = %u.\n", status, second->qops);
+        return 1;
+    }
+
+    struct ofsm_array resumed;
+    status = ofsm_builder_make_array(second, 1, &resumed);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_make_array failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (!is_same_array(&resumed, &expected)) {
+        fprintf(stderr, "Resumed pipeline gives another array.\n");
+        return 1;
+    }
+
+    // Flip one byte in the middle of the final checkpoint, loading must fail and keep the stack
+    f = fopen(path, "r+b");
+    if (f == NULL) {
+        fprintf(stderr, "fopen(“%s”, “r+b”) failed.\n", path);
+        return 1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    const long file_sz = ftell(f);
+    fseek(f, file_sz / 2, SEEK_SET);
+    const int byte = fgetc(f);
+    fseek(f, file_sz / 2, SEEK_SET);
+    fputc(byte ^ 0x5A, f);
+    rewind(f);
+
+    status = ofsm_builder_load_checkpoint(second, f);
+    fclose(f);
+    remove(path);
+
+    if (status == 0 || second->stack_len != 1) {
+        fprintf(stderr, "Corrupted checkpoint is loaded, status = %d, stack_len = %u.\n", status, second->stack_len);
+        return 1;
+    }
+
+    free(expected.array);
+    free(resumed.array);
+    free_ofsm_builder(second);
+    return 0;
+}
+
+
+
+static int async_build(struct ofsm_builder * const me, void * const args)
+{
+    return 0
+        || ofsm_builder_push_comb(me, 16, 4)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_optimize(me, 4, 0, NULL)
+    ;
+}
+
+static int async_endless(struct ofsm_builder * const me, void * const args)
+{
+    for (;;) {
+        const int status = 0
+            || ofsm_builder_push_comb(me, 16, 4)
+            || ofsm_builder_pack(me, sum_mod5, 0)
+            || ofsm_builder_drop(me)
+        ;
+
+        if (status != 0) {
+            return status;
+        }
+    }
+}
+
+int async_test(void)
+{
+    int status;
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    if (ofsm_builder_get_status(me, NULL) != STATUS__NEW) {
+        fprintf(stderr, "New builder has status %d.\n", ofsm_builder_get_status(me, NULL));
+        return 1;
+    }
+
+    status = ofsm_builder_start(me, async_build, NULL);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_start failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    double progress = 0;
+    while (ofsm_builder_get_status(me, &progress) == STATUS__EXECUTING) {
+        if (progress < 0 || progress > 1) {
+            fprintf(stderr, "Progress %g is out of range.\n", progress);
+            return 1;
+        }
+        usleep(100);
+    }
+
+    status = ofsm_builder_wait(me);
+    const int final_status = ofsm_builder_get_status(me, &progress);
+    if (status != 0 || final_status != STATUS__DONE || progress != 1.0) {
+        fprintf(stderr, "Async build failed, result = %d, status = %d, progress = %g.\n", status, final_status, progress);
+        return 1;
+    }
+
+    struct ofsm_array async_array;
+    status = ofsm_builder_make_array(me, 1, &async_array);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_make_array failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_builder * restrict const sync = create_ofsm_builder(NULL, stderr);
+    if (sync == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    struct ofsm_array sync_array;
+    status = async_build(sync, NULL) || ofsm_builder_make_array(sync, 1, &sync_array);
+    if (status != 0) {
+        fprintf(stderr, "Synchronous build failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (!is_same_array(&async_array, &sync_array)) {
+        fprintf(stderr, "Async and sync builds differ.\n");
+        return 1;
+    }
+
+    // Endless task stops only by cancellation
+    status = ofsm_builder_start(me, async_endless, NULL);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_start failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    usleep(10000);
+    ofsm_builder_cancel(me);
+
+    status = ofsm_builder_wait(me);
+    if (status == 0 || ofsm_builder_get_status(me, NULL) != STATUS__INTERRUPTED) {
+        fprintf(stderr, "Cancelled task returns %d with status %d.\n", status, ofsm_builder_get_status(me, NULL));
+        return 1;
+    }
+
+    free(async_array.array);
+    free(sync_array.array);
+    free_ofsm_builder(sync);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static int deferred_pipeline(struct ofsm_builder * restrict const me)
+{
+    return 0
+        || ofsm_builder_push_comb(me, 10, 3)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_optimize(me, 3, 0, NULL)
+        || ofsm_builder_push_pow(me, 3, 2)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_product(me)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_optimize(me, 5, 0, NULL)
+    ;
+}
+
+int deferred_test(void)
+{
+    int status;
+
+    struct ofsm_builder * restrict const direct = create_ofsm_builder(NULL, stderr);
+    if (direct == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    direct->flags |= OBF__AUTO_VERIFY;
+
+    struct ofsm_array expected;
+    status = deferred_pipeline(direct) || ofsm_builder_make_array(direct, 1, &expected);
+    if (status != 0) {
+        fprintf(stderr, "Direct pipeline failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY | OBF__DEFERRED;
+
+    status = deferred_pipeline(me);
+    if (status != 0 || me->stack_len != 0) {
+        fprintf(stderr, "Recording failed, status = %d, stack_len = %u.\n", status, me->stack_len);
+        return 1;
+    }
+
+    status = ofsm_builder_execute(me);
+    if (status != 0 || me->stack_len != 1 || me->qops != 8) {
+        fprintf(stderr, "ofsm_builder_execute failed, status = %d, stack_len = %u, qops = %u.\n", status, me->stack_len, me->qops);
+        return 1;
+    }
+
+    struct ofsm_array deferred;
+    status = ofsm_builder_make_array(me, 1, &deferred);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_make_array failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (!is_same_array(&deferred, &expected)) {
+        fprintf(stderr, "Deferred pipeline gives another array.\n");
+        return 1;
+    }
+
+    // Existing item joins the graph, dup executes recorded operations first
+    status = 0
+        || ofsm_builder_push_pow(me, 2, 1)
+        || ofsm_builder_product(me)
+        || ofsm_builder_dup(me)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_execute(me)
+    ;
+
+    if (status != 0 || me->stack_len != 2) {
+        fprintf(stderr, "Deferred product with existing item failed, status = %d, stack_len = %u.\n", status, me->stack_len);
+        return 1;
+    }
+
+    status = 0
+        || ofsm_builder_push_pow(direct, 2, 1)
+        || ofsm_builder_product(direct)
+        || ofsm_builder_pack(direct, sum_mod5, 0)
+    ;
+
+    free(expected.array);
+    status = status || ofsm_builder_make_array(direct, 1, &expected) || check_top_array(me, &expected, "deferred product");
+    if (status != 0) {
+        fprintf(stderr, "Deferred product with existing item differs from the direct one.\n");
+        return 1;
+    }
+
+    free(expected.array);
+    free(deferred.array);
+    free_ofsm_builder(direct);
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+static pack_value_t counted_sum_mod5(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    ++*(unsigned int *)user_data;
+    return sum_mod5(NULL, n, path);
+}
+
+static pack_value_t counted_sum_mod3(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    ++*(unsigned int *)user_data;
+    unsigned int sum = 0;
+    for (unsigned int i=0; i<n; ++i) {
+        sum += path[i];
+    }
+    return sum % 3;
+}
+
+static int run_cached(const char * const cache_dir, const char * const tag, const unsigned int qlast, pack_func f, const char * const name, unsigned int * restrict const qcalls, struct ofsm_array * restrict const out)
+{
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+    me->cache_dir = cache_dir;
+    me->cache_tag = tag;
+    me->user_data = qcalls;
+
+    *qcalls = 0;
+    const int status = 0
+        || (name != NULL && ofsm_builder_name_callback(me, (const void *)f, name))
+        || ofsm_builder_push_comb(me, 8, 3)
+        || ofsm_builder_pack(me, f, 0)
+        || ofsm_builder_optimize(me, 3, qlast, NULL)
+        || ofsm_builder_make_array(me, 1, out)
+    ;
+
+    free_ofsm_builder(me);
+    return status;
+}
+
+static unsigned int count_cache_files(const char * const cache_dir)
+{
+    char cmd[256];
+    sprintf(cmd, "ls %s | wc -l", cache_dir);
+    FILE * const f = popen(cmd, "r");
+    unsigned int result = 0;
+    if (f != NULL) {
+        if (fscanf(f, "%u", &result) != 1) {
+            result = 0;
+        }
+        pclose(f);
+    }
+    return result;
+}
+
+int cache_test(void)
+{
+    int status;
+
+    char cache_dir[] = "/tmp/yoo-ofsm-cache-XXXXXX";
+    if (mkdtemp(cache_dir) == NULL) {
+        fprintf(stderr, "mkdtemp(\"%s\") failed.\n", cache_dir);
+        return 1;
+    }
+
+    struct ofsm_array arrays[6];
+    unsigned int qcalls[6];
+
+    status = 0
+        || run_cached(cache_dir, "v1", 0, counted_sum_mod5, "sum_mod5", qcalls + 0, arrays + 0)
+        || run_cached(cache_dir, "v1", 0, counted_sum_mod5, "sum_mod5", qcalls + 1, arrays + 1)
+        || run_cached(cache_dir, "v1", 1, counted_sum_mod5, "sum_mod5", qcalls + 2, arrays + 2)
+        || run_cached(cache_dir, "v2", 0, counted_sum_mod5, "sum_mod5", qcalls + 3, arrays + 3)
+        || run_cached(cache_dir, "v1", 0, counted_sum_mod3, "sum_mod3", qcalls + 4, arrays + 4)
+        || run_cached(cache_dir, "v1", 0, counted_sum_mod5, NULL, qcalls + 5, arrays + 5)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Cached pipelines failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    /*
+     * First run fills the cache, second one loads everything, third one repeats only optimize.
+     * Other callback after the same push misses the pack entry, unnamed callback is never cached
+     * and optimize after it is keyed by the stack content.
+     */
+    const unsigned int qfiles = count_cache_files(cache_dir);
+    const int is_ok = 1
+        && qcalls[0] > 0 && qcalls[1] == 0 && qcalls[2] == 0 && qcalls[3] == qcalls[0]
+        && qcalls[4] == qcalls[0] && qcalls[5] == qcalls[0]
+        && is_same_array(arrays + 0, arrays + 1)
+        && is_same_array(arrays + 0, arrays + 3)
+        && !is_same_array(arrays + 0, arrays + 4)
+        && is_same_array(arrays + 0, arrays + 5)
+        && arrays[2].len >= arrays[0].len
+        && qfiles == 3 + 1 + 3 + 2 + 1
+    ;
+
+    if (!is_ok) {
+        fprintf(stderr, "Unexpected cache behaviour, pack calls %u %u %u %u %u %u, %u files.\n", qcalls[0], qcalls[1], qcalls[2], qcalls[3], qcalls[4], qcalls[5], qfiles);
+        return 1;
+    }
+
+    char cmd[256];
+    sprintf(cmd, "rm -rf %s", cache_dir);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Can not remove cache directory “%s”.\n", cache_dir);
+    }
+
+    for (unsigned int i = 0; i < 6; ++i) {
+        free(arrays[i].array);
+    }
+
+    return 0;
+}
+
+
+
+static pack_value_t crash_once_sum_mod5(void * const user_data, const unsigned int n, const input_t * const path)
+{
+    // Every worker that does not see the marker creates it and dies, so the first attempt of some shards fails
+    const char * const marker = user_data;
+    if (access(marker, F_OK) != 0) {
+        FILE * const f = fopen(marker, "w");
+        if (f != NULL) {
+            fclose(f);
+        }
+        abort();
+    }
+
+    return sum_mod5(NULL, n, path);
+}
+
+int shard_test(void)
+{
+    int status;
+
+    char shard_dir[] = "/tmp/yoo-ofsm-shard-XXXXXX";
+    if (mkdtemp(shard_dir) == NULL) {
+        fprintf(stderr, "mkdtemp(\"%s\") failed.\n", shard_dir);
+        return 1;
+    }
+
+    char marker[sizeof(shard_dir) + 16];
+    sprintf(marker, "%s/crashed", shard_dir);
+
+    for (unsigned int flags = 0; flags <= PACK_FLAG__SKIP_RENUMERING; ++flags) {
+
+        struct ofsm_builder * restrict const direct = create_ofsm_builder(NULL, stderr);
+        struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+        if (direct == NULL || me == NULL) {
+            fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+            return 1;
+        }
+
+        me->flags |= OBF__AUTO_VERIFY;
+        me->shard_dir = shard_dir;
+        me->qshards = 7;
+        me->user_data = marker;
+        remove(marker);
+
+        struct ofsm_array expected;
+        status = 0
+            || ofsm_builder_push_comb(direct, 16, 4)
+            || ofsm_builder_pack(direct, sum_mod5, flags)
+            || ofsm_builder_make_array(direct, 1, &expected)
+            || ofsm_builder_push_comb(me, 16, 4)
+            || ofsm_builder_pack(me, crash_once_sum_mod5, flags)
+        ;
+
+        if (status != 0) {
+            fprintf(stderr, "Sharded pack with flags %u failed with %d as error code.\n", flags, status);
+            return 1;
+        }
+
+        status = check_top_array(me, &expected, "sharded pack");
+        if (status != 0) {
+            return 1;
+        }
+
+        free(expected.array);
+        free_ofsm_builder(direct);
+        free_ofsm_builder(me);
+    }
+
+    // Only the crash marker is left, all shard files are removed
+    remove(marker);
+    if (rmdir(shard_dir) != 0) {
+        fprintf(stderr, "Shard directory “%s” is not empty after packing.\n", shard_dir);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+
+static uint64_t sum_path_hash(void * const user_data, const unsigned int qjumps, const state_t * jumps, const unsigned int path_len, const input_t * const path)
+{
+    return sum_mod5(NULL, path_len, path);
+}
+
+static int is_same_comb_results(const void * const a, const void * const b, const input_t qinputs)
+{
+    input_t inputs[4];
+    for (inputs[0] = 0; inputs[0] < qinputs; ++inputs[0])
+    for (inputs[1] = 0; inputs[1] < qinputs; ++inputs[1])
+    for (inputs[2] = 0; inputs[2] < qinputs; ++inputs[2])
+    for (inputs[3] = 0; inputs[3] < qinputs; ++inputs[3]) {
+        const int is_distinct = 1
+            && inputs[0] != inputs[1] && inputs[0] != inputs[2] && inputs[0] != inputs[3]
+            && inputs[1] != inputs[2] && inputs[1] != inputs[3]
+            && inputs[2] != inputs[3]
+        ;
+
+        if (is_distinct && ofsm_execute(a, 4, inputs) != ofsm_execute(b, 4, inputs)) {
+            fprintf(stderr, "Results differ for inputs %u %u %u %u.\n", inputs[0], inputs[1], inputs[2], inputs[3]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int autotune_test(void)
+{
+    static const input_t QINPUTS = 10;
+
+    int status;
+
+    struct ofsm_builder * restrict const direct = create_ofsm_builder(NULL, stderr);
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    struct ofsm_builder * restrict const replay = create_ofsm_builder(NULL, stderr);
+    if (direct == NULL || me == NULL || replay == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    // Trials run immediately even in deferred mode, the chosen recipe is recorded as usual
+    me->flags |= OBF__AUTO_VERIFY | OBF__DEFERRED;
+    replay->flags |= OBF__AUTO_VERIFY;
+
+    const struct ofsm_tune_hash hashes[1] = { { sum_path_hash, 3 } };
+    struct ofsm_recipe recipe;
+
+    status = 0
+        || ofsm_builder_push_comb(direct, QINPUTS, 4)
+        || ofsm_builder_pack(direct, sum_mod5, 0)
+        || ofsm_builder_push_comb(me, QINPUTS, 4)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_autotune(me, 1, hashes, 0, &recipe)
+        || ofsm_builder_execute(me)
+        || ofsm_builder_push_comb(replay, QINPUTS, 4)
+        || ofsm_builder_pack(replay, sum_mod5, 0)
+        || ofsm_builder_apply_recipe(replay, &recipe)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Autotune pipeline failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (recipe.qsteps == 0 || recipe.len >= recipe.base_len || me->stack_len != 1) {
+        fprintf(stderr, "Autotune did not improve export length, %u steps, %lu -> %lu.\n", recipe.qsteps, recipe.base_len, recipe.len);
+        return 1;
+    }
+
+    struct ofsm_array tuned;
+    status = ofsm_builder_make_array(me, 1, &tuned);
+    if (status != 0 || tuned.len != recipe.len) {
+        fprintf(stderr, "Export length %lu of tuned OFSM differs from the recipe one %lu.\n", tuned.len, recipe.len);
+        return 1;
+    }
+
+    status = check_top_array(replay, &tuned, "replayed recipe");
+    if (status != 0) {
+        return 1;
+    }
+
+    if (!is_same_comb_results(ofsm_builder_get_ofsm(direct), ofsm_builder_get_ofsm(me), QINPUTS)) {
+        fprintf(stderr, "Tuned OFSM calculates different values.\n");
+        return 1;
+    }
+
+    free(tuned.array);
+    free_ofsm_builder(direct);
+    free_ofsm_builder(me);
+    free_ofsm_builder(replay);
+    return 0;
+}
+
+
+
+static int last_checked_flakes(FILE * const log, char * const * const buf)
+{
+    // Buffer of memory stream is valid only after flush
+    fflush(log);
+    const char * const mark = "DONE verification of changed flakes, ";
+    const char * found = NULL;
+    for (const char * ptr = strstr(*buf, mark); ptr != NULL; ptr = strstr(ptr + 1, mark)) {
+        found = ptr;
+    }
+
+    return found != NULL ? atoi(found + strlen(mark)) : -1;
+}
+
+int incremental_verify_test(void)
+{
+    char * buf = NULL;
+    size_t sz = 0;
+    FILE * const log = open_memstream(&buf, &sz);
+    if (log == NULL) {
+        fprintf(stderr, "open_memstream failed.\n");
+        return 1;
+    }
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY;
+    me->logstream = log;
+
+    // Pack replaces the last flake, optimize rewrites the flake and the previous one, product appends four new flakes
+    int qchecked[4];
+    int status = 0;
+    status = status || ofsm_builder_push_comb(me, 10, 4);
+    qchecked[0] = last_checked_flakes(log, &buf);
+    status = status || ofsm_builder_pack(me, sum_mod5, 0);
+    qchecked[1] = last_checked_flakes(log, &buf);
+    status = status || ofsm_builder_optimize(me, 4, 1, NULL);
+    qchecked[2] = last_checked_flakes(log, &buf);
+    status = status || ofsm_builder_dup(me) || ofsm_builder_product(me);
+    qchecked[3] = last_checked_flakes(log, &buf);
+
+    if (status != 0) {
+        fprintf(stderr, "Pipeline failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (qchecked[0] != 4 || qchecked[1] != 1 || qchecked[2] != 2 || qchecked[3] != 4) {
+        fprintf(stderr, "Unexpected count of verified flakes: %d %d %d %d.\n", qchecked[0], qchecked[1], qchecked[2], qchecked[3]);
+        return 1;
+    }
+
+    status = ofsm_builder_verify(me);
+    if (status != 0) {
+        fprintf(stderr, "Full verification failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    me->logstream = NULL;
+    free_ofsm_builder(me);
+    fclose(log);
+    free(buf);
+    return 0;
+}
+
+
+
+int parallel_verify_test(void)
+{
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    // Flakes with hundreds of thousands outputs are split in many chunks between four threads
+    me->flags |= OBF__AUTO_VERIFY;
+    me->qthreads = 4;
+
+    const int status = 0
+        || ofsm_builder_push_comb(me, 40, 5)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+        || ofsm_builder_optimize(me, 5, 0, NULL)
+        || ofsm_builder_verify(me)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Verified pipeline failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+int sampled_verify_test(void)
+{
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->flags |= OBF__AUTO_VERIFY_SAMPLED;
+    me->verify_samples = 100;
+
+    int status = 0
+        || ofsm_builder_push_comb(me, 20, 4)
+        || ofsm_builder_pack(me, sum_mod5, 0)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "Pipeline with sampled verification failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    // Flakes have 20, 190, 1140 and 5 outputs
+    uint64_t qchecked[3];
+    status = 0
+        || ofsm_builder_verify_sampled(me, 100, 0, qchecked + 0)
+        || ofsm_builder_verify_sampled(me, 0, 0, qchecked + 1)
+        || ofsm_builder_verify_sampled(me, 0, 1e-9, qchecked + 2)
+    ;
+
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_verify_sampled failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    if (qchecked[0] != 20 + 100 + 100 + 5 || qchecked[1] != 20 + 190 + 1140 + 5 || qchecked[2] > qchecked[1]) {
+        fprintf(stderr, "Unexpected sample counts %lu, %lu, %lu.\n", qchecked[0], qchecked[1], qchecked[2]);
+        return 1;
+    }
+
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+/*
+ * Checkpoint of push_comb(n, k) with zeroed inputs at the end of the last flake paths,
+ * the checksum is updated, so the broken OFSM is loaded as is.
+ */
+static struct ofsm_builder * create_broken_builder(FILE * const errstream, const input_t n, const unsigned int k, const size_t qbroken)
+{
+    struct ofsm_builder * restrict const source = create_ofsm_builder(NULL, stderr);
+    FILE * const f = tmpfile();
+    if (source == NULL || f == NULL) {
+        fprintf(stderr, "create_ofsm_builder or tmpfile failed with NULL as a error value.\n");
+        return NULL;
+    }
+
+    int status = 0
+        || ofsm_builder_push_comb(source, n, k)
+        || ofsm_builder_save_checkpoint(source, f)
+    ;
+
+    free_ofsm_builder(source);
+
+    const long file_sz = ftell(f);
+    uint8_t * restrict const data = malloc(file_sz);
+    if (status != 0 || data == NULL) {
+        fprintf(stderr, "Saving of checkpoint failed, status = %d.\n", status);
+        return NULL;
+    }
+
+    rewind(f);
+    status = fread(data, 1, file_sz, f) != (size_t)file_sz;
+
+    const size_t checksum_pos = file_sz - sizeof(uint64_t);
+    memset(data + checksum_pos - qbroken * sizeof(input_t), 0, qbroken * sizeof(input_t));
+
+    uint64_t checksum = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < checksum_pos; ++i) {
+        checksum ^= data[i];
+        checksum *= 0x100000001B3ull;
+    }
+    memcpy(data + checksum_pos, &checksum, sizeof(checksum));
+
+    rewind(f);
+    status = status || fwrite(data, 1, file_sz, f) != (size_t)file_sz;
+    free(data);
+    rewind(f);
+
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, errstream);
+    status = status || me == NULL || ofsm_builder_load_checkpoint(me, f);
+    fclose(f);
+
+    if (status != 0) {
+        fprintf(stderr, "Loading of broken checkpoint failed, status = %d.\n", status);
+        return NULL;
+    }
+
+    return me;
+}
+
+int sampled_verify_failure_test(void)
+{
+    char * buf = NULL;
+    size_t sz = 0;
+    FILE * const errstream = open_memstream(&buf, &sz);
+    if (errstream == NULL) {
+        fprintf(stderr, "open_memstream failed.\n");
+        return 1;
+    }
+
+    // Every path of the last flake with 4845 outputs is broken, so any sample fails
+    struct ofsm_builder * restrict const me = create_broken_builder(errstream, 20, 4, 4845 * 4);
+    if (me == NULL) {
+        return 1;
+    }
+
+    me->qthreads = 4;
+
+    uint64_t qchecked;
+    const int status = ofsm_builder_verify_sampled(me, 100, 0, &qchecked);
+    fflush(errstream);
+
+    if (status == 0 || strstr(buf, "Input:") == NULL) {
+        fprintf(stderr, "Sampled verification of broken paths gives status %d and report:\n%s", status, buf);
+        return 1;
+    }
+
+    free_ofsm_builder(me);
+    fclose(errstream);
+    free(buf);
+    return 0;
+}
+
+
+
+static int deferred_cancelled_build(struct ofsm_builder * restrict const me, void * const args)
+{
+    me->flags |= OBF__DEFERRED;
+    const int status = deferred_pipeline(me);
+    me->flags &= ~OBF__DEFERRED;
+
+    // Branches run in sub-builders, they must see cancellation of the parent task
+    ofsm_builder_cancel(me);
+    return status || ofsm_builder_execute(me);
+}
+
+int deferred_cancel_test(void)
+{
+    struct ofsm_builder * restrict const me = create_ofsm_builder(NULL, stderr);
+    if (me == NULL) {
+        fprintf(stderr, "create_ofsm_builder failed with NULL as a error value.");
+        return 1;
+    }
+
+    me->qthreads = 3;
+
+    int status = ofsm_builder_start(me, deferred_cancelled_build, NULL);
+    if (status != 0) {
+        fprintf(stderr, "ofsm_builder_start failed with %d as error code.\n", status);
+        return 1;
+    }
+
+    status = ofsm_builder_wait(me);
+    if (status == 0 || ofsm_builder_get_status(me, NULL) != STATUS__INTERRUPTED || me->stack_len != 0) {
+        fprintf(stderr, "Cancelled deferred task returns %d with status %d, stack_len = %u.\n", status, ofsm_builder_get_status(me, NULL), me->stack_len);
+        return 1;
+    }
+
+    free_ofsm_builder(me);
+    return 0;
+}
+
+
+
+int parallel_verify_failure_test(void)
+{
+    char * buf = NULL;
+    size_t sz = 0;
+    FILE * const errstream = open_memstream(&buf, &sz);
+    if (errstream == NULL) {
+        fprintf(stderr, "open_memstream failed.\n");
+        return 1;
+    }
+
+    // Only the last input of the last output path 39 38 37 36 35 is zeroed, it is checked in one of four threads
+    struct ofsm_builder * restrict const me = create_broken_builder(errstream, 40, 5, 1);
+    if (me == NULL) {
+        return 1;
+    }
+
+    me->qthreads = 4;
+
+    const int status = ofsm_builder_verify(me);
+    fflush(errstream);
+
+    if (status == 0 || strstr(buf, "Input: 39 38 37 36 0") == NULL) {
+        fprintf(stderr, "Parallel verification of broken path gives status %d and report:\n%s", status, buf);
+        return 1;
+    }
+
+    free_ofsm_builder(me);
+    fclose(errstream);
+    free(buf);
+    return 0;
+}